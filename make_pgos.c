@@ -1,6 +1,11 @@
 /* make_pgos.c
 Simply runs through each of the most common code paths for PGO purposes
 (C) 2010 Niall Douglas
+
+As well as uniform sizes on one thread, it trains with the small object sizes C++
+programs mostly allocate, blocks grown by realloc() as strings and vectors are, several
+threads at once and blocks freed by threads other than the one which allocated them,
+so the profile matches what servers actually do.
 */
 
 #define _CRT_SECURE_NO_WARNINGS 1	/* Don't care about MSVC warnings on POSIX functions */
@@ -8,8 +13,53 @@ Simply runs through each of the most common code paths for PGO purposes
 #include <stdlib.h>
 #include <assert.h>
 #include "nedmalloc.h"
+#ifdef WIN32
+#define WIN32_LEAN_AND_MEAN 1
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
 
 #define RECORDS 100000
+#define THREADS 4
+#define THREADRECORDS 10000
+#define GROWABLES 1000
+
+static void threadcode(int);
+#ifdef WIN32
+static DWORD WINAPI _threadcode(LPVOID a)
+{
+	threadcode((int)(size_t) a);
+	return 0;
+}
+#define THREADVAR HANDLE
+#define THREADINIT(v, id) (*v=CreateThread(NULL, 0, _threadcode, (LPVOID)(size_t) id, 0, NULL))
+#define THREADWAIT(v) (WaitForSingleObject(v, INFINITE), CloseHandle(v))
+#else
+static void *_threadcode(void *a)
+{
+	threadcode((int)(size_t) a);
+	return 0;
+}
+#define THREADVAR pthread_t
+#define THREADINIT(v, id) pthread_create(v, NULL, _threadcode, (void *)(size_t) id)
+#define THREADWAIT(v) pthread_join(v, NULL)
+#endif
+
+static unsigned int myrandom(unsigned int *seed)
+{
+	*seed=1664525UL*(*seed)+1013904223UL;
+	return *seed>>8;
+}
+/* Most blocks C++ allocates are small objects and only a few are buffers */
+static size_t cppsize(unsigned int *seed)
+{
+	unsigned int r=myrandom(seed)%100;
+	if(r<60) return 16+myrandom(seed)%48;
+	if(r<90) return 64+myrandom(seed)%192;
+	if(r<99) return 256+myrandom(seed)%3840;
+	return 4096+myrandom(seed)%61440;
+}
 
 static void run(size_t maxsize, size_t records, size_t loops)
 {
@@ -43,8 +93,109 @@ static void run(size_t maxsize, size_t records, size_t loops)
 	}
 }
 
+static void cppobjects(void **mem, size_t records, size_t loops, unsigned int seed)
+{
+	size_t n, m;
+	for(m=0; m<loops; m++)
+	{
+		for(n=0; n<records; n++)
+		{
+			unsigned int r=myrandom(&seed);
+			size_t size=cppsize(&seed);
+			if(mem[n])
+			{
+				nedfree(mem[n]);
+				mem[n]=0;
+			}
+			if(!(r & 15))
+				mem[n]=nedcalloc(1, size);
+			else if(!(r & 63))
+				mem[n]=nedmemalign(64, size);
+			else if(r & 1)
+				mem[n]=nedmalloc(size);
+		}
+	}
+	for(n=0; n<records; n++)
+	{
+		if(mem[n])
+		{
+			nedfree(mem[n]);
+			mem[n]=0;
+		}
+	}
+}
+
+static void growables(size_t loops)
+{
+	static void *mem[GROWABLES];
+	static size_t sizes[GROWABLES];
+	unsigned int seed=1;
+	size_t n, m;
+	for(m=0; m<loops; m++)
+	{
+		for(n=0; n<GROWABLES; n++)
+		{
+			unsigned int r=myrandom(&seed);
+			if(!sizes[n] || sizes[n]>1024*1024)
+				sizes[n]=cppsize(&seed);	/* Start again */
+			else if(r & 1)
+				sizes[n]+=1+r%64;			/* Appending to a string */
+			else if(r & 6)
+				sizes[n]*=2;				/* A vector growing */
+			else
+				sizes[n]/=2;				/* shrink_to_fit() */
+			mem[n]=nedrealloc(mem[n], sizes[n]);
+		}
+	}
+	for(n=0; n<GROWABLES; n++)
+	{
+		nedfree(mem[n]);
+		mem[n]=0;
+		sizes[n]=0;
+	}
+}
+
+static void *threadmem[THREADS][THREADRECORDS];
+static int threadphase;
+static void threadcode(int threadidx)
+{
+	size_t n;
+	unsigned int seed=threadidx+1;
+	switch(threadphase)
+	{
+	case 0:
+		cppobjects(threadmem[threadidx], THREADRECORDS, 50, seed);
+		break;
+	case 1:
+		for(n=0; n<THREADRECORDS; n++)
+			threadmem[threadidx][n]=nedmalloc(cppsize(&seed));
+		break;
+	case 2:
+		{	/* Free what the next thread allocated */
+			void **mem=threadmem[(threadidx+1)%THREADS];
+			for(n=0; n<THREADRECORDS; n++)
+			{
+				nedfree(mem[n]);
+				mem[n]=0;
+			}
+		}
+		break;
+	}
+}
+static void runthreads(int phase)
+{
+	THREADVAR threads[THREADS];
+	int n;
+	threadphase=phase;
+	for(n=0; n<THREADS; n++)
+		THREADINIT(&threads[n], n);
+	for(n=0; n<THREADS; n++)
+		THREADWAIT(threads[n]);
+}
+
 int main(void)
 {
+	int n;
 	printf("nedmalloc PGO maker\n"
 		   "-=-=-=-=-=-=-=-=-=-\n");
 	printf("Small allocations\n");
@@ -56,5 +207,24 @@ int main(void)
 	printf("Large allocations\n");
 	run(8*1024*1024, RECORDS/1000, 10000);
 
+	printf("C++ object allocations\n");
+	{
+		static void *mem[RECORDS];
+		cppobjects(mem, RECORDS, 20, 1);
+	}
+
+	printf("Growing with realloc\n");
+	growables(200);
+
+	printf("C++ object allocations on %d threads\n", THREADS);
+	runthreads(0);
+
+	printf("Freeing on a different thread than allocated\n");
+	for(n=0; n<20; n++)
+	{
+		runthreads(1);
+		runthreads(2);
+	}
+
 	return 0;
-}
\ No newline at end of file
+}
@@ -491,6 +491,18 @@ DEFAULT_MMAP_THRESHOLD       default: 256K
   empirically derived value that works well in most systems. You can
   disable mmap by setting to MAX_SIZE_T.
 
+DEFAULT_MMAP_THRESHOLD_MAX   default: 32Mb (512K on 32 bit systems)
+  The ceiling to which each mspace may raise its own mmap threshold.
+  Whenever a directly mmapped chunk no bigger than this is freed, the
+  mspace raises its threshold to that chunk's size so that similarly
+  sized requests are next served from its segments instead of paying
+  for mmap and munmap on every cycle. The trim threshold is kept at no
+  less than twice the raised value to stop such chunks being trimmed
+  straight back to the system. An mspace drops back to the global
+  threshold when it is trimmed or fails to extend a segment. Setting
+  the threshold with mallopt(M_MMAP_THRESHOLD, x) also sets this
+  ceiling, so disabling the dynamic adjustment.
+
 MAX_RELEASE_CHECK_RATE   default: 4095 unless not HAVE_MMAP
   The number of consolidated frees between checks to release
   unused segments when freeing. When using non-contiguous segments,
@@ -504,6 +516,33 @@ MAX_RELEASE_CHECK_RATE   default: 4095 unless not HAVE_MMAP
   rarely trigger versus holding on to unused memory. To effectively
   disable, set to MAX_SIZE_T. This may lead to a very slight speed
   improvement at the expense of carrying around more memory.
+
+MMAP_CACHE_ENTRIES       default: 8 unless not HAVE_MMAP
+  The number of recently freed directly mmapped chunks each mspace
+  keeps mapped for reuse by later large requests. A request is served
+  from the cache if a held region is at least as big as needed and no
+  more than a quarter bigger, so repeatedly allocating and freeing
+  similarly sized large buffers costs neither the mmap/munmap system
+  calls nor the page faults of fresh mappings. Cached regions still
+  count towards the footprint. Set to zero to disable.
+
+MMAP_CACHE_MAXBYTES      default: 16Mb
+  The total size of the regions held by each mspace's mmap cache. The
+  least recently cached regions are unmapped to make room. Regions
+  bigger than this are never cached.
+
+MMAP_CACHE_MAXAGE        default: 64
+  The number of direct mmap allocations and frees an mspace may perform
+  before a region held in its mmap cache is considered stale and
+  unmapped. malloc_trim() releases the entire cache.
+
+USE_PAGEMAP              default: 1 if HAVE_MMAP and compiler has CAS
+  If true, a radix tree recording which mspace owns each page obtained
+  from the system is maintained, so that pagemap_get() can tell in
+  constant time, without touching the block itself, whether an
+  arbitrary address lies in memory belonging to some mspace. The tree's
+  tables are allocated with MMAP on first use and never released; each
+  leaf table costs 32Kb on 64 bit systems and covers 16Mb of addresses.
 */
 
 /* Version identifier to allow people to support multiple versions */
@@ -665,6 +704,14 @@ MAX_RELEASE_CHECK_RATE   default: 4095 unless not HAVE_MMAP
 #define DEFAULT_MMAP_THRESHOLD MAX_SIZE_T
 #endif  /* HAVE_MMAP */
 #endif  /* DEFAULT_MMAP_THRESHOLD */
+#ifndef DEFAULT_MMAP_THRESHOLD_MAX
+#if HAVE_MMAP
+#define DEFAULT_MMAP_THRESHOLD_MAX ((sizeof(size_t) >= 8)?\
+  ((size_t)32U * (size_t)1024U * (size_t)1024U) : ((size_t)512U * (size_t)1024U))
+#else   /* HAVE_MMAP */
+#define DEFAULT_MMAP_THRESHOLD_MAX MAX_SIZE_T
+#endif  /* HAVE_MMAP */
+#endif  /* DEFAULT_MMAP_THRESHOLD_MAX */
 #ifndef MAX_RELEASE_CHECK_RATE
 #if HAVE_MMAP
 #define MAX_RELEASE_CHECK_RATE 4095
@@ -672,6 +719,31 @@ MAX_RELEASE_CHECK_RATE   default: 4095 unless not HAVE_MMAP
 #define MAX_RELEASE_CHECK_RATE MAX_SIZE_T
 #endif /* HAVE_MMAP */
 #endif /* MAX_RELEASE_CHECK_RATE */
+#ifndef MMAP_CACHE_ENTRIES
+#if HAVE_MMAP
+#define MMAP_CACHE_ENTRIES 8
+#else
+#define MMAP_CACHE_ENTRIES 0
+#endif /* HAVE_MMAP */
+#endif /* MMAP_CACHE_ENTRIES */
+#ifndef MMAP_CACHE_MAXBYTES
+#define MMAP_CACHE_MAXBYTES ((size_t)16U * (size_t)1024U * (size_t)1024U)
+#endif /* MMAP_CACHE_MAXBYTES */
+#ifndef MMAP_CACHE_MAXAGE
+#define MMAP_CACHE_MAXAGE 64
+#endif /* MMAP_CACHE_MAXAGE */
+#ifndef USE_PAGEMAP
+#if HAVE_MMAP && (defined(__GNUC__) || defined(_MSC_VER))
+#define USE_PAGEMAP 1
+#else
+#define USE_PAGEMAP 0
+#endif /* HAVE_MMAP && CAS */
+#endif /* USE_PAGEMAP */
+#ifndef NEDPROBE3
+/* nedmalloc defines these as USDT probes when NEDMALLOC_USDT is set */
+#define NEDPROBE2(name, a1, a2) do { } while(0)
+#define NEDPROBE3(name, a1, a2, a3) do { } while(0)
+#endif /* NEDPROBE3 */
 #ifndef USE_BUILTIN_FFS
 #define USE_BUILTIN_FFS 0
 #endif  /* USE_BUILTIN_FFS */
@@ -701,7 +773,7 @@ MAX_RELEASE_CHECK_RATE   default: 4095 unless not HAVE_MMAP
 #define M2_ZERO_MEMORY          (1<<0)
 #define M2_PREVENT_MOVE         (1<<1)
 #define M2_ALWAYS_MMAP          (1<<2)
-#define M2_RESERVED1            (1<<3)
+#define M2_PREFAULT             (1<<3)
 #define M2_RESERVED2            (1<<4)
 #define M2_RESERVED3            (1<<5)
 #define M2_RESERVED4            (1<<6)
@@ -1212,6 +1284,19 @@ size_t destroy_mspace(mspace msp);
 */
 mspace create_mspace_with_base(void* base, size_t capacity, int locked);
 
+/*
+  create_mspace_with_reservation creates an mspace within address space
+  of capacity bytes at base previously reserved using CALL_RESERVE. It
+  commits only enough of the reservation for its bookkeeping, and then
+  grows by committing further pages and shrinks on trim by decommitting
+  them, never obtaining memory from outside the reservation. Large
+  chunks are therefore never directly mmapped. Once the reservation is
+  exhausted, allocations fail. Destroying this space decommits its
+  pages but leaves the reservation itself to the caller. The capacity
+  must be at least the granularity. (Otherwise 0 is returned.)
+*/
+mspace create_mspace_with_reservation(void* base, size_t capacity, int locked);
+
 /*
   mspace_track_large_chunks controls whether requests for large chunks
   are allocated in their own untracked mmapped regions, separate from
@@ -1289,6 +1374,8 @@ void** mspace_independent_comalloc(mspace msp, size_t n_elements,
   * M2_ALWAYS_MMAP:      Always allocate as though mmap_threshold
                          were being exceeded. This is useful for large
                          arrays which frequently extend.
+  * M2_PREFAULT:         Take the page faults for the allocated chunk
+                         now rather than on first touch.
   * M2_RESERVE_MULT(n):  Reserve n times as much address space such
                          that mmapped realloc() is much faster.
   * M2_RESERVE_SHIFT(n): Reserve (1<<n) bytes of address space such
@@ -1320,6 +1407,8 @@ void* mspace_malloc2(mspace msp, size_t bytes, size_t alignment, unsigned flags)
                          bit will not necessarily mmap a chunk which
                          isn't already mmapped, but it will force a
                          mmapped chunk if new memory needs allocating.
+  * M2_PREFAULT:         Take the page faults for any increase in the
+                         allocated chunk now rather than on first touch.
   * M2_RESERVE_MULT(n):  Reserve n times as much address space such
                          that mmapped realloc() is much faster.
   * M2_RESERVE_SHIFT(n): Reserve (1<<n) bytes of address space such
@@ -1594,6 +1683,7 @@ struct malloc_params {
   size_t page_size;
   size_t granularity;
   size_t mmap_threshold;
+  size_t mmap_threshold_max;
   size_t trim_threshold;
   flag_t default_mflags;
 };
@@ -1668,7 +1758,7 @@ static FORCEINLINE void* posix_mmap(size_t size) {
 }
 
 /* For direct MMAP, use MAP_GROWSDOWN (linux)|MAP_STACK (bsd) to minimize interference */
-static FORCEINLINE void* posix_direct_mmap(size_t size) {
+static FORCEINLINE void* posix_direct_mmap(size_t size, unsigned flags2) {
   void* ptr = 0;
   int flags = MMAP_FLAGS, fd = -1;
 #ifndef MAP_ANONYMOUS
@@ -1682,6 +1772,10 @@ static FORCEINLINE void* posix_direct_mmap(size_t size) {
   flags |= MAP_STACK;
 #else
 #warning Cannot figure out how to request memory from the top of the address space!
+#endif
+#ifdef MAP_POPULATE
+  if (flags2 & M2_PREFAULT)
+    flags |= MAP_POPULATE;
 #endif
   ptr = mmap(0, size, MMAP_PROT, flags, fd, 0);
 #if DEBUG && 0
@@ -1690,9 +1784,39 @@ static FORCEINLINE void* posix_direct_mmap(size_t size) {
   return ptr;
 }
 
+/* Reserve address space without committing any memory to it */
+static FORCEINLINE void* posix_reserve(size_t size) {
+  int flags = MMAP_FLAGS, fd = -1;
+#ifndef MAP_ANONYMOUS
+  if (dev_zero_fd < 0)
+    dev_zero_fd = open("/dev/zero", O_RDWR);
+  fd = dev_zero_fd;
+#endif
+#ifdef MAP_NORESERVE
+  flags |= MAP_NORESERVE;
+#endif
+  return mmap(0, size, PROT_NONE, flags, fd, 0);
+}
+
+/* Throw away the contents of reserved pages, returning them to PROT_NONE */
+static FORCEINLINE int posix_decommit(void* addr, size_t size) {
+  int flags = MMAP_FLAGS|MAP_FIXED, fd = -1;
+#ifndef MAP_ANONYMOUS
+  fd = dev_zero_fd;
+#endif
+#ifdef MAP_NORESERVE
+  flags |= MAP_NORESERVE;
+#endif
+  return (mmap(addr, size, PROT_NONE, flags, fd, 0) == MFAIL) ? -1 : 0;
+}
+
 #define MMAP_DEFAULT(s)                     posix_mmap(s)
 #define MUNMAP_DEFAULT(h, a, s)             munmap((a), (s))
-#define DIRECT_MMAP_DEFAULT(h, s, f)        posix_direct_mmap(s)
+#define RESERVE_DEFAULT(s)                  posix_reserve(s)
+#define COMMIT_DEFAULT(a, s)                mprotect((a), (s), MMAP_PROT)
+#define DECOMMIT_DEFAULT(a, s)              posix_decommit((a), (s))
+#define UNRESERVE_DEFAULT(a, s)             munmap((a), (s))
+#define DIRECT_MMAP_DEFAULT(h, s, f)        posix_direct_mmap((s), (f))
 #if HAVE_MREMAP
 #define MREMAP_DEFAULT(addr, osz, nsz, mv)  mremap((addr), (osz), (nsz), (mv))
 #define DIRECT_MREMAP_DEFAULT(h, addr, osz, nsz, mv, f) mremap((addr), (osz), (nsz), (mv))
@@ -1929,8 +2053,18 @@ static FORCEINLINE int win32munmap(void *handle, void* ptr, size_t size) {
   return 0;
 }
 
+/* Reserve address space without committing any memory to it */
+static FORCEINLINE void* win32reserve(size_t size) {
+  void* ptr = VirtualAlloc(0, size, MEM_RESERVE, PAGE_NOACCESS);
+  return (ptr != 0)? ptr: MFAIL;
+}
+
 #define MMAP_DEFAULT(s)                        win32mmap(s)
 #define MUNMAP_DEFAULT(h, a, s)                win32munmap((h), (a), (s))
+#define RESERVE_DEFAULT(s)                     win32reserve(s)
+#define COMMIT_DEFAULT(a, s)                   ((VirtualAlloc((a), (s), MEM_COMMIT, PAGE_READWRITE) != 0)? 0 : -1)
+#define DECOMMIT_DEFAULT(a, s)                 ((VirtualFree((a), (s), MEM_DECOMMIT) != 0)? 0 : -1)
+#define UNRESERVE_DEFAULT(a, s)                ((VirtualFree((a), 0, MEM_RELEASE) != 0)? 0 : -1)
 #define DIRECT_MMAP_DEFAULT(h, s, f)           win32direct_mmap((h), (s), (f))
 #define DIRECT_MREMAP_DEFAULT(h, a, os, ns, f, f2) win32direct_mremap((h), (a), (os), (ns), (f), (f2))
 #endif /* WIN32 */
@@ -1990,6 +2124,17 @@ static FORCEINLINE int win32munmap(void *handle, void* ptr, size_t size) {
     #else /* DIRECT_MMAP */
         #define CALL_DIRECT_MREMAP(h, a, os, ns, f, f2) DIRECT_MREMAP_DEFAULT((h), (a), (os), (ns), (f), (f2))
     #endif /* DIRECT_MMAP */
+    #ifdef RESERVE
+        #define CALL_RESERVE(s)                 RESERVE(s)
+        #define CALL_COMMIT(a, s)               COMMIT((a), (s))
+        #define CALL_DECOMMIT(a, s)             DECOMMIT((a), (s))
+        #define CALL_UNRESERVE(a, s)            UNRESERVE((a), (s))
+    #else /* RESERVE */
+        #define CALL_RESERVE(s)                 RESERVE_DEFAULT(s)
+        #define CALL_COMMIT(a, s)               COMMIT_DEFAULT((a), (s))
+        #define CALL_DECOMMIT(a, s)             DECOMMIT_DEFAULT((a), (s))
+        #define CALL_UNRESERVE(a, s)            UNRESERVE_DEFAULT((a), (s))
+    #endif /* RESERVE */
 #else  /* HAVE_MMAP */
     #define USE_MMAP_BIT                            (SIZE_T_ZERO)
 
@@ -2004,14 +2149,61 @@ static FORCEINLINE int win32munmap(void *handle, void* ptr, size_t size) {
     #define CALL_MREMAP(a, os, ns, f)               MREMAP((a), (os), (ns), (f))
     #define CALL_DIRECT_MMAP(h, s, f)               DIRECT_MMAP((h), (s), (f))
     #define CALL_DIRECT_MREMAP(h, a, os, ns, f, f2) DIRECT_MREMAP((h), (a), (os), (ns), (f), (f2))
+    #define CALL_RESERVE(s)                         MFAIL
+    #define CALL_COMMIT(a, s)                       (-1)
+    #define CALL_DECOMMIT(a, s)                     (-1)
+    #define CALL_UNRESERVE(a, s)                    (-1)
 #endif /* HAVE_MMAP */
 
+/* Whether CALL_DIRECT_MMAP itself populates the mapping for M2_PREFAULT */
+#if HAVE_MMAP && !defined(WIN32) && !defined(DIRECT_MMAP) && defined(MAP_POPULATE)
+#define DIRECT_MMAP_PREFAULTS 1
+#else
+#define DIRECT_MMAP_PREFAULTS 0
+#endif
+
+#if defined(__linux__) && !defined(MADV_POPULATE_WRITE)
+#define MADV_POPULATE_WRITE 23 /* Linux 5.14 onwards, EINVAL before */
+#endif
+
+/*
+  Take the page faults for [mem, mem+size) now rather than on first
+  touch. Only bytes within the range are ever written, and then with
+  their existing value, as the surrounding pages may belong to chunks
+  in use by other threads.
+*/
+static void prefault_memory(void* mem, size_t size) {
+  char* p = (char*)mem;
+  char* end = p + size;
+  if (size == 0)
+    return;
+#if !defined(WIN32) && HAVE_MMAP
+  {
+    char* page = (char*)((size_t)p & ~(mparams.page_size - SIZE_T_ONE));
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(page, (size_t)(end - page), MADV_POPULATE_WRITE) == 0)
+      return;
+#endif /* MADV_POPULATE_WRITE */
+#ifdef MADV_WILLNEED
+    madvise(page, (size_t)(end - page), MADV_WILLNEED);
+#endif /* MADV_WILLNEED */
+  }
+#endif /* !WIN32 && HAVE_MMAP */
+  while (p < end) {
+    *(volatile char*)p = *(volatile char*)p;
+    p = (char*)(((size_t)p + mparams.page_size) & ~(mparams.page_size - SIZE_T_ONE));
+  }
+}
+
 /* mstate bit set if continguous morecore disabled or failed */
 #define USE_NONCONTIGUOUS_BIT (4U)
 
 /* segment bit set in create_mspace_with_base */
 #define EXTERN_BIT            (8U)
 
+/* segment bit set in create_mspace_with_reservation */
+#define RESERVED_BIT          (16U)
+
 
 /* --------------------------- Lock preliminaries ------------------------ */
 
@@ -2748,10 +2940,19 @@ struct malloc_segment {
 
 #define is_mmapped_segment(S)  ((S)->sflags & USE_MMAP_BIT)
 #define is_extern_segment(S)   ((S)->sflags & EXTERN_BIT)
+#define is_reserved_segment(S) ((S)->sflags & RESERVED_BIT)
 
 typedef struct malloc_segment  msegment;
 typedef struct malloc_segment* msegmentptr;
 
+#if MMAP_CACHE_ENTRIES
+struct malloc_mmcache_entry {
+  char*        base;             /* base address, 0 if unused */
+  size_t       size;             /* mapped size */
+  size_t       stamp;            /* mmcache_clock when cached */
+};
+#endif /* MMAP_CACHE_ENTRIES */
+
 /* ---------------------------- malloc_state ----------------------------- */
 
 /*
@@ -2767,6 +2968,12 @@ typedef struct malloc_segment* msegmentptr;
     cached from mparams in trim_check, except that it is disabled if
     an autotrim fails.
 
+  Mmap threshold
+    Requests at least this big are directly mmapped. Zero, or any value
+    outside mparams' mmap_threshold and mmap_threshold_max, means use
+    the mparams value. It is raised as directly mmapped chunks are
+    freed and reset under memory pressure.
+
   Designated victim (dv)
     This is the preferred chunk for servicing small requests that
     don't have exact fits.  It is normally the chunk split off most
@@ -2807,6 +3014,12 @@ typedef struct malloc_segment* msegmentptr;
     A list of segments headed by an embedded malloc_segment record
     representing the initial space.
 
+  Reservation
+    If non-zero, resv_end is the end of the address space reserved for
+    an mspace made by create_mspace_with_reservation(). Its only
+    segment then grows by committing further pages of the reservation
+    and is trimmed by decommitting them, never leaving the reservation.
+
   Address check support
     The least_addr field is the least address ever obtained from
     MORECORE or MMAP. Attempted frees and reallocs of any address less
@@ -2827,6 +3040,13 @@ typedef struct malloc_segment* msegmentptr;
     timming, and a counter to force periodic scanning to release unused
     non-topmost segments.
 
+  Mmap cache
+    Directly mmapped chunks recently freed, held mapped for reuse by
+    later large requests. Each entry records the region's base and
+    size plus the value of mmcache_clock when it was cached, the clock
+    advancing on every direct mmap allocation and free so stale
+    entries can be aged out. mmcache_bytes totals the held regions.
+
   Locking
     If USE_LOCKS is defined, the "mutex" lock is acquired and released
     around every public call using this mspace.
@@ -2852,9 +3072,11 @@ struct malloc_state {
   size_t     dvsize;
   size_t     topsize;
   char*      least_addr;
+  char*      resv_end;
   mchunkptr  dv;
   mchunkptr  top;
   size_t     trim_check;
+  size_t     mmap_threshold;
   size_t     release_checks;
   size_t     magic;
   mchunkptr  smallbins[(NSMALLBINS+1)*2];
@@ -2866,6 +3088,16 @@ struct malloc_state {
 #if USE_LOCKS
   MLOCK_T    mutex;     /* locate lock among fields that rarely change */
 #endif /* USE_LOCKS */
+#if MMAP_CACHE_ENTRIES
+  struct malloc_mmcache_entry mmcache[MMAP_CACHE_ENTRIES];
+  size_t     mmcache_bytes;
+  size_t     mmcache_clock;
+  size_t     mmcache_hits;   /* Direct mmaps served from the cache */
+#endif /* MMAP_CACHE_ENTRIES */
+  size_t     mmap_allocs;    /* Direct mmapped chunks handed out */
+  size_t     mmap_frees;     /* Direct mmapped chunks freed */
+  size_t     trims;          /* Times memory was given back to the system */
+  size_t     trimmed;        /* Bytes given back to the system */
   void*      extp;      /* Unused but available for extensions */
   size_t     exts;
 };
@@ -2953,6 +3185,18 @@ static int has_segment_link(mstate m, msegmentptr ss) {
   }
 }
 
+/* The mmap threshold for M, possibly raised above the mparams value */
+#define mmap_threshold_for(M)\
+  (((M)->mmap_threshold > mparams.mmap_threshold &&\
+    (M)->mmap_threshold <= mparams.mmap_threshold_max)?\
+   (M)->mmap_threshold : mparams.mmap_threshold)
+
+/* The trim threshold for M, at least twice any raised mmap threshold */
+#define trim_threshold_for(M)\
+  ((mmap_threshold_for(M) != mparams.mmap_threshold &&\
+    (mmap_threshold_for(M) << 1) > mparams.trim_threshold)?\
+   (mmap_threshold_for(M) << 1) : mparams.trim_threshold)
+
 #ifndef MORECORE_CANNOT_TRIM
 #define should_trim(M,s)  ((s) > (M)->trim_check)
 #else  /* MORECORE_CANNOT_TRIM */
@@ -3424,6 +3668,7 @@ static int init_mparams(void) {
     mparams.granularity = gsize;
     mparams.page_size = psize;
     mparams.mmap_threshold = DEFAULT_MMAP_THRESHOLD;
+    mparams.mmap_threshold_max = DEFAULT_MMAP_THRESHOLD_MAX;
     mparams.trim_threshold = DEFAULT_TRIM_THRESHOLD;
 #if MORECORE_CONTIGUOUS
     mparams.default_mflags = USE_LOCK_BIT|USE_MMAP_BIT;
@@ -3481,7 +3726,7 @@ static int change_mparam(int param_number, int value) {
     else
       return 0;
   case M_MMAP_THRESHOLD:
-    mparams.mmap_threshold = val;
+    mparams.mmap_threshold = mparams.mmap_threshold_max = val;
     return 1;
   default:
     return 0;
@@ -4083,6 +4328,129 @@ static void* mspace_malloc_implementation(mstate ms, size_t bytes, unsigned flag
 #endif /* MSPACES */
 #endif /* ONLY_MSPACES */
 
+/* ------------------------------- Page map ------------------------------ */
+
+/*
+  The page map is a three level radix tree indexed by page number which
+  records the mstate owning each page of every segment and directly
+  mmapped chunk, so that ownership of an arbitrary address can be
+  decided exactly without dereferencing it. It covers the low 48 bits of
+  the address space, which is all current 64 bit systems hand out.
+
+  Entries are written only by the mstate owning the pages concerned,
+  under its lock, so never race with each other. Interior and leaf
+  tables are installed with compare-and-swap rather than under the
+  global lock, as mspaces may be created while that lock is held, and
+  are never freed, so pagemap_get() needs no locking at all. Pages of
+  memory handed to create_mspace_with_base are recorded in their
+  entirety, including any partial pages at either end.
+
+  Allocators layered over an mspace may carve whole pages of a chunk
+  into blocks of their own and mark those pages with a pointer to their
+  own metadata, tagged with PAGEMAP_EXT_BIT. The record pointed to must
+  begin with the owning mstate, which pagemap_get() returns as usual,
+  while pagemap_entry() returns the raw entry. The pages must be handed
+  back to the mstate before the chunk is freed.
+*/
+
+#if USE_PAGEMAP
+#define PAGEMAP_PAGE_SHIFT  (12U)
+#define PAGEMAP_LEVEL_BITS  (12U)
+#define PAGEMAP_LEVEL_SIZE  ((size_t)1U << PAGEMAP_LEVEL_BITS)
+#define PAGEMAP_LEVEL_MASK  (PAGEMAP_LEVEL_SIZE - SIZE_T_ONE)
+#define PAGEMAP_TABLE_SIZE  (PAGEMAP_LEVEL_SIZE * sizeof(void*))
+#define PAGEMAP_EXT_BIT     (SIZE_T_ONE)
+
+#ifdef _MSC_VER
+#define pagemap_cas(P, O, N)\
+  (InterlockedCompareExchangePointer((PVOID volatile*)(P), (N), (O)) == (O))
+#else /* _MSC_VER */
+#define pagemap_cas(P, O, N)  __sync_bool_compare_and_swap((P), (O), (N))
+#endif /* _MSC_VER */
+
+static void** volatile* volatile pagemap_root[PAGEMAP_LEVEL_SIZE];
+
+#define pagemap_root_index(PG)  ((PG) >> (2U * PAGEMAP_LEVEL_BITS))
+#define pagemap_mid_index(PG)   (((PG) >> PAGEMAP_LEVEL_BITS) & PAGEMAP_LEVEL_MASK)
+#define pagemap_leaf_index(PG)  ((PG) & PAGEMAP_LEVEL_MASK)
+
+/* Return the raw entry for the page holding addr, or 0 if none */
+static FORCEINLINE void* pagemap_entry(void* addr) {
+  size_t pg = (size_t)addr >> PAGEMAP_PAGE_SHIFT;
+  void** volatile* mid;
+  void** leaf;
+  if (pagemap_root_index(pg) >= PAGEMAP_LEVEL_SIZE ||
+      (mid = pagemap_root[pagemap_root_index(pg)]) == 0 ||
+      (leaf = mid[pagemap_mid_index(pg)]) == 0)
+    return 0;
+  return leaf[pagemap_leaf_index(pg)];
+}
+
+/* Return the mstate owning the page holding addr, or 0 if none */
+static FORCEINLINE mstate pagemap_get(void* addr) {
+  size_t e = (size_t)pagemap_entry(addr);
+  if (e & PAGEMAP_EXT_BIT)
+    return *(mstate*)(e & ~PAGEMAP_EXT_BIT);
+  return (mstate)e;
+}
+
+/* Install a zeroed table at *slot if there is none, returning it or 0 */
+static void* pagemap_table(void* volatile* slot) {
+  void* t = *slot;
+  if (t == 0) {
+    void* nt = CALL_MMAP(PAGEMAP_TABLE_SIZE, 0);
+    if (nt == CMFAIL)
+      return 0;
+    memset(nt, 0, PAGEMAP_TABLE_SIZE);
+    if (pagemap_cas(slot, (void*)0, nt))
+      t = nt;
+    else { /* Another thread beat us to it */
+      CALL_MUNMAP(0, nt, PAGEMAP_TABLE_SIZE);
+      t = *slot;
+    }
+  }
+  return t;
+}
+
+/*
+  Record owner, an mstate or tagged record, as the owner of the pages
+  spanning [base, base+size), or forget their owner if it is 0. Returns
+  false, recording nothing, if a table could not be allocated or the
+  range lies beyond the map.
+*/
+static int pagemap_set(char* base, size_t size, void* owner) {
+  size_t first = (size_t)base >> PAGEMAP_PAGE_SHIFT;
+  size_t end = ((size_t)base + size + (((size_t)1U << PAGEMAP_PAGE_SHIFT) -
+                SIZE_T_ONE)) >> PAGEMAP_PAGE_SHIFT;
+  size_t pg;
+  if (size == 0)
+    return 1;
+  if (pagemap_root_index(end - 1) >= PAGEMAP_LEVEL_SIZE)
+    return owner == 0;
+  for (pg = first; pg < end; ++pg) {
+    void* volatile* rslot = (void* volatile*)&pagemap_root[pagemap_root_index(pg)];
+    void** volatile* mid;
+    void** leaf;
+    if (owner == 0) { /* Nothing to forget where no table exists */
+      if ((mid = pagemap_root[pagemap_root_index(pg)]) == 0 ||
+          (leaf = mid[pagemap_mid_index(pg)]) == 0) {
+        pg |= PAGEMAP_LEVEL_MASK;
+        continue;
+      }
+    }
+    else if ((mid = (void** volatile*)pagemap_table(rslot)) == 0 ||
+             (leaf = (void**)pagemap_table((void* volatile*)&mid[pagemap_mid_index(pg)])) == 0) {
+      pagemap_set((char*)(first << PAGEMAP_PAGE_SHIFT), (pg - first) << PAGEMAP_PAGE_SHIFT, 0);
+      return 0;
+    }
+    leaf[pagemap_leaf_index(pg)] = owner;
+  }
+  return 1;
+}
+
+#define pagemap_clear(B, S)  ((void)pagemap_set((B), (S), 0))
+#endif /* USE_PAGEMAP */
+
 /* -----------------------  Direct-mmapping chunks ----------------------- */
 
 /*
@@ -4099,11 +4467,124 @@ static void* mspace_malloc_implementation(mstate ms, size_t bytes, unsigned flag
 */
 
 /* Malloc using mmap */
-static void* mmap_alloc(mstate m, size_t nb, unsigned flags) {
+#if MMAP_CACHE_ENTRIES
+/* Unmap the region held in mmap cache entry e */
+static void mmcache_release_entry(mstate m, struct malloc_mmcache_entry* e) {
+  m->mmcache_bytes -= e->size;
+#if USE_PAGEMAP
+  pagemap_clear(e->base, e->size);
+#endif /* USE_PAGEMAP */
+  if (CALL_MUNMAP(*(void**)e->base, e->base, e->size) == 0)
+    m->footprint -= e->size;
+  e->base = 0;
+  e->size = 0;
+}
+
+/* Unmap all regions held in the mmap cache, returning true if any */
+static int mmcache_release(mstate m) {
+  int released = 0;
+  size_t i;
+  for (i = 0; i < MMAP_CACHE_ENTRIES; ++i) {
+    if (m->mmcache[i].base != 0) {
+      mmcache_release_entry(m, &m->mmcache[i]);
+      released = 1;
+    }
+  }
+  return released;
+}
+
+/* Advance the mmap cache clock, unmapping entries which have gone stale */
+static void mmcache_tick(mstate m) {
+  size_t i, now = ++m->mmcache_clock;
+  for (i = 0; i < MMAP_CACHE_ENTRIES; ++i) {
+    struct malloc_mmcache_entry* e = &m->mmcache[i];
+    if (e->base != 0 && now - e->stamp > MMAP_CACHE_MAXAGE)
+      mmcache_release_entry(m, e);
+  }
+}
+
+/*
+  Remove and return the best fitting cached region at least *mmsize big
+  but no more than a quarter bigger, updating *mmsize to its true size.
+  Returns CMFAIL if there is none.
+*/
+static char* mmcache_take(mstate m, size_t* mmsize) {
+  struct malloc_mmcache_entry* best = 0;
+  size_t i, want = *mmsize, slack = want >> 2;
+  mmcache_tick(m);
+  for (i = 0; i < MMAP_CACHE_ENTRIES; ++i) {
+    struct malloc_mmcache_entry* e = &m->mmcache[i];
+    if (e->base != 0 && e->size >= want && e->size - want <= slack &&
+        (best == 0 || e->size < best->size))
+      best = e;
+  }
+  if (best != 0) {
+    char* mm = best->base;
+    *mmsize = best->size;
+    m->mmcache_bytes -= best->size;
+    best->base = 0;
+    best->size = 0;
+    return mm;
+  }
+  return CMFAIL;
+}
+
+/*
+  Hold the freed mmapped region mm of mmsize bytes in the mmap cache,
+  unmapping the least recently cached regions as needed to keep within
+  budget. Returns false if the region should be unmapped instead.
+*/
+static int mmcache_put(mstate m, char* mm, size_t mmsize) {
+  struct malloc_mmcache_entry* slot;
+  size_t i;
+  if (mmsize > MMAP_CACHE_MAXBYTES)
+    return 0;
+  mmcache_tick(m);
+  for (;;) {
+    struct malloc_mmcache_entry* oldest = 0;
+    slot = 0;
+    for (i = 0; i < MMAP_CACHE_ENTRIES; ++i) {
+      struct malloc_mmcache_entry* e = &m->mmcache[i];
+      if (e->base == 0)
+        slot = e;
+      else if (oldest == 0 || e->stamp < oldest->stamp)
+        oldest = e;
+    }
+    if (slot != 0 && m->mmcache_bytes + mmsize <= MMAP_CACHE_MAXBYTES)
+      break;
+    mmcache_release_entry(m, oldest);
+  }
+  slot->base = mm;
+  slot->size = mmsize;
+  slot->stamp = m->mmcache_clock;
+  m->mmcache_bytes += mmsize;
+  return 1;
+}
+#endif /* MMAP_CACHE_ENTRIES */
+
+/* Directly map a chunk, or if cachedonly only recycle one from the mmap cache */
+static void* mmap_alloc_from(mstate m, size_t nb, unsigned flags, int cachedonly) {
   size_t mmsize = mmap_align_size(nb + SEVEN_SIZE_T_SIZES + CHUNK_ALIGN_MASK);
   if (mmsize > nb) {     /* Check for wrap around 0 */
     void* mmaph = 0;
-    char* mm = (char*)(CALL_DIRECT_MMAP(&mmaph, mmsize, flags));
+    char* mm = CMFAIL;
+    int fresh = 1;
+#if MMAP_CACHE_ENTRIES
+    /* Reserved address space must come fresh from DIRECT_MMAP */
+    if (!(flags & M2_RESERVE_MASK) && (mm = mmcache_take(m, &mmsize)) != CMFAIL) {
+      mmaph = *(void**)mm;
+      fresh = 0;
+    }
+    else
+#endif /* MMAP_CACHE_ENTRIES */
+    if (!cachedonly)
+      mm = (char*)(CALL_DIRECT_MMAP(&mmaph, mmsize, flags));
+#if USE_PAGEMAP
+    if (fresh && mm != CMFAIL && !pagemap_set(mm, mmsize, m)) {
+      CALL_MUNMAP(mmaph, mm, mmsize);
+      mm = CMFAIL;
+    }
+#endif /* USE_PAGEMAP */
     if (mm != CMFAIL) {
       size_t offset = MALLOC_ALIGNMENT + align_offset(chunk2mem(mm));
       size_t psize = mmsize - offset - MMAP_FOOT_PAD;
@@ -4115,10 +4596,22 @@ static void* mmap_alloc(mstate m, size_t nb, unsigned flags) {
       chunk_plus_offset(p, psize)->head = FENCEPOST_HEAD;
       chunk_plus_offset(p, psize+SIZE_T_SIZE)->head = 0;
 
-      if (m->least_addr == 0 || mm < m->least_addr)
-        m->least_addr = mm;
-      if ((m->footprint += mmsize) > m->max_footprint)
-        m->max_footprint = m->footprint;
+      ++m->mmap_allocs;
+      if (fresh) {
+        if (m->least_addr == 0 || mm < m->least_addr)
+          m->least_addr = mm;
+        if ((m->footprint += mmsize) > m->max_footprint)
+          m->max_footprint = m->footprint;
+      }
+      else {
+#if MMAP_CACHE_ENTRIES
+        ++m->mmcache_hits;
+#endif /* MMAP_CACHE_ENTRIES */
+        if (flags & M2_ZERO_MEMORY) /* Recycled regions are dirty */
+          memset(chunk2mem(p), 0, psize - MMAP_CHUNK_OVERHEAD);
+        else if (DIRECT_MMAP_PREFAULTS && (flags & M2_PREFAULT))
+          prefault_memory(chunk2mem(p), psize - MMAP_CHUNK_OVERHEAD);
+      }
       assert(is_aligned(chunk2mem(p)));
       check_mmapped_chunk(m, p);
       return chunk2mem(p);
@@ -4126,6 +4619,7 @@ static void* mmap_alloc(mstate m, size_t nb, unsigned flags) {
   }
   return 0;
 }
+#define mmap_alloc(M, NB, F)  mmap_alloc_from((M), (NB), (F), 0)
 
 /* Realloc using mmap */
 static mchunkptr mmap_resize(mstate m, mchunkptr oldp, size_t nb, unsigned flags) {
@@ -4142,7 +4636,28 @@ static mchunkptr mmap_resize(mstate m, mchunkptr oldp, size_t nb, unsigned flags
     size_t newmmsize = mmap_align_size(nb + SEVEN_SIZE_T_SIZES + CHUNK_ALIGN_MASK);
     char* mm = (char*)oldp - offset;
     void* mmaph = *(void**)mm;
+#if USE_PAGEMAP
+    /*
+      Pages leaving the block must be forgotten before another thread can
+      map them, and a moved block couldn't be put back if recording its new
+      pages failed, so resize in place only and let the caller copy.
+    */
+    char* cp;
+    if (newmmsize < oldmmsize)
+      pagemap_clear(mm + newmmsize, oldmmsize - newmmsize);
+    cp = (char*)CALL_DIRECT_MREMAP(&mmaph, mm, oldmmsize, newmmsize, 0, flags);
+    if (cp == CMFAIL) {
+      if (newmmsize < oldmmsize)
+        (void)pagemap_set(mm + newmmsize, oldmmsize - newmmsize, m);
+    }
+    else if (newmmsize > oldmmsize &&
+             !pagemap_set(cp + oldmmsize, newmmsize - oldmmsize, m)) {
+      CALL_DIRECT_MREMAP(&mmaph, cp, newmmsize, oldmmsize, 0, flags);
+      cp = CMFAIL;
+    }
+#else /* USE_PAGEMAP */
 	char* cp = (char*)CALL_DIRECT_MREMAP(&mmaph, mm, oldmmsize, newmmsize, (flags & M2_PREVENT_MOVE) ? 0 : MREMAP_MAYMOVE, flags);
+#endif /* USE_PAGEMAP */
     if (cp != CMFAIL) {
       mchunkptr newp = (mchunkptr)(cp + offset);
       size_t psize = newmmsize - offset - MMAP_FOOT_PAD;
@@ -4177,7 +4692,7 @@ static void init_top(mstate m, mchunkptr p, size_t psize) {
   p->head = psize | PINUSE_BIT;
   /* set size of fake trailing chunk holding overhead space only once */
   chunk_plus_offset(p, psize)->head = TOP_FOOT_SIZE;
-  m->trim_check = mparams.trim_threshold; /* reset on each update */
+  m->trim_check = trim_threshold_for(m); /* reset on each update */
 }
 
 /* Initialize bins for a new mstate that is otherwise zeroed out */
@@ -4306,6 +4821,26 @@ static void add_segment(mstate m, char* tbase, size_t tsize, flag_t mmapped) {
 
 /* -------------------------- System allocation -------------------------- */
 
+/*
+  Serve chunks of psize from segments rather than mmap in future. Regions
+  already in the mmap cache are still recycled below the new threshold by
+  sys_alloc, as that needs no system call.
+*/
+static void raise_mmap_threshold(mstate m, size_t psize) {
+  if (psize > mmap_threshold_for(m) && psize <= mparams.mmap_threshold_max) {
+    m->mmap_threshold = psize;
+    if (m->trim_check != MAX_SIZE_T)
+      m->trim_check = trim_threshold_for(m);
+  }
+}
+
+/* Drop back to the mparams mmap threshold */
+static void reset_mmap_threshold(mstate m) {
+  m->mmap_threshold = 0;
+  if (m->trim_check != MAX_SIZE_T)
+    m->trim_check = mparams.trim_threshold;
+}
+
 /* Get memory from system using MORECORE or MMAP */
 static void* sys_alloc(mstate m, size_t nb, unsigned flags) {
   char* tbase = CMFAIL;
@@ -4315,11 +4850,19 @@ static void* sys_alloc(mstate m, size_t nb, unsigned flags) {
   ensure_initialization();
 
   /* Directly map large chunks, but only if already initialized */
-  if (use_mmap(m) && (nb >= mparams.mmap_threshold || (flags & M2_ALWAYS_MMAP)) && m->topsize != 0) {
+  if (use_mmap(m) && (nb >= mmap_threshold_for(m) || (flags & M2_ALWAYS_MMAP)) && m->topsize != 0) {
     void* mem = mmap_alloc(m, nb, flags);
     if (mem != 0 || (flags & M2_ALWAYS_MMAP))
       return mem;
   }
+#if MMAP_CACHE_ENTRIES
+  /* Below a raised threshold, still prefer a cached region to growing a segment */
+  else if (use_mmap(m) && nb >= mparams.mmap_threshold && m->mmcache_bytes != 0 && m->topsize != 0) {
+    void* mem = mmap_alloc_from(m, nb, flags, 1);
+    if (mem != 0)
+      return mem;
+  }
+#endif /* MMAP_CACHE_ENTRIES */
 
   /*
     Try getting memory in any of three ways (in most-preferred to
@@ -4343,7 +4886,22 @@ static void* sys_alloc(mstate m, size_t nb, unsigned flags) {
    not on boundary, and round this up to a granularity unit.
   */
 
-  if (MORECORE_CONTIGUOUS && !use_noncontiguous(m)) {
+  if (m->resv_end != 0) { /* Commit more of the reserved address space */
+    char* end = m->seg.base + m->seg.size;
+    size_t avail = (size_t)(m->resv_end - end);
+    size_t need = (nb + SYS_ALLOC_PADDING > m->topsize)?
+      nb + SYS_ALLOC_PADDING - m->topsize : SIZE_T_ONE;
+    size_t asize = granularity_align(need);
+    if (asize > avail && need <= avail)
+      asize = avail; /* Use up the tail of the reservation */
+    if (need < HALF_MAX_SIZE_T && asize <= avail &&
+        CALL_COMMIT(end, asize) == 0) {
+      tbase = end;
+      tsize = asize;
+    }
+  }
+
+  else if (MORECORE_CONTIGUOUS && !use_noncontiguous(m)) {
     char* br = CMFAIL;
     msegmentptr ss = (m->top == 0)? 0 : segment_holding(m, (char*)m->top);
     size_t asize = 0;
@@ -4402,7 +4960,7 @@ static void* sys_alloc(mstate m, size_t nb, unsigned flags) {
     RELEASE_MALLOC_GLOBAL_LOCK();
   }
 
-  if (HAVE_MMAP && tbase == CMFAIL) {  /* Try MMAP */
+  if (HAVE_MMAP && tbase == CMFAIL && m->resv_end == 0) {  /* Try MMAP */
     size_t rsize = granularity_align(nb + SYS_ALLOC_PADDING);
     if (rsize > nb) { /* Fail if wraps around zero */
       char* mp = (char*)(CALL_MMAP(rsize, flags));
@@ -4414,7 +4972,7 @@ static void* sys_alloc(mstate m, size_t nb, unsigned flags) {
     }
   }
 
-  if (HAVE_MORECORE && tbase == CMFAIL) { /* Try noncontiguous MORECORE */
+  if (HAVE_MORECORE && tbase == CMFAIL && m->resv_end == 0) { /* Try noncontiguous MORECORE */
     size_t asize = granularity_align(nb + SYS_ALLOC_PADDING);
     if (asize < HALF_MAX_SIZE_T) {
       char* br = CMFAIL;
@@ -4433,7 +4991,19 @@ static void* sys_alloc(mstate m, size_t nb, unsigned flags) {
     }
   }
 
+#if USE_PAGEMAP
+  if (tbase != CMFAIL && !pagemap_set(tbase, tsize, m)) {
+    /* Memory whose owner can't be recorded is no use to us */
+    if (mmap_flag)
+      CALL_MUNMAP(0/*segment*/, tbase, tsize);
+    else if (m->resv_end != 0)
+      CALL_DECOMMIT(tbase, tsize);
+    tbase = CMFAIL;
+  }
+#endif /* USE_PAGEMAP */
+
   if (tbase != CMFAIL) {
+    NEDPROBE3(segment_alloc, m, tbase, tsize);
 
     if ((m->footprint += tsize) > m->max_footprint)
       m->max_footprint = m->footprint;
@@ -4503,13 +5073,32 @@ static void* sys_alloc(mstate m, size_t nb, unsigned flags) {
     }
   }
 
+  /* Under memory pressure, stop serving large requests from segments */
+  if (nb < mmap_threshold_for(m) && nb >= mparams.mmap_threshold) {
+    reset_mmap_threshold(m);
+    if (use_mmap(m) && m->topsize != 0) {
+      void* mem = mmap_alloc(m, nb, flags);
+      if (mem != 0)
+        return mem;
+    }
+  }
+
   MALLOC_FAILURE_ACTION;
   return 0;
 }
 
 /* -----------------------  system deallocation -------------------------- */
 
-/* Unmap and unlink any mmapped segments that don't contain used chunks */
+/* Counts one trim, however many places it released memory from */
+static void note_trim(mstate m, size_t released) {
+  if (released != 0) {
+    ++m->trims;
+    m->trimmed += released;
+  }
+}
+
+/* Unmap and unlink any mmapped segments that don't contain used chunks.
+   The caller counts what was released with note_trim. */
 static size_t release_unused_segments(mstate m) {
   size_t released = 0;
   int nsegs = 0;
@@ -4534,7 +5123,12 @@ static size_t release_unused_segments(mstate m) {
         else {
           unlink_large_chunk(m, tp);
         }
+#if USE_PAGEMAP
+        /* Forget the pages before another thread can map them */
+        pagemap_clear(base, size);
+#endif /* USE_PAGEMAP */
         if (CALL_MUNMAP(0/*segment*/, base, size) == 0) {
+          NEDPROBE3(segment_release, m, base, size);
           released += size;
           m->footprint -= size;
           /* unlink obsoleted record */
@@ -4542,6 +5136,9 @@ static size_t release_unused_segments(mstate m) {
           sp->next = next;
         }
         else { /* back out if cannot unmap */
+#if USE_PAGEMAP
+          (void)pagemap_set(base, size, m);
+#endif /* USE_PAGEMAP */
           insert_large_chunk(m, tp, psize);
         }
       }
@@ -4576,11 +5173,28 @@ static int sys_trim(mstate m, size_t pad) {
               sp->size >= extra &&
               !has_segment_link(m, sp)) { /* can't shrink if pinned */
             size_t newsize = sp->size - extra;
+#if USE_PAGEMAP
+            /* Forget the pages before another thread can map them */
+            pagemap_clear(sp->base + newsize, extra);
+#endif /* USE_PAGEMAP */
             /* Prefer mremap, fall back to munmap */
             if ((CALL_MREMAP(sp->base, sp->size, newsize, 0) != MFAIL) ||
                 (CALL_MUNMAP(0/*segment*/, sp->base + newsize, extra) == 0)) {
               released = extra;
             }
+#if USE_PAGEMAP
+            else
+              (void)pagemap_set(sp->base + newsize, extra, m);
+#endif /* USE_PAGEMAP */
+          }
+        }
+        else if (is_reserved_segment(sp)) {
+          if (sp->size >= extra &&
+              CALL_DECOMMIT(sp->base + sp->size - extra, extra) == 0) {
+            released = extra;
+#if USE_PAGEMAP /* The address space stays reserved to this mspace */
+            pagemap_clear(sp->base + sp->size - extra, extra);
+#endif /* USE_PAGEMAP */
           }
         }
         else if (HAVE_MORECORE) {
@@ -4591,10 +5205,19 @@ static int sys_trim(mstate m, size_t pad) {
             /* Make sure end of memory is where we last set it. */
             char* old_br = (char*)(CALL_MORECORE(0));
             if (old_br == sp->base + sp->size) {
-              char* rel_br = (char*)(CALL_MORECORE(-extra));
-              char* new_br = (char*)(CALL_MORECORE(0));
+              char* rel_br;
+              char* new_br;
+#if USE_PAGEMAP
+              pagemap_clear(old_br - extra, extra);
+#endif /* USE_PAGEMAP */
+              rel_br = (char*)(CALL_MORECORE(-extra));
+              new_br = (char*)(CALL_MORECORE(0));
               if (rel_br != CMFAIL && new_br < old_br)
                 released = old_br - new_br;
+#if USE_PAGEMAP
+              if (released < extra) /* Restore whatever is still ours */
+                (void)pagemap_set(old_br - extra, extra - released, m);
+#endif /* USE_PAGEMAP */
             }
           }
           RELEASE_MALLOC_GLOBAL_LOCK();
@@ -4604,6 +5227,7 @@ static int sys_trim(mstate m, size_t pad) {
       if (released != 0) {
         sp->size -= released;
         m->footprint -= released;
+        NEDPROBE2(sys_trim, m, released);
         init_top(m, m->top, m->topsize - released);
         check_top_chunk(m, m->top);
       }
@@ -4612,6 +5236,7 @@ static int sys_trim(mstate m, size_t pad) {
     /* Unmap any unused mmapped segments */
     if (HAVE_MMAP)
       released += release_unused_segments(m);
+    note_trim(m, released);
 
     /* On failure, disable autotrim to avoid repeated failed future calls */
     if (released == 0 && m->topsize > m->trim_check)
@@ -4748,7 +5373,8 @@ static void* internal_realloc(mstate m, void* oldmem, size_t bytes, size_t align
     mchunkptr newp = 0;
     void* extra = 0;
 
-    /* Try to either shrink or extend into top. Else malloc-copy-free */
+    /* Try to either shrink or extend into top, dv or a free successor.
+       Else malloc-copy-free */
 
     if (RTCHECK(ok_address(m, oldp) && ok_inuse(oldp) &&
                 ok_next(oldp, next) && ok_pinuse(next))) {
@@ -4776,6 +5402,45 @@ static void* internal_realloc(mstate m, void* oldmem, size_t bytes, size_t align
         m->topsize = newtopsize;
         newp = oldp;
       }
+      else if (next == m->dv && oldsize + m->dvsize >= nb) {
+        /* Expand into dv */
+        size_t dsize = oldsize + m->dvsize - nb;
+        if (dsize >= MIN_CHUNK_SIZE) {
+          mchunkptr r = chunk_plus_offset(oldp, nb);
+          mchunkptr n = chunk_plus_offset(r, dsize);
+          set_inuse(m, oldp, nb);
+          set_size_and_pinuse_of_free_chunk(r, dsize);
+          clear_pinuse(n);
+          m->dvsize = dsize;
+          m->dv = r;
+        }
+        else { /* exhaust dv */
+          size_t newsize = oldsize + m->dvsize;
+          set_inuse(m, oldp, newsize);
+          m->dvsize = 0;
+          m->dv = 0;
+        }
+        newp = oldp;
+      }
+      else if (!cinuse(next) && next != m->top && next != m->dv) {
+        /* Expand into a free successor, returning any tail */
+        size_t nextsize = chunksize(next);
+        if (oldsize + nextsize >= nb) {
+          size_t rsize = oldsize + nextsize - nb;
+          unlink_chunk(m, next, nextsize);
+          if (rsize < MIN_CHUNK_SIZE) {
+            size_t newsize = oldsize + nextsize;
+            set_inuse(m, oldp, newsize);
+          }
+          else {
+            mchunkptr remainder = chunk_plus_offset(oldp, nb);
+            set_inuse(m, oldp, nb);
+            set_inuse_and_pinuse(m, remainder, rsize);
+            extra = chunk2mem(remainder);
+          }
+          newp = oldp;
+        }
+      }
     }
     else {
       USAGE_ERROR_ACTION(m, oldmem);
@@ -5195,7 +5860,11 @@ void dlfree(void* mem) {
           size_t prevsize = p->prev_foot;
           if (is_mmapped(p)) {
             char* mm = (char*)p - prevsize;
+            ++fm->mmap_frees;
             psize += prevsize + MMAP_FOOT_PAD;
+#if USE_PAGEMAP
+            pagemap_clear(mm, psize);
+#endif /* USE_PAGEMAP */
             if (CALL_MUNMAP(*(void**)mm, mm, psize) == 0)
               fm->footprint -= psize;
             goto postaction;
@@ -5262,7 +5931,7 @@ void dlfree(void* mem) {
             insert_large_chunk(fm, tp, psize);
             check_free_chunk(fm, p);
             if (--fm->release_checks == 0)
-              release_unused_segments(fm);
+              note_trim(fm, release_unused_segments(fm));
           }
           goto postaction;
         }
@@ -5429,6 +6098,13 @@ mspace create_mspace(size_t capacity, int locked) {
       m = init_user_mstate(tbase, tsize);
       m->seg.sflags = USE_MMAP_BIT;
       set_lock(m, locked);
+#if USE_PAGEMAP
+      if (!pagemap_set(tbase, tsize, m)) {
+        DESTROY_LOCK(&m->mutex);
+        CALL_MUNMAP(0/*segment*/, tbase, tsize);
+        m = 0;
+      }
+#endif /* USE_PAGEMAP */
     }
   }
   return (mspace)m;
@@ -5444,6 +6120,40 @@ mspace create_mspace_with_base(void* base, size_t capacity, int locked) {
     m = init_user_mstate((char*)base, capacity);
     m->seg.sflags = EXTERN_BIT;
     set_lock(m, locked);
+#if USE_PAGEMAP
+    if (!pagemap_set((char*)base, capacity, m)) {
+      DESTROY_LOCK(&m->mutex);
+      m = 0;
+    }
+#endif /* USE_PAGEMAP */
+  }
+  return (mspace)m;
+}
+
+mspace create_mspace_with_reservation(void* base, size_t capacity, int locked) {
+  mstate m = 0;
+  size_t msize;
+  ensure_initialization();
+  msize = pad_request(sizeof(struct malloc_state));
+  if (capacity >= mparams.granularity &&
+      capacity < (size_t) -(msize + TOP_FOOT_SIZE + mparams.page_size)) {
+    size_t tsize = mparams.granularity;
+    if (tsize < msize + TOP_FOOT_SIZE + mparams.page_size)
+      tsize = granularity_align(msize + TOP_FOOT_SIZE + mparams.page_size);
+    if (tsize <= capacity && CALL_COMMIT(base, tsize) == 0) {
+      m = init_user_mstate((char*)base, tsize);
+      m->seg.sflags = RESERVED_BIT;
+      m->resv_end = (char*)base + capacity;
+      disable_mmap(m); /* Keep every chunk within the reservation */
+      set_lock(m, locked);
+#if USE_PAGEMAP
+      if (!pagemap_set((char*)base, tsize, m)) {
+        DESTROY_LOCK(&m->mutex);
+        CALL_DECOMMIT(base, tsize);
+        m = 0;
+      }
+#endif /* USE_PAGEMAP */
+    }
   }
   return (mspace)m;
 }
@@ -5468,14 +6178,22 @@ size_t destroy_mspace(mspace msp) {
   mstate ms = (mstate)msp;
   if (ok_magic(ms)) {
     msegmentptr sp = &ms->seg;
+#if MMAP_CACHE_ENTRIES
+    mmcache_release(ms);
+#endif /* MMAP_CACHE_ENTRIES */
     while (sp != 0) {
       char* base = sp->base;
       size_t size = sp->size;
       flag_t flag = sp->sflags;
       sp = sp->next;
+#if USE_PAGEMAP
+      pagemap_clear(base, size);
+#endif /* USE_PAGEMAP */
       if ((flag & USE_MMAP_BIT) && !(flag & EXTERN_BIT) &&
           CALL_MUNMAP(0/*segment*/, base, size) == 0)
         freed += size;
+      else if ((flag & RESERVED_BIT) && CALL_DECOMMIT(base, size) == 0)
+        freed += size;
     }
     DESTROY_LOCK(&ms->mutex);
   }
@@ -5624,6 +6342,11 @@ void* mspace_malloc2(mspace msp, size_t bytes, size_t alignment, unsigned flags)
     if (calloc_must_clear(p))
       memset(mem, 0, chunksize(p) - overhead_for(p));
   }
+  if (mem && (flags & M2_PREFAULT)) {
+    mchunkptr p = mem2chunk(mem);
+    if (!DIRECT_MMAP_PREFAULTS || !is_mmapped(p))
+      prefault_memory(mem, chunksize(p) - overhead_for(p));
+  }
   return mem;
 }
 
@@ -5649,7 +6372,16 @@ void mspace_free(mspace msp, void* mem) {
           size_t prevsize = p->prev_foot;
           if (is_mmapped(p)) {
             char* mm = (char*)p - prevsize;
+            ++fm->mmap_frees;
+            raise_mmap_threshold(fm, psize);
             psize += prevsize + MMAP_FOOT_PAD;
+#if MMAP_CACHE_ENTRIES
+            if (mmcache_put(fm, mm, psize))
+              goto postaction;
+#endif /* MMAP_CACHE_ENTRIES */
+#if USE_PAGEMAP
+            pagemap_clear(mm, psize);
+#endif /* USE_PAGEMAP */
             if (CALL_MUNMAP(*(void**)mm, mm, psize) == 0)
               fm->footprint -= psize;
             goto postaction;
@@ -5716,7 +6448,7 @@ void mspace_free(mspace msp, void* mem) {
             insert_large_chunk(fm, tp, psize);
             check_free_chunk(fm, p);
             if (--fm->release_checks == 0)
-              release_unused_segments(fm);
+              note_trim(fm, release_unused_segments(fm));
           }
           goto postaction;
         }
@@ -5743,7 +6475,7 @@ void* mspace_calloc(mspace msp, size_t n_elements, size_t elem_size) {
         (req / n_elements != elem_size))
       req = MAX_SIZE_T; /* force downstream failure on overflow */
   }
-  mem = internal_malloc(ms, req, 0);
+  mem = internal_malloc(ms, req, M2_ZERO_MEMORY);
   if (mem != 0) {
     mchunkptr p = mem2chunk(mem);
     if (calloc_must_clear(p))
@@ -5782,6 +6514,12 @@ void* mspace_realloc2(mspace msp, void* oldmem, size_t bytes, size_t alignment,
         memset((char*)mem + oldsize, 0, newsize - oldsize);
       }
     }
+    if (mem && (flags & M2_PREFAULT) && bytes > oldsize) {
+      size_t newsize;
+      p = mem2chunk(mem);
+      newsize = chunksize(p) - overhead_for(p);
+      prefault_memory((char*)mem + oldsize, newsize - oldsize);
+    }
     return mem;
   }
 }
@@ -5824,7 +6562,11 @@ int mspace_trim(mspace msp, size_t pad) {
   mstate ms = (mstate)msp;
   if (ok_magic(ms)) {
     if (!PREACTION(ms)) {
+      reset_mmap_threshold(ms);
       result = sys_trim(ms, pad);
+#if MMAP_CACHE_ENTRIES
+      result |= mmcache_release(ms);
+#endif /* MMAP_CACHE_ENTRIES */
       POSTACTION(ms);
     }
   }
@@ -0,0 +1,642 @@
+/* nedbench.cpp
+Runs the standard multithreaded allocator benchmarks against nedmalloc, the system
+allocator or dlmalloc and reports the results as a table, CSV or JSON.
+
+larson          Server churn. Each thread frees and replaces random blocks of a set it
+                inherited from the previous generation of threads, so most frees are of
+                blocks a thread which has since exited allocated.
+xmalloc         Producer/consumer. Each thread allocates blocks and hands them to the
+                next thread, which frees them, so every free is remote.
+cache-scratch   Passive false sharing. Each thread frees a small block which the main
+                thread allocated next to the other threads' ones, then repeatedly
+                allocates, writes to and frees a block of the same size.
+cache-thrash    Active false sharing. As cache-scratch without the initial block, so only
+                an allocator handing neighbouring blocks to different threads shares lines.
+threadtest      Each thread repeatedly allocates its share of a fixed number of small
+                blocks and then frees them all.
+frag            Fragmentation stress. Each thread keeps a set of blocks of widely varying
+                size, periodically frees every other one and refills the holes with larger
+                blocks. Compare the RSS rise with peak live bytes to see what was wasted.
+
+Memory use is sampled every millisecond and reported as the rise in RSS over the run.
+Allocators don't give back everything they get, so on POSIX each run happens in a
+child process of its own. On Windows runs share the process, so run one allocator per
+process when comparing memory use.
+*/
+
+#define FORCEINLINE
+#define NOINLINE
+
+#include "nedmalloc.c"
+#include <vector>
+#ifdef WIN32
+#include <psapi.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+#ifdef WIN32
+typedef unsigned __int64 usCount;
+static usCount GetUsCount()
+{
+	static LARGE_INTEGER ticksPerSec;
+	static double scalefactor;
+	LARGE_INTEGER val;
+	if(!scalefactor)
+	{
+		if(QueryPerformanceFrequency(&ticksPerSec))
+			scalefactor=ticksPerSec.QuadPart/1000000000000.0;
+		else
+			scalefactor=1;
+	}
+	if(!QueryPerformanceCounter(&val))
+		return (usCount) GetTickCount() * 1000000000;
+	return (usCount) (val.QuadPart/scalefactor);
+}
+static DWORD WINAPI _threadcode(LPVOID a);
+#define THREADVAR HANDLE
+#define THREADINIT(v, t) (*v=CreateThread(NULL, 0, _threadcode, (LPVOID)(t), 0, NULL))
+#define THREADSLEEP(v) SleepEx(v, FALSE)
+#define THREADYIELD() SleepEx(0, FALSE)
+#define THREADWAIT(v) (WaitForSingleObject(v, INFINITE), CloseHandle(v))
+/* MSVC gives volatile accesses acquire and release semantics */
+#define BENCH_LOAD(p)		(*(p))
+#define BENCH_STORE(p, v)	(*(p)=(v))
+#ifdef _WIN64
+#define BENCH_ADD(p, v)		InterlockedExchangeAdd64((volatile LONGLONG *)(p), (LONGLONG)(v))
+#else
+#define BENCH_ADD(p, v)		InterlockedExchangeAdd((volatile LONG *)(p), (LONG)(v))
+#endif
+#define BENCH_SUB(p, v)		BENCH_ADD((p), 0-(v))
+#else
+#include <sys/time.h>
+
+typedef unsigned long long usCount;
+static usCount GetUsCount()
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((usCount) ts.tv_sec*1000000000000LL)+ts.tv_nsec*1000LL;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return ((usCount) tv.tv_sec*1000000000000LL)+tv.tv_usec*1000000LL;
+#endif
+}
+static void *_threadcode(void *a);
+#define THREADVAR pthread_t
+#define THREADINIT(v, t) pthread_create(v, NULL, _threadcode, (void *)(t))
+#define THREADSLEEP(v) usleep(v*1000)
+#define THREADYIELD() sched_yield()
+#define THREADWAIT(v) pthread_join(v, NULL)
+#define BENCH_LOAD(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define BENCH_STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define BENCH_ADD(p, v)		__atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define BENCH_SUB(p, v)		__atomic_fetch_sub((p), (v), __ATOMIC_RELAXED)
+#endif
+
+static size_t CurrentRSS()
+{
+#ifdef WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	return GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)) ? pmc.WorkingSetSize : 0;
+#elif defined(__linux__)
+	unsigned long pages=0, resident=0;
+	FILE *ih=fopen("/proc/self/statm", "r");
+	if(!ih) return 0;
+	if(2!=fscanf(ih, "%lu %lu", &pages, &resident)) resident=0;
+	fclose(ih);
+	return (size_t) resident*sysconf(_SC_PAGESIZE);
+#else
+	return 0;
+#endif
+}
+
+static void *nedmalloc_wrapper(size_t size)
+{
+	return nedalloc::nedpmalloc(0, size);
+}
+static void nedfree_wrapper(void *mem)
+{
+	nedalloc::nedpfree(0, mem);
+}
+static void *sysmalloc_wrapper(size_t size)
+{
+	return malloc(size);
+}
+static void sysfree_wrapper(void *mem)
+{
+	free(mem);
+}
+static mspace mymspace = create_mspace(0,1);
+static void *dlmalloc_wrapper(size_t size)
+{
+	return mspace_malloc(mymspace, size);
+}
+static void dlfree_wrapper(void *mem)
+{
+	mspace_free(mymspace, mem);
+}
+
+struct Allocator
+{
+	const char *name, *shortname;
+	void *(*malloc)(size_t size);
+	void (*free)(void *mem);
+};
+static Allocator allocators[]={
+	{ "nedmalloc", "nedmalloc", &nedmalloc_wrapper, &nedfree_wrapper },
+	{ "System allocator", "sysalloc", &sysmalloc_wrapper, &sysfree_wrapper },
+	{ "dlmalloc", "dlmalloc", &dlmalloc_wrapper, &dlfree_wrapper }
+};
+
+struct BenchThread
+{
+	unsigned int index, seed;
+	size_t ops;						/* Allocator calls made */
+	std::vector<void *> blocks;		/* Blocks carried between rounds or handed over by the main thread */
+	std::vector<size_t> sizes;
+	THREADVAR thread;
+};
+
+static Allocator *benchallocator;
+static void (*benchthread)(BenchThread &t);
+static std::vector<BenchThread> threads;
+static unsigned int threadcount;
+static double scale=1;
+static volatile size_t live;		/* Bytes allocated and not yet freed, if the workload counts them */
+static volatile int done;
+static size_t peakrss;
+static size_t peaklive;
+
+static inline unsigned int rnd(unsigned int &seed)
+{	/* xorshift32 */
+	seed^=seed<<13;
+	seed^=seed>>17;
+	seed^=seed<<5;
+	return seed;
+}
+static inline void *touch(void *mem, size_t size)
+{	/* Programs write to what they allocate, so fault it in as they would */
+	const size_t pagesize=mparams.page_size;
+	for(volatile char *p=(volatile char *) mem, *pend=(volatile char *) mem+size; mem && p<pend; p+=pagesize)
+		*p=1;
+	return mem;
+}
+static void nothing()
+{
+}
+static void freeblocks()
+{
+	for(std::vector<BenchThread>::iterator t=threads.begin(); t!=threads.end(); ++t)
+	{
+		for(std::vector<void *>::iterator b=t->blocks.begin(); b!=t->blocks.end(); ++b)
+			if(*b) benchallocator->free(*b);
+		t->blocks.clear();
+	}
+}
+
+/* larson: Each generation of threads runs to completion before the next is started with
+the blocks the previous one left, where the original has each thread start its successor */
+#define LARSON_BLOCKS 1000			/* Per thread */
+#define LARSON_MINSIZE 16
+#define LARSON_MAXSIZE 512
+#define LARSON_ROUNDS 10
+#define LARSON_OPS 100000			/* Replacements per thread per round */
+static void larson_prepare()
+{
+	for(std::vector<BenchThread>::iterator t=threads.begin(); t!=threads.end(); ++t)
+	{
+		t->blocks.resize(LARSON_BLOCKS);
+		for(size_t i=0; i<LARSON_BLOCKS; i++)
+			t->blocks[i]=touch(benchallocator->malloc(LARSON_MINSIZE+rnd(t->seed)%(LARSON_MAXSIZE-LARSON_MINSIZE)), 1);
+	}
+}
+static void larson(BenchThread &t)
+{
+	size_t n, ops=(size_t)(LARSON_OPS*scale);
+	for(n=0; n<ops; n++)
+	{
+		size_t i=rnd(t.seed)%LARSON_BLOCKS;
+		benchallocator->free(t.blocks[i]);
+		t.blocks[i]=touch(benchallocator->malloc(LARSON_MINSIZE+rnd(t.seed)%(LARSON_MAXSIZE-LARSON_MINSIZE)), 1);
+	}
+	t.ops+=2*ops;
+}
+
+/* xmalloc: Thread n hands the blocks it allocates to thread n+1 through a ring */
+#define XMALLOC_BLOCKS 200000		/* Produced per thread */
+#define XMALLOC_MINSIZE 16
+#define XMALLOC_MAXSIZE 512
+#define XMALLOC_RINGSIZE 1024
+struct XmallocRing
+{
+	void *items[XMALLOC_RINGSIZE];
+	volatile size_t head;			/* Written only by the producer */
+	char pad1[64];
+	volatile size_t tail;			/* Written only by the consumer */
+	char pad2[64];
+};
+static XmallocRing *rings;
+static void xmalloc_prepare()
+{
+	rings=(XmallocRing *) calloc(threadcount, sizeof(XmallocRing));
+}
+static void xmalloc_finish()
+{
+	free(rings);
+	rings=0;
+}
+static void xmalloc(BenchThread &t)
+{
+	XmallocRing &out=rings[t.index], &in=rings[(t.index+threadcount-1)%threadcount];
+	size_t produced=0, consumed=0, count=(size_t)(XMALLOC_BLOCKS*scale);
+	while(produced<count || consumed<count)
+	{
+		int progress=0;
+		if(produced<count && out.head-BENCH_LOAD(&out.tail)<XMALLOC_RINGSIZE)
+		{
+			out.items[out.head%XMALLOC_RINGSIZE]=touch(benchallocator->malloc(XMALLOC_MINSIZE+rnd(t.seed)%(XMALLOC_MAXSIZE-XMALLOC_MINSIZE)), 1);
+			BENCH_STORE(&out.head, out.head+1);
+			produced++;
+			progress=1;
+		}
+		if(in.tail!=BENCH_LOAD(&in.head))
+		{
+			benchallocator->free(in.items[in.tail%XMALLOC_RINGSIZE]);
+			BENCH_STORE(&in.tail, in.tail+1);
+			consumed++;
+			progress=1;
+		}
+		if(!progress) THREADYIELD();
+	}
+	t.ops+=produced+consumed;
+}
+
+/* cache-scratch and cache-thrash */
+#define CACHE_OBJSIZE 8
+#define CACHE_ITERATIONS 10000		/* Per thread */
+#define CACHE_WRITES 1000			/* Per block */
+static void cachethrash(BenchThread &t)
+{
+	size_t n, iterations=(size_t)(CACHE_ITERATIONS*scale);
+	for(n=0; n<iterations; n++)
+	{
+		volatile char *p=(volatile char *) benchallocator->malloc(CACHE_OBJSIZE);
+		for(int w=0; w<CACHE_WRITES; w++)
+			for(int b=0; b<CACHE_OBJSIZE; b++)
+				p[b]++;
+		benchallocator->free((void *) p);
+	}
+	t.ops+=2*iterations;
+}
+static void cachescratch_prepare()
+{
+	for(std::vector<BenchThread>::iterator t=threads.begin(); t!=threads.end(); ++t)
+		t->blocks.push_back(touch(benchallocator->malloc(CACHE_OBJSIZE), 1));
+}
+static void cachescratch(BenchThread &t)
+{
+	benchallocator->free(t.blocks[0]);
+	t.blocks[0]=0;
+	t.ops++;
+	cachethrash(t);
+}
+
+/* threadtest */
+#define THREADTEST_BLOCKS 100000	/* Shared between the threads */
+#define THREADTEST_SIZE 64
+#define THREADTEST_ITERATIONS 50
+static void threadtest_prepare()
+{
+	for(std::vector<BenchThread>::iterator t=threads.begin(); t!=threads.end(); ++t)
+		t->blocks.resize(THREADTEST_BLOCKS/threadcount);
+}
+static void threadtest(BenchThread &t)
+{
+	size_t n, i, count=t.blocks.size(), iterations=(size_t)(THREADTEST_ITERATIONS*scale);
+	for(n=0; n<iterations; n++)
+	{
+		for(i=0; i<count; i++)
+			t.blocks[i]=touch(benchallocator->malloc(THREADTEST_SIZE), 1);
+		for(i=0; i<count; i++)
+		{
+			benchallocator->free(t.blocks[i]);
+			t.blocks[i]=0;
+		}
+	}
+	t.ops+=2*count*iterations;
+}
+
+/* frag */
+#define FRAG_BLOCKS 4096			/* Per thread */
+#define FRAG_OPS 100000				/* Replacements per thread */
+#define FRAG_PHASE 10000			/* Replacements between freeing every other block */
+static size_t fragsize(unsigned int &seed, unsigned int phase)
+{	/* Roughly log uniform between 16 bytes and 32Kb with the odd block sixteen times
+	that, all getting bigger with each phase so they don't fit the holes left by the last */
+	size_t size=(size_t) 16<<(rnd(seed)%11);
+	size+=rnd(seed)%size;
+	if(!(rnd(seed)%64)) size*=16;
+	return size+size*phase/8;
+}
+static void frag_prepare()
+{
+	for(std::vector<BenchThread>::iterator t=threads.begin(); t!=threads.end(); ++t)
+	{
+		t->blocks.resize(FRAG_BLOCKS);
+		t->sizes.resize(FRAG_BLOCKS);
+	}
+}
+static void frag(BenchThread &t)
+{
+	size_t n, i, ops=(size_t)(FRAG_OPS*scale);
+	unsigned int phase=0;
+	for(n=0; n<ops; n++)
+	{
+		if(n && !(n%FRAG_PHASE))
+		{	/* The survivors pin the holes */
+			phase++;
+			for(i=phase&1; i<FRAG_BLOCKS; i+=2)
+				if(t.blocks[i])
+				{
+					benchallocator->free(t.blocks[i]);
+					BENCH_SUB(&live, t.sizes[i]);
+					t.blocks[i]=0;
+					t.ops++;
+				}
+		}
+		i=rnd(t.seed)%FRAG_BLOCKS;
+		if(t.blocks[i])
+		{
+			benchallocator->free(t.blocks[i]);
+			BENCH_SUB(&live, t.sizes[i]);
+			t.ops++;
+		}
+		t.sizes[i]=fragsize(t.seed, phase);
+		if((t.blocks[i]=touch(benchallocator->malloc(t.sizes[i]), t.sizes[i])))
+			BENCH_ADD(&live, t.sizes[i]);
+		t.ops++;
+	}
+	for(i=0; i<FRAG_BLOCKS; i++)
+		if(t.blocks[i])
+		{
+			benchallocator->free(t.blocks[i]);
+			BENCH_SUB(&live, t.sizes[i]);
+			t.blocks[i]=0;
+			t.ops++;
+		}
+}
+
+struct Workload
+{
+	const char *name;
+	void (*prepare)();				/* Run on the main thread before timing starts */
+	void (*thread)(BenchThread &t);
+	void (*finish)();				/* Run on the main thread after timing stops */
+	unsigned int rounds;			/* Generations of threads */
+};
+static Workload workloads[]={
+	{ "larson", &larson_prepare, &larson, &freeblocks, LARSON_ROUNDS },
+	{ "xmalloc", &xmalloc_prepare, &xmalloc, &xmalloc_finish, 1 },
+	{ "cache-scratch", &cachescratch_prepare, &cachescratch, &freeblocks, 1 },
+	{ "cache-thrash", &nothing, &cachethrash, &nothing, 1 },
+	{ "threadtest", &threadtest_prepare, &threadtest, &freeblocks, 1 },
+	{ "frag", &frag_prepare, &frag, &freeblocks, 1 }
+};
+
+#ifdef WIN32
+static DWORD WINAPI _threadcode(LPVOID a)
+#else
+static void *_threadcode(void *a)
+#endif
+{
+	if(a) benchthread(*(BenchThread *) a);
+	else
+	{	/* Memory sampler */
+		size_t rss, l;
+		while(!BENCH_LOAD(&done))
+		{
+			if((rss=CurrentRSS())>peakrss) peakrss=rss;
+			if((l=BENCH_LOAD(&live))>peaklive) peaklive=l;
+			THREADSLEEP(1);
+		}
+	}
+	return 0;
+}
+
+struct Result
+{
+	const char *workload, *allocator;
+	unsigned int threads;
+	size_t ops;
+	double seconds;
+	size_t startrss, peakrss, peaklive;
+};
+static Result run(const Workload &w, Allocator &a, unsigned int count)
+{
+	Result r;
+	THREADVAR sampler;
+	usCount start, end;
+	unsigned int n, round;
+	benchallocator=&a;
+	benchthread=w.thread;
+	threadcount=count;
+	threads.clear();
+	threads.resize(count);
+	for(n=0; n<count; n++)
+	{
+		threads[n].index=n;
+		threads[n].seed=n*2654435761U+1;
+		threads[n].ops=0;
+	}
+	w.prepare();
+	live=0;
+	peaklive=0;
+	done=0;
+	r.startrss=peakrss=CurrentRSS();
+	THREADINIT(&sampler, 0);
+	start=GetUsCount();
+	for(round=0; round<w.rounds; round++)
+	{
+		for(n=0; n<count; n++)
+			THREADINIT(&threads[n].thread, &threads[n]);
+		for(n=0; n<count; n++)
+			THREADWAIT(threads[n].thread);
+	}
+	end=GetUsCount();
+	BENCH_STORE(&done, 1);
+	THREADWAIT(sampler);
+	w.finish();
+	r.workload=w.name;
+	r.allocator=a.shortname;
+	r.threads=count;
+	r.ops=0;
+	for(n=0; n<count; n++)
+		r.ops+=threads[n].ops;
+	r.seconds=(double)(end-start)/1000000000000.0;
+	r.peakrss=peakrss;
+	r.peaklive=peaklive;
+	return r;
+}
+#ifndef WIN32
+static Result runisolated(const Workload &w, Allocator &a, unsigned int count)
+{	/* Runs in a child process so the run starts with none of the memory earlier runs left behind */
+	Result r;
+	int fds[2], status;
+	pid_t pid;
+	fflush(stdout);
+	if(pipe(fds)) return run(w, a, count);
+	if(-1==(pid=fork()))
+	{
+		close(fds[0]);
+		close(fds[1]);
+		return run(w, a, count);
+	}
+	if(!pid)
+	{
+		close(fds[0]);
+		r=run(w, a, count);
+		_exit(sizeof(r)==write(fds[1], &r, sizeof(r)) ? 0 : 1);
+	}
+	close(fds[1]);
+	if(sizeof(r)!=read(fds[0], &r, sizeof(r)))
+	{
+		fprintf(stderr, "The %s run with %s and %u threads failed\n", w.name, a.shortname, count);
+		exit(1);
+	}
+	close(fds[0]);
+	waitpid(pid, &status, 0);
+	return r;
+}
+#else
+#define runisolated run
+#endif
+
+static void usage(const char *argv0)
+{
+	unsigned int n;
+	fprintf(stderr, "Usage: %s [-a <allocator>|all] [-w <workload>|all] [-t <threads>[,<threads>...]] [-s <scale>] [-f text|csv|json]\n\nAllocators are", argv0);
+	for(n=0; n<sizeof(allocators)/sizeof(Allocator); n++)
+		fprintf(stderr, " %s", allocators[n].shortname);
+	fprintf(stderr, ", defaulting to nedmalloc.\nWorkloads are");
+	for(n=0; n<sizeof(workloads)/sizeof(Workload); n++)
+		fprintf(stderr, " %s", workloads[n].name);
+	fprintf(stderr, ", defaulting to all of them.\nThreads defaults to 4. Scale multiplies the work each workload does.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	std::vector<Allocator *> runallocators;
+	std::vector<Workload *> runworkloads;
+	std::vector<unsigned int> threadcounts;
+	std::vector<Result> results;
+	const char *format="text";
+	unsigned int n;
+	int i;
+	for(i=1; i<argc; i++)
+	{
+		const char *arg=argv[i+1];
+		if(i+1==argc || argv[i][0]!='-' || !argv[i][1] || argv[i][2])
+		{
+			usage(argv[0]);
+			return 1;
+		}
+		switch(argv[i++][1])
+		{
+		case 'a':
+			for(n=0; n<sizeof(allocators)/sizeof(Allocator); n++)
+				if(!strcmp(arg, "all") || !strcmp(arg, allocators[n].shortname))
+					runallocators.push_back(allocators+n);
+			if(runallocators.empty())
+			{
+				fprintf(stderr, "Unknown allocator %s\n", arg);
+				return 1;
+			}
+			break;
+		case 'w':
+			for(n=0; n<sizeof(workloads)/sizeof(Workload); n++)
+				if(!strcmp(arg, "all") || !strcmp(arg, workloads[n].name))
+					runworkloads.push_back(workloads+n);
+			if(runworkloads.empty())
+			{
+				fprintf(stderr, "Unknown workload %s\n", arg);
+				return 1;
+			}
+			break;
+		case 't':
+			for(char *p=(char *) arg; *p; )
+			{
+				unsigned long count=strtoul(p, &p, 10);
+				if(!count || (*p && *p++!=','))
+				{
+					fprintf(stderr, "Bad thread count %s\n", arg);
+					return 1;
+				}
+				threadcounts.push_back((unsigned int) count);
+			}
+			break;
+		case 's':
+			if((scale=atof(arg))<=0)
+			{
+				fprintf(stderr, "Bad scale %s\n", arg);
+				return 1;
+			}
+			break;
+		case 'f':
+			format=arg;
+			if(strcmp(format, "text") && strcmp(format, "csv") && strcmp(format, "json"))
+			{
+				fprintf(stderr, "Unknown format %s\n", arg);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if(runallocators.empty()) runallocators.push_back(allocators);
+	if(runworkloads.empty())
+		for(n=0; n<sizeof(workloads)/sizeof(Workload); n++)
+			runworkloads.push_back(workloads+n);
+	if(threadcounts.empty()) threadcounts.push_back(4);
+
+	if(!strcmp(format, "text"))
+		printf("%-14s %-10s %7s %10s %13s %12s %12s\n", "Workload", "Allocator", "Threads", "Seconds", "Ops/sec", "RSS rise Kb", "Peak live Kb");
+	else if(!strcmp(format, "csv"))
+		printf("workload,allocator,threads,operations,seconds,opspersec,startrss,peakrss,peaklive\n");
+	for(std::vector<Workload *>::const_iterator w=runworkloads.begin(); w!=runworkloads.end(); ++w)
+		for(std::vector<unsigned int>::const_iterator t=threadcounts.begin(); t!=threadcounts.end(); ++t)
+			for(std::vector<Allocator *>::const_iterator a=runallocators.begin(); a!=runallocators.end(); ++a)
+			{
+				Result r=runisolated(**w, **a, *t);
+				double rate=r.seconds>0 ? r.ops/r.seconds : 0.0;
+				results.push_back(r);
+				if(!strcmp(format, "text"))
+				{
+					printf("%-14s %-10s %7u %10.3f %13.0f %12lu ", r.workload, r.allocator, r.threads, r.seconds, rate, (unsigned long)((r.peakrss-r.startrss)/1024));
+					if(r.peaklive)
+						printf("%12lu\n", (unsigned long)(r.peaklive/1024));
+					else
+						printf("%12s\n", "-");
+				}
+				else if(!strcmp(format, "csv"))
+					printf("%s,%s,%u,%lu,%f,%.0f,%lu,%lu,%lu\n", r.workload, r.allocator, r.threads, (unsigned long) r.ops, r.seconds, rate,
+						(unsigned long) r.startrss, (unsigned long) r.peakrss, (unsigned long) r.peaklive);
+				fflush(stdout);
+			}
+	if(!strcmp(format, "json"))
+	{
+		printf("{\"results\":[");
+		for(std::vector<Result>::const_iterator r=results.begin(); r!=results.end(); ++r)
+			printf("%s\n {\"workload\":\"%s\",\"allocator\":\"%s\",\"threads\":%u,\"operations\":%lu,\"seconds\":%f,\"opspersec\":%.0f,\"startrss\":%lu,\"peakrss\":%lu,\"peaklive\":%lu}",
+				r==results.begin() ? "" : ",", r->workload, r->allocator, r->threads, (unsigned long) r->ops, r->seconds,
+				r->seconds>0 ? r->ops/r->seconds : 0.0, (unsigned long) r->startrss, (unsigned long) r->peakrss, (unsigned long) r->peaklive);
+		printf("\n]}\n");
+	}
+	return 0;
+}
@@ -79,6 +79,7 @@ DEALINGS IN THE SOFTWARE.
 
 #include "nedmalloc.h"
 #include <errno.h>
+#include <stdarg.h>
 #ifdef HAVE_VALGRIND
 #include <valgrind/valgrind.h>
 #include <valgrind/memcheck.h>
@@ -176,6 +177,20 @@ extern void *userpage_realloc(void *mem, size_t oldsize, size_t newsize, int fla
 /*#undef DIRECT_MREMAP
 #define DIRECT_MREMAP(h, a, os, ns, f, f2) (!OSHavePhysicalPageSupport() ? DIRECT_MREMAP_DEFAULT((h), (a), (os), (ns), (f), (f2)) : MFAIL)*/
 
+#endif
+/* NEDMALLOC_USDT compiles in USDT probes for perf and bpftrace, which cost a nop each when not traced */
+#ifndef NEDMALLOC_USDT
+#define NEDMALLOC_USDT 0
+#endif
+#if NEDMALLOC_USDT
+#include <sys/sdt.h>
+#define NEDPROBE2(name, a1, a2)				DTRACE_PROBE2(nedmalloc, name, a1, a2)
+#define NEDPROBE3(name, a1, a2, a3)			DTRACE_PROBE3(nedmalloc, name, a1, a2, a3)
+#define NEDPROBE4(name, a1, a2, a3, a4)		DTRACE_PROBE4(nedmalloc, name, a1, a2, a3, a4)
+#else
+#define NEDPROBE2(name, a1, a2)				do { } while(0)
+#define NEDPROBE3(name, a1, a2, a3)			do { } while(0)
+#define NEDPROBE4(name, a1, a2, a3, a4)		do { } while(0)
 #endif
 #include "malloc.c.h"
 #ifdef NDEBUG               /* Disable assert checking on release builds */
@@ -217,6 +232,38 @@ extern void *userpage_realloc(void *mem, size_t oldsize, size_t newsize, int fla
 #ifndef THREADCACHEMAXFREESPACE
 #define THREADCACHEMAXFREESPACE (1024*1024)
 #endif
+/* The largest request served without a chunk header from runs of pages holding a single size class */
+#ifndef SMALLBLKMAX
+#if USE_ALLOCATOR==1 && USE_PAGEMAP && !USE_MAGIC_HEADERS
+#define SMALLBLKMAX 64
+#else
+#define SMALLBLKMAX 0
+#endif
+#endif
+#if SMALLBLKMAX
+#if !USE_PAGEMAP || USE_MAGIC_HEADERS
+#error SMALLBLKMAX requires USE_PAGEMAP and cannot be used with USE_MAGIC_HEADERS
+#endif
+/* The number of size classes, each a multiple of MALLOC_ALIGNMENT */
+#define SMALLBLKCLASSES ((SMALLBLKMAX+MALLOC_ALIGNMENT-1)/MALLOC_ALIGNMENT)
+#endif
+/* The size of each run of small blocks. Must be a multiple of the page size */
+#ifndef SMALLBLKRUNSIZE
+#define SMALLBLKRUNSIZE (64*1024)
+#endif
+/* The most small blocks of each class a thread cache holds. Half are taken from or given
+back to their runs at a time, under a single lock. */
+#ifndef SMALLBLKCACHE
+#define SMALLBLKCACHE 64
+#endif
+/* A realloc shrinking a block by less than 1/(2^REALLOCSLACKSHIFT) of its size is a noop */
+#ifndef REALLOCSLACKSHIFT
+#define REALLOCSLACKSHIFT 3
+#endif
+/* The most chunks pinning a segment which nedpfragreport() lists per segment */
+#ifndef NEDMALLOC_FRAGREPORTPINS
+#define NEDMALLOC_FRAGREPORTPINS 8
+#endif
 /* NEDMALLOC_FORCERESERVE is used to force malloc2 flags for normal malloc, calloc et al */
 #ifndef NEDMALLOC_FORCERESERVE
 #define NEDMALLOC_FORCERESERVE(p, mem, size) 0
@@ -224,7 +271,20 @@ extern void *userpage_realloc(void *mem, size_t oldsize, size_t newsize, int fla
 /* ENABLE_LOGGING is a bitmask of what events to log */
 #if ENABLE_LOGGING
 #ifndef NEDMALLOC_LOGFILE
-#define NEDMALLOC_LOGFILE "nedmalloc.csv"
+#define NEDMALLOC_LOGFILE "nedmalloc.trace"
+#endif
+/* The number of records in each thread's log ring. Must be a power of two */
+#ifndef NEDMALLOC_LOGRINGSIZE
+#define NEDMALLOC_LOGRINGSIZE 16384
+#endif
+/* How often in milliseconds the background writer drains the log rings */
+#ifndef NEDMALLOC_LOGFLUSHINTERVAL
+#define NEDMALLOC_LOGFLUSHINTERVAL 10
+#endif
+/* Set NEDMALLOC_LOGLOSSLESS to have a thread drain its full log ring rather than drop records,
+as nedreplay needs every record */
+#ifndef NEDMALLOC_LOGLOSSLESS
+#define NEDMALLOC_LOGLOSSLESS 0
 #endif
 #endif
 /* NEDMALLOC_TESTLOGENTRY returns non-zero if the entry should be logged */
@@ -235,11 +295,40 @@ extern void *userpage_realloc(void *mem, size_t oldsize, size_t newsize, int fla
 #ifndef NEDMALLOC_STACKBACKTRACEDEPTH
 #define NEDMALLOC_STACKBACKTRACEDEPTH 0
 #endif
+#if ENABLE_LOGGING && !defined(WIN32)
+#include <sched.h>
+#include <unistd.h>
 #if NEDMALLOC_STACKBACKTRACEDEPTH
-#include "Dbghelp.h"
-#include "psapi.h"
-#pragma comment(lib, "dbghelp.lib")
-#pragma comment(lib, "psapi.lib")
+#include <execinfo.h>
+#endif
+#endif
+/* NEDMALLOC_HEAPPROFILE samples one allocation per this many bytes on average for nedheapprofile_dump() */
+#ifndef NEDMALLOC_HEAPPROFILE
+#define NEDMALLOC_HEAPPROFILE 0
+#endif
+#if NEDMALLOC_HEAPPROFILE
+#ifndef NEDMALLOC_HEAPPROFILEDEPTH
+#define NEDMALLOC_HEAPPROFILEDEPTH 32
+#endif
+#ifndef WIN32
+#include <execinfo.h>
+#endif
+#endif
+/* NEDMALLOC_STATSEXPORT publishes pool statistics to a POSIX shared memory segment every this many milliseconds */
+#ifndef NEDMALLOC_STATSEXPORT
+#define NEDMALLOC_STATSEXPORT 0
+#endif
+#if NEDMALLOC_STATSEXPORT
+#if defined(WIN32) || !USE_LOCKS
+#error NEDMALLOC_STATSEXPORT needs POSIX shared memory and threads
+#endif
+/* The name of the shared memory segment, formatted with the process id */
+#ifndef NEDMALLOC_STATSEXPORTNAME
+#define NEDMALLOC_STATSEXPORTNAME "/nedmalloc.%u"
+#endif
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #endif
 #define NM_FLAGS_MASK (M2_FLAGS_MASK&~M2_ZERO_MEMORY)
 
@@ -296,7 +385,7 @@ static void *unsupported_operation(const char *opname) THROWSPEC
 }
 static size_t mspacecounter=(size_t) 0xdeadbeef;
 #endif
-#ifndef ENABLE_FAST_HEAP_DETECTION
+#if !USE_PAGEMAP && !defined(ENABLE_FAST_HEAP_DETECTION)
 static void *RESTRICT leastusedaddress;
 static size_t largestusedblock;
 #endif
@@ -334,6 +423,23 @@ void (*sysfree)(void *);
 size_t (*sysblksize)(void *);
 #endif
 
+#if SMALLBLKMAX
+struct smallblkrun_t;
+typedef struct smallblkrun_t smallblkrun;
+struct smallblkrun_t
+{	/* Sits at the start of each run of pages holding small blocks of one size class */
+	mstate m;							/* Must come first, as the page map finds the owning mspace here */
+	smallblkrun *RESTRICT next, *RESTRICT prev;	/* Runs of this class with free blocks */
+	void *RESTRICT freelist;			/* Blocks freed back to this run */
+	char *RESTRICT unused;				/* Blocks from here on have never been handed out */
+	unsigned int size, cls;				/* Block size and its class */
+	unsigned int used, capacity;		/* Blocks handed out and the total */
+};
+static FORCEINLINE smallblkrun *SmallBlkRun(void *RESTRICT mem) THROWSPEC;
+static void *smallblk_malloc(mstate m, size_t size, unsigned flags) THROWSPEC;
+static void smallblk_free(smallblkrun *RESTRICT run, void *RESTRICT mem) THROWSPEC;
+#endif
+
 static FORCEINLINE NEDMALLOCNOALIASATTR NEDMALLOCPTRATTR void *CallMalloc(void *RESTRICT mspace, size_t size, size_t alignment, unsigned flags) THROWSPEC
 {
 	void *RESTRICT ret=0;
@@ -350,11 +456,16 @@ static FORCEINLINE NEDMALLOCNOALIASATTR NEDMALLOCPTRATTR void *CallMalloc(void *
 #if USE_ALLOCATOR==0
 	ret=(flags & M2_ZERO_MEMORY) ? syscalloc(1, size) : sysmalloc(size);	/* magic headers takes care of alignment */
 #elif USE_ALLOCATOR==1
+#if SMALLBLKMAX
+	if(size<=SMALLBLKMAX && alignment<=MALLOC_ALIGNMENT && !(flags & NM_FLAGS_MASK))
+		ret=smallblk_malloc((mstate) mspace, size, flags);
+	else
+#endif
 	ret=mspace_malloc2((mstate) mspace, size, alignment, flags);
 #ifdef HAVE_VALGRIND
 	if(ret) VALGRIND_MEMPOOL_ALLOC(mspace, ret, size);
 #endif
-#ifndef ENABLE_FAST_HEAP_DETECTION
+#if !USE_PAGEMAP && !defined(ENABLE_FAST_HEAP_DETECTION)
 	if(ret)
 	{
 		mchunkptr p=mem2chunk(ret);
@@ -398,7 +509,15 @@ static FORCEINLINE NEDMALLOCNOALIASATTR NEDMALLOCPTRATTR void *CallRealloc(void
 #if USE_MAGIC_HEADERS
 		assert(_mem[0]!=*(size_t *) "NEDMALOC");
 #endif
-		if((ret=CallMalloc(mspace, newsize, alignment, flags)))
+#if SMALLBLKMAX && USE_LOCKS
+		/* The small block allocator needs the mspace locked */
+		ACQUIRE_LOCK(&((mstate) mspace)->mutex);
+		ret=CallMalloc(mspace, newsize, alignment, flags);
+		RELEASE_LOCK(&((mstate) mspace)->mutex);
+#else
+		ret=CallMalloc(mspace, newsize, alignment, flags);
+#endif
+		if(ret)
 		{
 #if defined(DEBUG)
 			printf("*** nedmalloc frees system allocated block %p\n", mem);
@@ -423,7 +542,7 @@ static FORCEINLINE NEDMALLOCNOALIASATTR NEDMALLOCPTRATTR void *CallRealloc(void
 #ifdef HAVE_VALGRIND
 	if(ret) VALGRIND_MEMPOOL_CHANGE(mspace, mem, ret, newsize);
 #endif
-#ifndef ENABLE_FAST_HEAP_DETECTION
+#if !USE_PAGEMAP && !defined(ENABLE_FAST_HEAP_DETECTION)
 	if(ret)
 	{
 		mchunkptr p=mem2chunk(ret);
@@ -477,6 +596,16 @@ static FORCEINLINE void CallFree(void *RESTRICT mspace, void *RESTRICT mem, int
 #if USE_ALLOCATOR==0
 	sysfree(mem);
 #elif USE_ALLOCATOR==1
+#if SMALLBLKMAX
+	{
+		smallblkrun *RESTRICT run=SmallBlkRun(mem);
+		if(run)
+		{
+			smallblk_free(run, mem);
+			return;
+		}
+	}
+#endif
 #ifdef HAVE_VALGRIND
 	{
 		void *m=mspace ? mspace : get_mstate_for(mem2chunk(mem));
@@ -507,7 +636,11 @@ static NEDMALLOCNOALIASATTR mstate nedblkmstate(void *RESTRICT mem) THROWSPEC
 		/* Fail everything */
 		return 0;
 #elif USE_ALLOCATOR==1
-#ifdef ENABLE_FAST_HEAP_DETECTION
+#if USE_PAGEMAP
+		/* The page map knows exactly which pages belong to which mspace, so
+		this never touches memory which isn't ours */
+		return pagemap_get(mem);
+#elif defined(ENABLE_FAST_HEAP_DETECTION)
 #ifdef WIN32
 		/*  On Windows for RELEASE both x86 and x64 the NT heap precedes each block with an eight byte header
 			which looks like:
@@ -641,6 +774,16 @@ NEDMALLOCNOALIASATTR size_t nedblksize(int *RESTRICT isforeign, void *RESTRICT m
 			}
 		}
 #elif USE_ALLOCATOR==1
+#if SMALLBLKMAX
+		{
+			smallblkrun *RESTRICT run=SmallBlkRun(mem);
+			if(run)
+			{
+				if(isforeign) *isforeign=0;
+				return run->size;
+			}
+		}
+#endif
 		if((flags & NM_SKIP_TOLERANCE_CHECKS) || nedblkmstate(mem))
 		{
 			mchunkptr p=mem2chunk(mem);
@@ -739,45 +882,37 @@ typedef enum LogEntryType_t
 	LOGENTRY_POOL_REALLOC			=(1<<7),
 	LOGENTRY_POOL_FREE				=(1<<8)
 } LogEntryType;
-#if NEDMALLOC_STACKBACKTRACEDEPTH
-typedef struct StackFrameType_t
+#if ENABLE_LOGGING
+/* Each thread cache logs into its own ring of fixed size records. Only the owning thread
+writes records and only the log writer consumes them, so neither side takes a lock. */
+typedef struct logrecord_t
 {
-	void *pc;
-	char module[64];
-	char functname[256];
-	char file[96];
-	int lineno;
-} StackFrameType;
+	timeCount delta;					/* Time since this thread's previous record */
+	void *mem, *returned;
+	size_t size, alignment;
+	unsigned int flags;
+	int mspace;
+	unsigned char type;					/* Bit index of the LogEntryType */
+	unsigned char frames;
+#if NEDMALLOC_STACKBACKTRACEDEPTH
+	void *stack[NEDMALLOC_STACKBACKTRACEDEPTH];
 #endif
-typedef struct logentry_t
+} logrecord;
+typedef struct logring_t logring;
+struct logring_t
 {
-	timeCount timestamp;
+	logring *next;						/* Next in the list of all rings */
 	nedpool *np;
-	LogEntryType type;
-	int mspace;
-	size_t size;
-	void *mem;
-	size_t alignment;
-	unsigned flags;
-	void *returned;
-#if NEDMALLOC_STACKBACKTRACEDEPTH
-	StackFrameType stack[NEDMALLOC_STACKBACKTRACEDEPTH];
-#endif
-} logentry;
-static const char *LogEntryTypeStrings[]={
-	"LOGENTRY_MALLOC",
-	"LOGENTRY_REALLOC",
-	"LOGENTRY_FREE",
-
-	"LOGENTRY_THREADCACHE_MALLOC",
-	"LOGENTRY_THREADCACHE_FREE",
-	"LOGENTRY_THREADCACHE_CLEAN",
-
-	"LOGENTRY_POOL_MALLOC",
-	"LOGENTRY_POOL_REALLOC",
-	"LOGENTRY_POOL_FREE",
-	"******************"
+	long threadid;
+	volatile size_t closed;				/* Set once the owning thread cache has gone */
+	volatile size_t dropped;			/* Records lost because the ring was full */
+	volatile size_t head;				/* Only written by the owning thread */
+	volatile size_t tail;				/* Only written by the log writer */
+	size_t reporteddropped;
+	timeCount consumedtime;				/* Timestamp of the last record consumed */
+	logrecord records[NEDMALLOC_LOGRINGSIZE];
 };
+#endif
 
 struct threadcacheblk_t;
 typedef struct threadcacheblk_t threadcacheblk;
@@ -791,6 +926,9 @@ struct threadcacheblk_t
 	size_t size;
 	threadcacheblk *RESTRICT next, *RESTRICT prev;
 };
+/* The smallest block the thread cache handles. Anything the small block allocator can serve
+without a header is left to it. */
+#define THREADCACHEMIN (SMALLBLKMAX>=sizeof(threadcacheblk) ? SMALLBLKMAX+1 : sizeof(threadcacheblk))
 typedef struct threadcache_t
 {
 #ifdef FULLSANITYCHECKS
@@ -800,10 +938,23 @@ typedef struct threadcache_t
 	long threadid;
 	unsigned int mallocs, frees, successes;
 #if ENABLE_LOGGING
-	logentry *logentries, *logentriesptr, *logentriesend;
+	logring *ring;
+	timeCount logtime;					/* Timestamp of this thread's previous record */
+#endif
+#if NEDMALLOC_HEAPPROFILE
+	size_t heapprofleft;				/* Bytes to allocate before the next sample */
+	unsigned long long heapprofseed;
+	int heapprofbusy;					/* Set while sampling to stop recursion */
 #endif
 	size_t freeInCache;					/* How much free space is stored in this cache */
+	unsigned int binhits[THREADCACHEMAXBINS+1], binmisses[THREADCACHEMAXBINS+1];	/* Per bin counts for nedpgetstats() */
+	size_t bincached[THREADCACHEMAXBINS+1];	/* Per bin split of freeInCache */
 	threadcacheblk *RESTRICT bins[(THREADCACHEMAXBINS+1)*2];
+#if SMALLBLKMAX
+	void *RESTRICT smallblks[SMALLBLKCLASSES];	/* Small blocks held by this thread per class, linked through their first word */
+	unsigned int smallcount[SMALLBLKCLASSES];
+	size_t smallInCache;				/* How much space is held in smallblks */
+#endif
 #ifdef FULLSANITYCHECKS
 	unsigned int magic2;
 #endif
@@ -818,261 +969,478 @@ struct nedpool_t
 	threadcache *RESTRICT caches[THREADCACHEMAXCACHES];
 	TLSVAR mycache;						/* Thread cache for this thread. 0 for unset, negative for use mspace-1 directly, otherwise is cache-1 */
 	mstate m[MAXTHREADSINPOOL+1];		/* mspace entries for this pool */
+	char *reservation;					/* Address space reserved by NP_RESERVE_CAPACITY, shared equally between m */
+	size_t reservationsize;
+#if SMALLBLKMAX
+	smallblkrun *smallblks[MAXTHREADSINPOOL+1][SMALLBLKCLASSES];	/* Runs with free blocks per mspace and class */
+#endif
 };
 static nedpool syspool;
 
 #if ENABLE_LOGGING
-#if NEDMALLOC_STACKBACKTRACEDEPTH
-#if defined(WIN32) && defined(_MSC_VER)
-#define COPY_STRING(d, s, maxlen) { size_t len=strlen(s); len=(len>maxlen) ? maxlen-1 : len; memcpy(d, s, len); d[len]=0; }
+#if defined(__GNUC__) && defined(__ATOMIC_ACQUIRE)
+#define LOGRING_LOAD(p)			__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define LOGRING_STORE(p, v)		__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define LOGRING_CAS(p, o, n)	__sync_bool_compare_and_swap((p), (o), (n))
+#elif defined(_MSC_VER)
+/* MSVC gives volatile accesses acquire and release semantics */
+#define LOGRING_LOAD(p)			(*(p))
+#define LOGRING_STORE(p, v)		(*(p)=(v))
+#define LOGRING_CAS(p, o, n)	(InterlockedCompareExchangePointer((PVOID volatile *)(p), (PVOID)(n), (PVOID)(o))==(PVOID)(o))
+#else
+#define LOGRING_LOAD(p)			(__sync_synchronize(), *(p))
+#define LOGRING_STORE(p, v)		(__sync_synchronize(), *(p)=(v))
+#define LOGRING_CAS(p, o, n)	__sync_bool_compare_and_swap((p), (o), (n))
+#endif
+/* The most bytes one record can take in the trace file */
+#define LOGRECORD_MAXBYTES (9*10+NEDMALLOC_STACKBACKTRACEDEPTH*10)
+
+static logring *volatile logrings;		/* Every ring which may still hold records */
+static void *volatile logwriterlock;
+static void *volatile logwriterstarted;
+static FILE *logfile;
+static unsigned char logbuffer[65536];
 
-#pragma optimize("g", off)
-static int ExceptionFilter(unsigned int code, struct _EXCEPTION_POINTERS *ep, CONTEXT *ct) THROWSPEC
+static unsigned char *PutLogVarint(unsigned char *out, unsigned long long v) THROWSPEC
 {
-	*ct=*ep->ContextRecord;
-	return EXCEPTION_EXECUTE_HANDLER;
+	while(v>=0x80)
+	{
+		*out++=(unsigned char)(v|0x80);
+		v>>=7;
+	}
+	*out++=(unsigned char) v;
+	return out;
 }
-
-static DWORD64 __stdcall GetModBase(HANDLE hProcess, DWORD64 dwAddr) THROWSPEC
+static void FlushLogBuffer(unsigned char *end) THROWSPEC
 {
-	DWORD64 modulebase;
-	// Try to get the module base if already loaded, otherwise load the module
-	modulebase=SymGetModuleBase64(hProcess, dwAddr);
-	if(modulebase)
-		return modulebase;
-	else
+	if(logfile && end>logbuffer)
+		fwrite(logbuffer, 1, end-logbuffer, logfile);
+}
+/* Writes everything in every ring to the trace file and frees any closed rings. Only the
+log writer lock holder consumes from the rings, so producers never wait on it. */
+static void DrainLogRings(const char *filepath) THROWSPEC
+{
+	logring *ring, *prev, *next;
+	unsigned char *out=logbuffer;
+	while(!LOGRING_CAS(&logwriterlock, (void *) 0, (void *) 1))
+	{
+#ifdef WIN32
+		SleepEx(0, FALSE);
+#else
+		sched_yield();
+#endif
+	}
+	if(filepath && logfile)
+	{
+		fclose(logfile);
+		logfile=0;
+	}
+	if(!logfile)
 	{
-		MEMORY_BASIC_INFORMATION stMBI ;
-		if ( 0 != VirtualQueryEx ( hProcess, (LPCVOID)(size_t)dwAddr, &stMBI, sizeof(stMBI)))
+		if((logfile=fopen(filepath ? filepath : NEDMALLOC_LOGFILE, "ab")))
 		{
-			int n;
-			DWORD dwPathLen=0, dwNameLen=0 ;
-			TCHAR szFile[ MAX_PATH ], szModuleName[ MAX_PATH ] ;
-			MODULEINFO mi={0};
-			dwPathLen = GetModuleFileName ( (HMODULE) stMBI.AllocationBase , szFile, MAX_PATH );
-			dwNameLen = GetModuleBaseName (hProcess, (HMODULE) stMBI.AllocationBase , szModuleName, MAX_PATH );
-			for(n=dwNameLen; n>0; n--)
+			fseek(logfile, 0, SEEK_END);
+			if(!ftell(logfile))
+				fwrite("NEDTRC01", 1, 8, logfile);
+		}
+	}
+	for(prev=0, ring=(logring *) LOGRING_LOAD(&logrings); ring; ring=next)
+	{
+		size_t closed=LOGRING_LOAD(&ring->closed), tail=ring->tail, head=LOGRING_LOAD(&ring->head), dropped=LOGRING_LOAD(&ring->dropped);
+		next=ring->next;
+		if(head!=tail || dropped!=ring->reporteddropped)
+		{	/* Block header is count, pool, thread id, base timestamp and records dropped since the last block */
+			if(out>logbuffer+sizeof(logbuffer)-5*10)
 			{
-				if(szModuleName[n]=='.')
-				{
-					szModuleName[n]=0;
-					break;
-				}
+				FlushLogBuffer(out);
+				out=logbuffer;
 			}
-			if(!GetModuleInformation(hProcess, (HMODULE) stMBI.AllocationBase, &mi, sizeof(mi)))
+			out=PutLogVarint(out, head-tail);
+			out=PutLogVarint(out, (size_t) ring->np);
+			out=PutLogVarint(out, (unsigned long) ring->threadid);
+			out=PutLogVarint(out, ring->consumedtime);
+			out=PutLogVarint(out, dropped-ring->reporteddropped);
+			ring->reporteddropped=dropped;
+			for(; tail!=head; tail++)
 			{
-				//fxmessage("WARNING: GetModuleInformation() returned error code %d\n", GetLastError());
+				logrecord *lr=&ring->records[tail & (NEDMALLOC_LOGRINGSIZE-1)];
+				int i;
+				if(out>logbuffer+sizeof(logbuffer)-LOGRECORD_MAXBYTES)
+				{
+					FlushLogBuffer(out);
+					out=logbuffer;
+				}
+				out=PutLogVarint(out, lr->delta);
+				*out++=lr->type;
+				out=PutLogVarint(out, (unsigned int) lr->mspace);
+				out=PutLogVarint(out, lr->size);
+				out=PutLogVarint(out, (size_t) lr->mem);
+				out=PutLogVarint(out, lr->alignment);
+				out=PutLogVarint(out, lr->flags);
+				out=PutLogVarint(out, (size_t) lr->returned);
+				*out++=lr->frames;
+#if NEDMALLOC_STACKBACKTRACEDEPTH
+				for(i=0; i<lr->frames; i++)
+					out=PutLogVarint(out, (size_t) lr->stack[i]);
+#else
+				(void) i;
+#endif
+				ring->consumedtime+=lr->delta;
 			}
-			if(!SymLoadModule64 ( hProcess, NULL, (PSTR)( (dwPathLen) ? szFile : 0), (PSTR)( (dwNameLen) ? szModuleName : 0),
-				(DWORD64) mi.lpBaseOfDll, mi.SizeOfImage))
+			LOGRING_STORE(&ring->tail, tail);
+		}
+		if(closed)
+		{	/* The owner has gone and everything it wrote is now out, so unlink and free it.
+			New rings only ever get pushed onto the head of the list. */
+			if(prev)
+				prev->next=next;
+			else if(!LOGRING_CAS(&logrings, ring, next))
 			{
-				//fxmessage("WARNING: SymLoadModule64() returned error code %d\n", GetLastError());
+				for(prev=(logring *) LOGRING_LOAD(&logrings); prev->next!=ring; prev=prev->next);
+				prev->next=next;
 			}
-			//fxmessage("%s, %p, %x, %x\n", szFile, mi.lpBaseOfDll, mi.SizeOfImage, (DWORD) mi.lpBaseOfDll+mi.SizeOfImage);
-			modulebase=SymGetModuleBase64(hProcess, dwAddr);
-			return modulebase;
+			CallFree(0, ring, 0);
 		}
+		else
+			prev=ring;
+	}
+	FlushLogBuffer(out);
+	if(logfile) fflush(logfile);
+	LOGRING_STORE(&logwriterlock, (void *) 0);
+}
+#if USE_LOCKS
+#ifdef WIN32
+static DWORD WINAPI LogWriterThread(LPVOID arg) THROWSPEC
+#else
+static void *LogWriterThread(void *arg) THROWSPEC
+#endif
+{
+	for(;;)
+	{
+#ifdef WIN32
+		SleepEx(NEDMALLOC_LOGFLUSHINTERVAL, FALSE);
+#else
+		usleep(NEDMALLOC_LOGFLUSHINTERVAL*1000);
+#endif
+		DrainLogRings(0);
 	}
 	return 0;
 }
-
-extern HANDLE sym_myprocess;
-extern VOID (WINAPI *RtlCaptureContextAddr)(PCONTEXT);
-extern void DeinitSym(void) THROWSPEC;
-static void DoStackWalk(logentry *p) THROWSPEC
+static void DrainLogRingsAtExit(void)
+{
+	DrainLogRings(0);
+}
+#endif
+static void StartLogRing(nedpool *p, threadcache *tc) THROWSPEC
 {
-	int i,i2;
-	HANDLE mythread=(HANDLE) GetCurrentThread();
-	STACKFRAME64 sf={ 0 };
-	CONTEXT ct={ 0 };
-	if(!sym_myprocess)
+	logring *ring=(logring *) CallMalloc(p->m[0], sizeof(logring), 0, M2_ALWAYS_MMAP);
+	if(!ring) return;
+	ring->np=p;
+	ring->threadid=tc->threadid;
+	ring->closed=ring->dropped=ring->head=ring->tail=ring->reporteddropped=0;
+	ring->consumedtime=tc->logtime=GetTimestamp();
+	do
 	{
-		DWORD symopts;
-		DuplicateHandle(GetCurrentProcess(), GetCurrentProcess(), GetCurrentProcess(), &sym_myprocess, 0, FALSE, DUPLICATE_SAME_ACCESS);
-		symopts=SymGetOptions();
-		SymSetOptions(symopts /*| SYMOPT_DEFERRED_LOADS*/ | SYMOPT_LOAD_LINES);
-		SymInitialize(sym_myprocess, NULL, TRUE);
-		atexit(DeinitSym);
+		ring->next=(logring *) LOGRING_LOAD(&logrings);
+	} while(!LOGRING_CAS(&logrings, ring->next, ring));
+	tc->ring=ring;
+#if USE_LOCKS
+	if(LOGRING_CAS(&logwriterstarted, (void *) 0, (void *) 1))
+	{	/* First ring, so start the background writer */
+#ifdef WIN32
+		HANDLE h=CreateThread(0, 0, LogWriterThread, 0, 0, 0);
+		if(h) CloseHandle(h);
+#else
+		pthread_t writer;
+		if(!pthread_create(&writer, 0, LogWriterThread, 0))
+			pthread_detach(writer);
+#endif
+		atexit(DrainLogRingsAtExit);
 	}
-	ct.ContextFlags=CONTEXT_FULL;
-
-	// Use RtlCaptureContext() if we have it as it saves an exception throw
-	if((VOID (WINAPI *)(PCONTEXT)) -1==RtlCaptureContextAddr)
-		RtlCaptureContextAddr=(VOID (WINAPI *)(PCONTEXT)) GetProcAddress(GetModuleHandle(L"kernel32"), "RtlCaptureContext");
-	if(RtlCaptureContextAddr)
-		RtlCaptureContextAddr(&ct);
-	else
-	{	// This is nasty, but it works
-		__try
-		{
-			int *foo=0;
-			*foo=78;
-		}
-		__except (ExceptionFilter(GetExceptionCode(), GetExceptionInformation(), &ct))
+#endif
+}
+static void StopLogRing(threadcache *tc) THROWSPEC
+{
+	if(tc->ring)
+	{
+		LOGRING_STORE(&tc->ring->closed, (size_t) 1);
+		tc->ring=0;
+	}
+}
+#endif
+static FORCEINLINE void LogOperation(threadcache *tc, nedpool *np, LogEntryType type, int mspace, size_t size, void *mem, size_t alignment, unsigned flags, void *returned) THROWSPEC
+{
+#if ENABLE_LOGGING
+	logring *ring;
+	if(tc && (ring=tc->ring) && NEDMALLOC_TESTLOGENTRY(tc, np, type, mspace, size, mem, alignment, flags, returned))
+	{
+		size_t head=ring->head;
+		logrecord *lr;
+		timeCount now;
+		if(head-LOGRING_LOAD(&ring->tail)>=NEDMALLOC_LOGRINGSIZE)
 		{
+#if USE_LOCKS && !NEDMALLOC_LOGLOSSLESS
+			/* Drop rather than wait for the writer */
+			LOGRING_STORE(&ring->dropped, ring->dropped+1);
+			return;
+#else
+			/* There is no writer thread or we mustn't drop, so drain it ourselves */
+			DrainLogRings(0);
+#endif
 		}
-	}
-
-	sf.AddrPC.Mode=sf.AddrStack.Mode=sf.AddrFrame.Mode=AddrModeFlat;
-#if !(defined(_M_AMD64) || defined(_M_X64))
-	sf.AddrPC.Offset   =ct.Eip;
-	sf.AddrStack.Offset=ct.Esp;
-	sf.AddrFrame.Offset=ct.Ebp;
+		lr=&ring->records[head & (NEDMALLOC_LOGRINGSIZE-1)];
+		now=GetTimestamp();
+		lr->delta=now-tc->logtime;
+		tc->logtime=now;
+		lr->mem=mem;
+		lr->returned=returned;
+		lr->size=size;
+		lr->alignment=alignment;
+		lr->flags=flags;
+		lr->mspace=mspace;
+		for(lr->type=0; !(type & (1<<lr->type)); lr->type++);
+#if NEDMALLOC_STACKBACKTRACEDEPTH
+#ifdef WIN32
+		lr->frames=(unsigned char) CaptureStackBackTrace(1, NEDMALLOC_STACKBACKTRACEDEPTH, lr->stack, 0);
 #else
-	sf.AddrPC.Offset   =ct.Rip;
-	sf.AddrStack.Offset=ct.Rsp;
-	sf.AddrFrame.Offset=ct.Rbp; // maybe Rdi?
-#endif
-	for(i2=0; i2<NEDMALLOC_STACKBACKTRACEDEPTH; i2++)
-	{
-		IMAGEHLP_MODULE64 ihm={ sizeof(IMAGEHLP_MODULE64) };
-		char temp[MAX_PATH+sizeof(IMAGEHLP_SYMBOL64)];
-		IMAGEHLP_SYMBOL64 *ihs;
-		IMAGEHLP_LINE64 ihl={ sizeof(IMAGEHLP_LINE64) };
-		DWORD64 offset;
-		if(!StackWalk64(
-#if !(defined(_M_AMD64) || defined(_M_X64))
-			IMAGE_FILE_MACHINE_I386,
+		lr->frames=(unsigned char) backtrace(lr->stack, NEDMALLOC_STACKBACKTRACEDEPTH);
+#endif
 #else
-			IMAGE_FILE_MACHINE_AMD64,
+		lr->frames=0;
 #endif
-			sym_myprocess, mythread, &sf, &ct, NULL, SymFunctionTableAccess64, GetModBase, NULL))
-			break;
-		if(0==sf.AddrPC.Offset)
-			break;
-		i=i2;
-		if(i)	// Skip first entry relating to this function
-		{
-			DWORD lineoffset=0;
-			p->stack[i-1].pc=(void *)(size_t) sf.AddrPC.Offset;
-			if(SymGetModuleInfo64(sym_myprocess, sf.AddrPC.Offset, &ihm))
-			{
-				char *leaf;
-				leaf=strrchr(ihm.ImageName, '\\');
-				if(!leaf) leaf=ihm.ImageName-1;
-				COPY_STRING(p->stack[i-1].module, leaf+1, sizeof(p->stack[i-1].module));
-			}
-			else strcpy(p->stack[i-1].module, "<unknown>");
-			//fxmessage("WARNING: SymGetModuleInfo64() returned error code %d\n", GetLastError());
-			memset(temp, 0, MAX_PATH+sizeof(IMAGEHLP_SYMBOL64));
-			ihs=(IMAGEHLP_SYMBOL64 *) temp;
-			ihs->SizeOfStruct=sizeof(IMAGEHLP_SYMBOL64);
-			ihs->Address=sf.AddrPC.Offset;
-			ihs->MaxNameLength=MAX_PATH;
-
-			if(SymGetSymFromAddr64(sym_myprocess, sf.AddrPC.Offset, &offset, ihs))
-			{
-				COPY_STRING(p->stack[i-1].functname, ihs->Name, sizeof(p->stack[i-1].functname));
-				if(strlen(p->stack[i-1].functname)<sizeof(p->stack[i-1].functname)-8)
-				{
-					sprintf(strchr(p->stack[i-1].functname, 0), " +0x%x", offset);
-				}
-			}
-			else
-				strcpy(p->stack[i-1].functname, "<unknown>");
-			if(SymGetLineFromAddr64(sym_myprocess, sf.AddrPC.Offset, &lineoffset, &ihl))
-			{
-				char *leaf;
-				p->stack[i-1].lineno=ihl.LineNumber;
+		LOGRING_STORE(&ring->head, head+1);
+	}
+#endif
+}
 
-				leaf=strrchr(ihl.FileName, '\\');
-				if(!leaf) leaf=ihl.FileName-1;
-				COPY_STRING(p->stack[i-1].file, leaf+1, sizeof(p->stack[i-1].file));
-			}
-			else
-				strcpy(p->stack[i-1].file, "<unknown>");
+#if NEDMALLOC_HEAPPROFILE
+/* Call sites are kept for the life of the process with running totals of what they
+sampled, and each live sampled block points at the call site which allocated it */
+#define HEAPPROFBUCKETS 65536
+typedef struct heapstack_t heapstack;
+struct heapstack_t
+{
+	heapstack *next;
+	size_t hash;
+	unsigned long long allocs, allocbytes, frees, freebytes;
+	int frames;
+	void *stack[NEDMALLOC_HEAPPROFILEDEPTH];
+};
+typedef struct heapsample_t heapsample;
+struct heapsample_t
+{
+	heapsample *next;
+	void *mem;
+	size_t size;
+	heapstack *stack;
+};
+static mspace heapprofms;				/* Holds the profiler's own tables. Its lock guards them too */
+static heapstack **heapstacks;			/* Call sites by hash of their return addresses */
+static heapsample *volatile *volatile heapsamples;	/* Live sampled blocks by address */
+
+static FORCEINLINE size_t HeapProfileHash(void *mem) THROWSPEC
+{
+	return (((size_t) mem>>4) ^ ((size_t) mem>>20)) & (HEAPPROFBUCKETS-1);
+}
+static int HeapProfileInit(void) THROWSPEC
+{
+	if(heapsamples) return 1;
+	ACQUIRE_MALLOC_GLOBAL_LOCK();
+	if(!heapsamples)
+	{
+		mspace ms=create_mspace(0, 1);
+		heapsample **samples=0;
+		if(ms && (heapstacks=(heapstack **) mspace_calloc(ms, HEAPPROFBUCKETS, sizeof(heapstack *)))
+			&& (samples=(heapsample **) mspace_calloc(ms, HEAPPROFBUCKETS, sizeof(heapsample *))))
+		{
+			heapprofms=ms;
+			heapsamples=samples;
 		}
+		else if(ms)
+			destroy_mspace(ms);
 	}
+	RELEASE_MALLOC_GLOBAL_LOCK();
+	return !!heapsamples;
 }
-#pragma optimize("g", on)
+/* Returns how many bytes to allocate before the next sample. This is exponentially
+distributed with a mean of NEDMALLOC_HEAPPROFILE, so the chance of sampling a block is
+proportional to its size however the allocations are split up. */
+static size_t HeapProfileInterval(threadcache *tc) THROWSPEC
+{
+	unsigned int bits, top;
+	double frac, log2bits;
+	tc->heapprofseed=tc->heapprofseed*6364136223846793005ULL+1442695040888963407ULL;
+	bits=(unsigned int)(tc->heapprofseed>>38)+1;	/* 1 to 2^26 */
+	for(top=0; bits>>(top+1); top++);
+	/* A quadratic fit of log2 over the mantissa is plenty for this */
+	frac=(double) bits/(double)(1U<<top)-1.0;
+	log2bits=top+frac*(1.3465553-0.3465553*frac);
+	return (size_t)((26-log2bits)*0.69314718*NEDMALLOC_HEAPPROFILE)+1;
+}
+static NOINLINE int HeapProfileStack(void **stack) THROWSPEC
+{	/* Skip this function and HeapProfileSample() */
+#ifdef WIN32
+	return CaptureStackBackTrace(2, NEDMALLOC_HEAPPROFILEDEPTH, stack, 0);
 #else
-static void DoStackWalk(logentry *p) THROWSPEC
+	void *frames[NEDMALLOC_HEAPPROFILEDEPTH+2];
+	int n=backtrace(frames, NEDMALLOC_HEAPPROFILEDEPTH+2)-2;
+	if(n<0) n=0;
+	memcpy(stack, frames+2, n*sizeof(void *));
+	return n;
+#endif
+}
+static NOINLINE void HeapProfileSample(threadcache *tc, void *mem, size_t size) THROWSPEC
 {
-	void *backtr[NEDMALLOC_STACKBACKTRACEDEPTH];
-	size_t size;
-	char **strings;
-	size_t i2;
-	size=backtrace(backtr, NEDMALLOC_STACKBACKTRACEDEPTH);
-	strings=backtrace_symbols(backtr, size);
-	for(i2=0; i2<size; i2++)
-	{	// Format can be <file path>(<mangled symbol>+0x<offset>) [<pc>]
-		// or can be <file path> [<pc>]
-		int start=0, end=strlen(strings[i2]), which=0, idx;
-		for(idx=0; idx<end; idx++)
+	void *stack[NEDMALLOC_HEAPPROFILEDEPTH];
+	size_t hash=0, h;
+	int frames, n;
+	heapstack *hs;
+	heapsample *s;
+	if(!tc->heapprofseed)
+	{	/* This thread's first allocation, so just start counting */
+		tc->heapprofseed=(unsigned long long)(size_t) tc ^ ((unsigned long long) GetTimestamp()<<16);
+		tc->heapprofleft=HeapProfileInterval(tc);
+		return;
+	}
+	tc->heapprofleft=HeapProfileInterval(tc);
+	/* Capturing a stack can allocate, so don't recurse */
+	if(tc->heapprofbusy || !HeapProfileInit()) return;
+	tc->heapprofbusy=1;
+	frames=HeapProfileStack(stack);
+	for(n=0; n<frames; n++)
+		hash=hash*31+(size_t) stack[n];
+	ACQUIRE_LOCK(&((mstate) heapprofms)->mutex);
+	h=hash & (HEAPPROFBUCKETS-1);
+	for(hs=heapstacks[h]; hs; hs=hs->next)
+		if(hs->hash==hash && hs->frames==frames && !memcmp(hs->stack, stack, frames*sizeof(void *)))
+			break;
+	if(!hs && (hs=(heapstack *) mspace_calloc(heapprofms, 1, sizeof(heapstack))))
+	{
+		hs->hash=hash;
+		hs->frames=frames;
+		memcpy(hs->stack, stack, frames*sizeof(void *));
+		hs->next=heapstacks[h];
+		heapstacks[h]=hs;
+	}
+	if(hs && (s=(heapsample *) mspace_malloc(heapprofms, sizeof(heapsample))))
+	{
+		hs->allocs++;
+		hs->allocbytes+=size;
+		s->mem=mem;
+		s->size=size;
+		s->stack=hs;
+		h=HeapProfileHash(mem);
+		s->next=heapsamples[h];
+		heapsamples[h]=s;
+	}
+	RELEASE_LOCK(&((mstate) heapprofms)->mutex);
+	tc->heapprofbusy=0;
+}
+static NOINLINE void HeapProfileUnsample(void *mem) THROWSPEC
+{
+	heapsample *volatile *ps, *s;
+	ACQUIRE_LOCK(&((mstate) heapprofms)->mutex);
+	for(ps=&heapsamples[HeapProfileHash(mem)]; (s=*ps); ps=&s->next)
+	{
+		if(s->mem==mem)
 		{
-			if(0==which && (' '==strings[i2][idx] || '('==strings[i2][idx]))
-			{
-				int len=FXMIN(idx-start, (int) sizeof(p->stack[i2].file));
-				memcpy(p->stack[i2].file, strings[i2]+start, len);
-				p->stack[i2].file[len]=0;
-				which=(' '==strings[i2][idx]) ? 2 : 1;
-				start=idx+1;
-			}
-			else if(1==which && ')'==strings[i2][idx])
-			{
-				FXString functname(strings[i2]+start, idx-start);
-				FXint offset=functname.rfind("+0x");
-				FXString rawsymbol(functname.left(offset));
-				FXString symbol(rawsymbol.length() ? fxdemanglesymbol(rawsymbol, false) : rawsymbol);
-				symbol.append(functname.mid(offset));
-				int len=FXMIN(symbol.length(), (int) sizeof(p->stack[i2].functname));
-				memcpy(p->stack[i2].functname, symbol.text(), len);
-				p->stack[i2].functname[len]=0;
-				which=2;
-			}
-			else if(2==which && '['==strings[i2][idx])
-			{
-				start=idx+1;
-				which=3;
-			}
-			else if(3==which && ']'==strings[i2][idx])
-			{
-				FXString v(strings[i2]+start+2, idx-start-2);
-				p->stack[i2].pc=(void *)(FXuval)v.toULong(0, 16);
-			}
+			*ps=s->next;
+			s->stack->frees++;
+			s->stack->freebytes+=s->size;
+			mspace_free(heapprofms, s);
+			break;
 		}
 	}
-	free(strings);
+	RELEASE_LOCK(&((mstate) heapprofms)->mutex);
 }
 #endif
+/* Counts size bytes towards the next sample for this thread */
+static FORCEINLINE void HeapProfileMalloc(threadcache *tc, void *mem, size_t size) THROWSPEC
+{
+#if NEDMALLOC_HEAPPROFILE
+	if(tc && mem)
+	{
+		if(size<tc->heapprofleft)
+			tc->heapprofleft-=size;
+		else
+			HeapProfileSample(tc, mem, size);
+	}
 #endif
+}
+/* Nearly all buckets are empty, so most frees cost one load */
+static FORCEINLINE void HeapProfileFree(void *mem) THROWSPEC
+{
+#if NEDMALLOC_HEAPPROFILE
+	heapsample *volatile *samples=heapsamples;
+	if(samples && samples[HeapProfileHash(mem)])
+		HeapProfileUnsample(mem);
 #endif
-static FORCEINLINE logentry *LogOperation(threadcache *tc, nedpool *np, LogEntryType type, int mspace, size_t size, void *mem, size_t alignment, unsigned flags, void *returned) THROWSPEC
+}
+int nedheapprofile_dump(const char *path) THROWSPEC
 {
-#if ENABLE_LOGGING
-	if(tc->logentries && NEDMALLOC_TESTLOGENTRY(tc, np, type, mspace, size, mem, alignment, flags, returned))
+#if NEDMALLOC_HEAPPROFILE
+	heapstack *snapshot, *hs;
+	unsigned long long inuse=0, inusebytes=0, allocs=0, allocbytes=0;
+	size_t count=0, n;
+	FILE *oh;
+	int i;
+	if(!HeapProfileInit()) return 0;
+	/* Copy the call sites so nothing is locked while writing the file, which may allocate */
+	ACQUIRE_LOCK(&((mstate) heapprofms)->mutex);
+	for(n=0; n<HEAPPROFBUCKETS; n++)
+		for(hs=heapstacks[n]; hs; hs=hs->next)
+			count++;
+	if((snapshot=(heapstack *) mspace_malloc(heapprofms, (count ? count : 1)*sizeof(heapstack))))
+	{
+		count=0;
+		for(n=0; n<HEAPPROFBUCKETS; n++)
+			for(hs=heapstacks[n]; hs; hs=hs->next)
+				snapshot[count++]=*hs;
+	}
+	RELEASE_LOCK(&((mstate) heapprofms)->mutex);
+	if(!snapshot) return 0;
+	if(!(oh=fopen(path, "w")))
+	{
+		mspace_free(heapprofms, snapshot);
+		return 0;
+	}
+	for(n=0; n<count; n++)
 	{
-		logentry *le;
-		if(tc->logentriesptr==tc->logentriesend)
+		inuse+=snapshot[n].allocs-snapshot[n].frees;
+		inusebytes+=snapshot[n].allocbytes-snapshot[n].freebytes;
+		allocs+=snapshot[n].allocs;
+		allocbytes+=snapshot[n].allocbytes;
+	}
+	/* This is the legacy text heap profile which pprof reads and unsamples itself */
+	fprintf(oh, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%u\n", inuse, inusebytes, allocs, allocbytes, (unsigned int) NEDMALLOC_HEAPPROFILE);
+	for(n=0; n<count; n++)
+	{
+		hs=&snapshot[n];
+		fprintf(oh, "%llu: %llu [%llu: %llu] @", hs->allocs-hs->frees, hs->allocbytes-hs->freebytes, hs->allocs, hs->allocbytes);
+		for(i=0; i<hs->frames; i++)
+			fprintf(oh, " 0x%llx", (unsigned long long)(size_t) hs->stack[i]);
+		fprintf(oh, "\n");
+	}
+	mspace_free(heapprofms, snapshot);
+#ifdef __linux__
+	{	/* pprof needs the mappings to symbolise the addresses */
+		FILE *ih=fopen("/proc/self/maps", "r");
+		if(ih)
 		{
-			mchunkptr cp=mem2chunk(tc->logentries);
-			size_t logentrieslen=chunksize(cp)-overhead_for(cp);
-			le=(logentry *) CallRealloc(0, tc->logentries, 0, logentrieslen, (logentrieslen*3)/2, 0, M2_ZERO_MEMORY|M2_ALWAYS_MMAP|M2_RESERVE_MULT(8));
-			if(!le) return 0;
-			tc->logentriesptr=le+(tc->logentriesptr-tc->logentries);
-			tc->logentries=le;
-			cp=mem2chunk(tc->logentries);
-			logentrieslen=(chunksize(cp)-overhead_for(cp))/sizeof(logentry);
-			tc->logentriesend=tc->logentries+logentrieslen;
+			char buffer[4096];
+			size_t len;
+			fprintf(oh, "\nMAPPED_LIBRARIES:\n");
+			while((len=fread(buffer, 1, sizeof(buffer), ih)))
+				fwrite(buffer, 1, len, oh);
+			fclose(ih);
 		}
-		le=tc->logentriesptr++;
-		assert(le+1<=tc->logentriesend);
-		le->timestamp=GetTimestamp();
-		le->np=np;
-		le->type=type;
-		le->mspace=mspace;
-		le->size=size;
-		le->mem=mem;
-		le->alignment=alignment;
-		le->flags=flags;
-		le->returned=returned;
-#if NEDMALLOC_STACKBACKTRACEDEPTH
-		DoStackWalk(le);
-#endif
-		return le;
 	}
 #endif
+	fclose(oh);
+	return 1;
+#else
 	return 0;
+#endif
 }
 
 static FORCEINLINE NEDMALLOCNOALIASATTR unsigned int size2binidx(size_t _size) THROWSPEC
@@ -1164,14 +1532,29 @@ static void tcfullsanitycheck(threadcache *tc) THROWSPEC
 #endif
 
 static NOINLINE int InitPool(nedpool *RESTRICT p, size_t capacity, int threads) THROWSPEC;
+#if NEDMALLOC_STATSEXPORT
+static void StartStatsExport(void) THROWSPEC;
+#endif
+#if SMALLBLKMAX
+static NOINLINE void smallblk_cacheflush(threadcache *RESTRICT tc, unsigned int cls, unsigned int count) THROWSPEC;
+#endif
 static NOINLINE void RemoveCacheEntries(nedpool *RESTRICT p, threadcache *RESTRICT tc, unsigned int age) THROWSPEC
 {
 #ifdef FULLSANITYCHECKS
 	tcfullsanitycheck(tc);
+#endif
+#if SMALLBLKMAX
+	if(!age)
+	{	/* Small blocks aren't aged, so only go back to their runs when everything does */
+		unsigned int cls;
+		for(cls=0; cls<SMALLBLKCLASSES; cls++)
+			smallblk_cacheflush(tc, cls, tc->smallcount[cls]);
+	}
 #endif
 	if(tc->freeInCache)
 	{
 		threadcacheblk *RESTRICT *RESTRICT tcbptr=tc->bins;
+		size_t cached=tc->freeInCache;
 		int n;
 		for(n=0; n<=THREADCACHEMAXBINS; n++, tcbptr+=2)
 		{
@@ -1192,12 +1575,14 @@ static NOINLINE void RemoveCacheEntries(nedpool *RESTRICT p, threadcache *RESTRI
 				else
 					*tcbptr=0;
 				tc->freeInCache-=blksize;
+				tc->bincached[n]-=blksize;
 				assert((long) tc->freeInCache>=0);
 				CallFree(0, f, f->isforeign);
 				/*tcsanitycheck(tcbptr);*/
 				LogOperation(tc, p, LOGENTRY_THREADCACHE_CLEAN, age, blksize, f, 0, 0, 0);
 			}
 		}
+		NEDPROBE4(tcache_flush, p, tc->threadid, age, cached-tc->freeInCache);
 	}
 #ifdef FULLSANITYCHECKS
 	tcfullsanitycheck(tc);
@@ -1215,9 +1600,6 @@ size_t nedflushlogs(nedpool *p, char *filepath) THROWSPEC
 	{
 		threadcache *tc;
 		int n;
-#if ENABLE_LOGGING
-		int haslogentries=0;
-#endif
 		for(n=0; n<THREADCACHEMAXCACHES; n++)
 		{
 			if((tc=p->caches[n]))
@@ -1227,68 +1609,13 @@ size_t nedflushlogs(nedpool *p, char *filepath) THROWSPEC
 				RemoveCacheEntries(p, tc, 0);
 				assert(!tc->freeInCache);
 #if ENABLE_LOGGING
-				haslogentries|=!!tc->logentries;
+				StopLogRing(tc);
 #endif
 			}
 		}
 #if ENABLE_LOGGING
-		if(haslogentries)
-		{
-			char buffer[MAX_PATH]=NEDMALLOC_LOGFILE;
-			FILE *oh;
-			fpos_t pos1, pos2;
-			if(!filepath) filepath=buffer;
-			oh=fopen(filepath, "r+");
-			while(!oh)
-			{
-				char *bptr;
-				if((oh=fopen(filepath, "w"))) break;
-				if(ENOSPC==errno) break;
-				bptr=strrchr(filepath, '.');
-				if(bptr-filepath>=MAX_PATH-6) abort();
-				memcpy(bptr, "!.csv", 6);
-			}
-			if(oh)
-			{
-				fgetpos(oh, &pos1);
-				fseek(oh, 0, SEEK_END);
-				fgetpos(oh, &pos2);
-				if(pos1==pos2)
-					fprintf(oh, "Timestamp, Pool, Operation, MSpace, Size, Block, Alignment, Flags, Returned,\"Stack Backtrace\"\n");
-				for(n=0; n<THREADCACHEMAXCACHES; n++)
-				{
-					if((tc=p->caches[n]) && tc->logentries)
-					{
-						logentry *le;
-						for(le=tc->logentries; le<tc->logentriesptr; le++)
-						{
-							const char *LogEntryTypeString=LogEntryTypeStrings[size2binidx(((size_t)le->type)<<4)];
-							char stackbacktrace[16384]="?";
-#if NEDMALLOC_STACKBACKTRACEDEPTH
-							char *sbtp=stackbacktrace;
-							int i;
-							for(i=0; i<NEDMALLOC_STACKBACKTRACEDEPTH && le->stack[i].pc; i++)
-							{
-								sbtp+=sprintf(sbtp, "0x%p:%s:%s (%s:%u),",
-									le->stack[i].pc, le->stack[i].module, le->stack[i].functname, le->stack[i].file, le->stack[i].lineno);
-								if(sbtp>=stackbacktrace+sizeof(stackbacktrace)) abort();
-							}
-							if(NEDMALLOC_STACKBACKTRACEDEPTH==i)
-								strcpy(sbtp, "<backtrace may continue ...>");
-							else
-								strcpy(sbtp, "<backtrace ends>");
-							if(strchr(sbtp, 0)>=stackbacktrace+sizeof(stackbacktrace)) abort();
-#endif
-							fprintf(oh, "%llu, 0x%p, %s, %d, %Iu, 0x%p, %Iu, 0x%x, 0x%p,\"%s\"\n",
-								le->timestamp, le->np, LogEntryTypeString, le->mspace, le->size, le->mem, le->alignment, le->flags, le->returned, stackbacktrace);
-						}
-						CallFree(0, tc->logentries, 0);
-						tc->logentries=tc->logentriesptr=tc->logentriesend=0;
-					}
-				}
-				fclose(oh);
-			}
-		}
+		/* Closed rings get freed here, so none outlive the pool */
+		DrainLogRings(filepath);
 #endif
 	}
 	return count;
@@ -1348,25 +1675,11 @@ static NOINLINE threadcache *AllocCache(nedpool *RESTRICT p) THROWSPEC
 #endif
 	for(end=1; p->m[end]; end++);
 	tc->mymspace=abs(tc->threadid) % end;
-#if ENABLE_LOGGING
-	{
-		mchunkptr cp;
-		size_t logentrieslen=2048/sizeof(logentry);		/* One page */
-		tc->logentries=tc->logentriesptr=(logentry *) CallMalloc(p->m[0], logentrieslen*sizeof(logentry), 0, M2_ZERO_MEMORY|M2_ALWAYS_MMAP|M2_RESERVE_MULT(8));
-		if(!tc->logentries)
-		{
-#if USE_LOCKS
-			RELEASE_LOCK(&p->mutex);
-#endif
-			return 0;
-		}
-		cp=mem2chunk(tc->logentries);
-		logentrieslen=(chunksize(cp)-overhead_for(cp))/sizeof(logentry);
-		tc->logentriesend=tc->logentries+logentrieslen;
-	}
-#endif
 #if USE_LOCKS
 	RELEASE_LOCK(&p->mutex);
+#endif
+#if ENABLE_LOGGING
+	StartLogRing(p, tc);
 #endif
 	if(TLSSET(p->mycache, (void *)(size_t)(n+1))) abort();
 	return tc;
@@ -1377,7 +1690,7 @@ static void *threadcache_malloc(nedpool *RESTRICT p, threadcache *RESTRICT tc, s
 	void *RESTRICT ret=0;
 	size_t size=*_size, blksize=0;
 	unsigned int bestsize;
-	unsigned int idx=size2binidx(size);
+	unsigned int idx=size2binidx(size), wantidx;
 	threadcacheblk *RESTRICT blk, *RESTRICT *RESTRICT binsptr;
 #ifdef FULLSANITYCHECKS
 	tcfullsanitycheck(tc);
@@ -1409,6 +1722,7 @@ static void *threadcache_malloc(nedpool *RESTRICT p, threadcache *RESTRICT tc, s
 	assert(size<=THREADCACHEMAX);
 	assert(idx<=THREADCACHEMAXBINS);
 	binsptr=&tc->bins[idx*2];
+	wantidx=idx;
 	/* Try to match close, but move up a bin if necessary */
 	blk=*binsptr;
 	if(!blk || blk->size<size)
@@ -1443,9 +1757,13 @@ static void *threadcache_malloc(nedpool *RESTRICT p, threadcache *RESTRICT tc, s
 	{
 		assert(blksize>=size);
 		++tc->successes;
+		++tc->binhits[wantidx];
 		tc->freeInCache-=blksize;
+		tc->bincached[idx]-=blksize;
 		assert((long) tc->freeInCache>=0);
 	}
+	else
+		++tc->binmisses[wantidx];
 #if defined(DEBUG) && 0
 	if(!(tc->mallocs & 0xfff))
 	{
@@ -1530,6 +1848,7 @@ static void threadcache_free(nedpool *RESTRICT p, threadcache *RESTRICT tc, int
 	assert(tc->bins[idx*2+1]==tck || binsptr[0]->next->prev==tck);
 	/*printf("free: %p, %p, %p, %lu\n", p, tc, mem, (long) size);*/
 	tc->freeInCache+=size;
+	tc->bincached[idx]+=size;
 #ifdef FULLSANITYCHECKS
 	tcfullsanitycheck(tc);
 #endif
@@ -1539,34 +1858,220 @@ static void threadcache_free(nedpool *RESTRICT p, threadcache *RESTRICT tc, int
 #endif
 }
 
-
-
-
-static NOINLINE int InitPool(nedpool *RESTRICT p, size_t capacity, int threads) THROWSPEC
-{	/* threads is -1 for system pool */
-	ensure_initialization();
-	ACQUIRE_MALLOC_GLOBAL_LOCK();
-	if(p->threads) goto done;
-#if USE_LOCKS
-	if(INITIAL_LOCK(&p->mutex)) goto err;
+#if SMALLBLKMAX
+static FORCEINLINE smallblkrun *SmallBlkRun(void *RESTRICT mem) THROWSPEC
+{	/* Small blocks have no chunk header, so are recognised by their run's tagged page map entry */
+	size_t e=(size_t) pagemap_entry(mem);
+	return (e & PAGEMAP_EXT_BIT) ? (smallblkrun *)(e & ~PAGEMAP_EXT_BIT) : 0;
+}
+static NOINLINE smallblkrun *NewSmallBlkRun(mstate m, unsigned int cls) THROWSPEC
+{	/* Carves a new run of pages out of m, which must be locked. Asking for a chunk
+	overhead less than the run size has consecutive page aligned runs pack exactly */
+	const size_t runsize=SMALLBLKRUNSIZE-CHUNK_OVERHEAD;
+	smallblkrun *RESTRICT run;
+	char *mem=(char *) mspace_malloc2(m, runsize, mparams.page_size, 0);
+	if(!mem) return 0;
+	run=(smallblkrun *) mem;
+	run->m=m;
+	run->next=run->prev=0;
+	run->freelist=0;
+	run->unused=mem+((sizeof(smallblkrun)+MALLOC_ALIGNMENT-1) & ~(MALLOC_ALIGNMENT-1));
+	run->size=(unsigned int)((cls+1)*MALLOC_ALIGNMENT);
+	run->cls=cls;
+	run->used=0;
+	run->capacity=(unsigned int)((mem+runsize-run->unused)/run->size);
+	if(!pagemap_set(mem, runsize, (void *)((size_t) run | PAGEMAP_EXT_BIT)))
+	{
+		mspace_free(m, mem);
+		return 0;
+	}
+	return run;
+}
+static void *smallblk_malloc(mstate m, size_t size, unsigned flags) THROWSPEC
+{	/* m must be locked */
+	nedpool *RESTRICT p=(nedpool *) m->extp;
+	unsigned int cls=size ? (unsigned int)((size-1)/MALLOC_ALIGNMENT) : 0;
+	smallblkrun *RESTRICT *RESTRICT runs=&p->smallblks[m->exts][cls], *RESTRICT run=*runs;
+	void *RESTRICT ret;
+	if(!run)
+	{
+		if(!(run=NewSmallBlkRun(m, cls))) return 0;
+		*runs=run;
+	}
+	if(run->freelist)
+	{
+		ret=run->freelist;
+		run->freelist=*(void **) ret;
+	}
+	else
+	{
+		ret=(void *) run->unused;
+		run->unused+=run->size;
+	}
+	if(++run->used==run->capacity)
+	{	/* Full runs leave the list until a block is freed */
+		if((*runs=run->next)) run->next->prev=0;
+		run->next=0;
+	}
+	if(flags & M2_ZERO_MEMORY)
+		memset(ret, 0, run->size);
+	return ret;
+}
+static void smallblk_freelocked(smallblkrun *RESTRICT run, void *RESTRICT mem) THROWSPEC
+{	/* run->m must be locked */
+	mstate m=run->m;
+	nedpool *RESTRICT p=(nedpool *) m->extp;
+	smallblkrun *RESTRICT *RESTRICT runs=&p->smallblks[m->exts][run->cls];
+	*(void **) mem=run->freelist;
+	run->freelist=mem;
+	if(run->used--==run->capacity)
+	{	/* Was full, so rejoin the list */
+		run->prev=0;
+		if((run->next=*runs)) run->next->prev=run;
+		*runs=run;
+	}
+	else if(!run->used && (run->prev || run->next))
+	{	/* Hand empty runs back to the mspace, keeping the last of each class */
+		if(run->prev) run->prev->next=run->next; else *runs=run->next;
+		if(run->next) run->next->prev=run->prev;
+		pagemap_set((char *) run, SMALLBLKRUNSIZE-CHUNK_OVERHEAD, m);
+		mspace_free(m, run);
+	}
+#ifdef HAVE_VALGRIND
+	VALGRIND_MEMPOOL_FREE(m, mem);
+#endif
+}
+static void smallblk_free(smallblkrun *RESTRICT run, void *RESTRICT mem) THROWSPEC
+{
+	mstate m=run->m;
+#if USE_LOCKS
+	ACQUIRE_LOCK(&m->mutex);
+#endif
+	smallblk_freelocked(run, mem);
+#if USE_LOCKS
+	RELEASE_LOCK(&m->mutex);
+#endif
+}
+static void *smallblk_cachemalloc(mstate m, threadcache *RESTRICT tc, unsigned int cls) THROWSPEC
+{	/* Refills this thread's empty list of class cls from m, which must be locked, returning
+	one block. The list keeps the order the run hands them out in, which is usually ascending. */
+	const size_t size=(cls+1)*MALLOC_ALIGNMENT;
+	void *RESTRICT ret=smallblk_malloc(m, size, 0), *RESTRICT blk, **tail=(void **) &tc->smallblks[cls];
+	unsigned int n;
+	assert(!tc->smallblks[cls] && !tc->smallcount[cls]);
+#ifdef HAVE_VALGRIND
+	if(ret) VALGRIND_MEMPOOL_ALLOC(m, ret, size);
+#endif
+	for(n=0; ret && n<SMALLBLKCACHE/2 && (blk=smallblk_malloc(m, size, 0)); n++)
+	{
+#ifdef HAVE_VALGRIND
+		VALGRIND_MEMPOOL_ALLOC(m, blk, size);
+#endif
+		*tail=blk;
+		tail=(void **) blk;
+		tc->smallInCache+=size;
+	}
+	*tail=0;
+	tc->smallcount[cls]=n;
+	return ret;
+}
+static NOINLINE void smallblk_cacheflush(threadcache *RESTRICT tc, unsigned int cls, unsigned int count) THROWSPEC
+{	/* Hands count blocks of this thread's list of class cls back to their runs, locking each
+	mspace once per consecutive stretch of its blocks */
+	mstate locked=0;
+	for(; count && tc->smallblks[cls]; count--)
+	{
+		void *RESTRICT mem=tc->smallblks[cls];
+		smallblkrun *RESTRICT run=SmallBlkRun(mem);
+		tc->smallblks[cls]=*(void **) mem;
+		tc->smallcount[cls]--;
+		tc->smallInCache-=run->size;
+		if(run->m!=locked)
+		{
+#if USE_LOCKS
+			if(locked) RELEASE_LOCK(&locked->mutex);
+			ACQUIRE_LOCK(&run->m->mutex);
+#endif
+			locked=run->m;
+		}
+		smallblk_freelocked(run, mem);
+	}
+#if USE_LOCKS
+	if(locked) RELEASE_LOCK(&locked->mutex);
+#endif
+}
+static FORCEINLINE int smallblk_cachefree(nedpool *RESTRICT p, threadcache *RESTRICT tc, void *RESTRICT mem) THROWSPEC
+{	/* Holds a small block of this pool in this thread's list, returning false for anything else */
+	smallblkrun *RESTRICT run=SmallBlkRun(mem);
+	if(!run || run->m->extp!=p) return 0;
+	*(void **) mem=tc->smallblks[run->cls];
+	tc->smallblks[run->cls]=mem;
+	tc->smallInCache+=run->size;
+	if(++tc->smallcount[run->cls]>SMALLBLKCACHE)
+		smallblk_cacheflush(tc, run->cls, SMALLBLKCACHE/2);
+	return 1;
+}
+#endif
+
+
+
+
+#if USE_ALLOCATOR==1
+static mstate CreateMSpace(nedpool *RESTRICT p, int n, size_t capacity) THROWSPEC
+{	/* Creates the n'th mspace of a pool, within its share of any reservation */
+	mstate m;
+	if(p->reservation)
+	{
+		size_t share=(p->reservationsize/p->threads) & ~(mparams.granularity-1);
+		m=(mstate) create_mspace_with_reservation(p->reservation+n*share, share, 1);
+	}
+	else
+		m=(mstate) create_mspace(capacity, 1);
+	if(m)
+	{
+		m->extp=p;
+		m->exts=(size_t) n;
+		NEDPROBE3(mspace_create, p, n, m);
+	}
+	return m;
+}
+#endif
+static NOINLINE int InitPool(nedpool *RESTRICT p, size_t capacity, int threads) THROWSPEC
+{	/* threads is -1 for system pool. A non-zero p->reservationsize requests
+	that capacity be reserved up front (NP_RESERVE_CAPACITY). */
+	ensure_initialization();
+	ACQUIRE_MALLOC_GLOBAL_LOCK();
+	if(p->threads) goto done;
+#if USE_LOCKS
+	if(INITIAL_LOCK(&p->mutex)) goto err;
 #endif
 	if(TLSALLOC(&p->mycache)) goto err;
+	p->threads=(threads>MAXTHREADSINPOOL) ? MAXTHREADSINPOOL : (threads<=0) ? DEFAULTMAXTHREADSINPOOL : threads;
 #if USE_ALLOCATOR==0
 	p->m[0]=(mstate) mspacecounter++;
 #elif USE_ALLOCATOR==1
-	if(!(p->m[0]=(mstate) create_mspace(capacity, 1))) goto err;
+	if(p->reservationsize)
+	{
+		char *reservation;
+		p->reservationsize=granularity_align(p->reservationsize);
+		if(CMFAIL==(reservation=(char *) CALL_RESERVE(p->reservationsize))) goto err;
+		p->reservation=reservation;
+	}
+	if(!(p->m[0]=CreateMSpace(p, 0, capacity))) goto err;
 #ifdef HAVE_VALGRIND
 	VALGRIND_CREATE_MEMPOOL(p->m[0], 0, 1);
 #endif
-	p->m[0]->extp=p;
 #endif
-	p->threads=(threads>MAXTHREADSINPOOL) ? MAXTHREADSINPOOL : (threads<=0) ? DEFAULTMAXTHREADSINPOOL : threads;
 done:
 	RELEASE_MALLOC_GLOBAL_LOCK();
+#if NEDMALLOC_STATSEXPORT
+	if(threads<0) StartStatsExport();
+#endif
 	return 1;
 err:
 	if(threads<0)
 		abort();			/* If you can't allocate for system pool, we're screwed */
+	p->threads=0;
 	DestroyCaches(p);
 	if(p->m[0])
 	{
@@ -1578,6 +2083,13 @@ err:
 #endif
 		p->m[0]=0;
 	}
+#if USE_ALLOCATOR==1
+	if(p->reservation)
+	{
+		CALL_UNRESERVE(p->reservation, p->reservationsize);
+		p->reservation=0;
+	}
+#endif
 	if(p->mycache)
 	{
 		if(TLSFREE(p->mycache)) abort();
@@ -1604,11 +2116,12 @@ static NOINLINE mstate FindMSpace(nedpool *RESTRICT p, threadcache *RESTRICT tc,
 	}
 	if(end<p->threads)
 	{
-		mstate temp;
+		mstate temp=0;
 #if USE_ALLOCATOR==0
 		temp=(mstate) mspacecounter++;
 #elif USE_ALLOCATOR==1
-		if(!(temp=(mstate) create_mspace(size, 1)))
+		/* Reserved pools must know which share of the reservation to use first */
+		if(!p->reservation && !(temp=CreateMSpace(p, end, size)))
 			goto badexit;
 #endif
 		/* Now we're ready to modify the lists, we lock */
@@ -1619,16 +2132,27 @@ static NOINLINE mstate FindMSpace(nedpool *RESTRICT p, threadcache *RESTRICT tc,
 		{	/* Drat, must destroy it now */
 			RELEASE_LOCK(&p->mutex);
 #if USE_ALLOCATOR==1
-			destroy_mspace((mstate) temp);
+			if(temp)
+				destroy_mspace((mstate) temp);
 #endif
 			goto badexit;
 		}
+#if USE_ALLOCATOR==1
+		if(!temp && !(temp=CreateMSpace(p, end, size)))
+		{
+			RELEASE_LOCK(&p->mutex);
+			goto badexit;
+		}
+#endif
 		/* We really want to make sure this goes into memory now but we
 		have to be careful of breaking aliasing rules, so write it twice */
 		{
 			volatile struct malloc_state **_m=(volatile struct malloc_state **) &p->m[end];
 			*_m=(p->m[end]=temp);
 		}
+#if USE_ALLOCATOR==1
+		temp->exts=(size_t) end;		/* Another thread may have taken the slot it was created for */
+#endif
 #if USE_ALLOCATOR==1 && defined(HAVE_VALGRIND)
 		VALGRIND_CREATE_MEMPOOL(temp, 0, 1);
 #endif
@@ -1640,7 +2164,9 @@ static NOINLINE mstate FindMSpace(nedpool *RESTRICT p, threadcache *RESTRICT tc,
 	}
 	/* Let it lock on the last one it used */
 badexit:
+	NEDPROBE2(mspace_blocked, p, *lastUsed);
 	ACQUIRE_LOCK(&p->m[*lastUsed]->mutex);
+	NEDPROBE2(mspace_acquired, p, *lastUsed);
 	return p->m[*lastUsed];
 #endif
 found:
@@ -1653,6 +2179,46 @@ found:
 	}
 	return p->m[n];
 }
+#if USE_ALLOCATOR==1
+static NOINLINE void *MallocFromOtherShare(nedpool *RESTRICT p, int *RESTRICT mymspace, size_t size, size_t alignment, unsigned flags) THROWSPEC
+{	/* Gets called when an mspace of a reserving pool has used up its share of the
+	reservation. Rather than fail while the other shares have room, tries each of
+	them in turn, creating the mspaces for any shares not yet in use. */
+	void *ret=0;
+	int n;
+	for(n=0; !ret && n<p->threads; n++)
+	{
+		mstate m=p->m[n];
+		if(n==*mymspace) continue;
+		if(!m)
+		{	/* mspaces are created in order, so this is the next share */
+#if USE_LOCKS
+			ACQUIRE_LOCK(&p->mutex);
+#endif
+			if(!p->m[n] && (m=CreateMSpace(p, n, 0)))
+			{
+				volatile struct malloc_state **_m=(volatile struct malloc_state **) &p->m[n];
+				*_m=(p->m[n]=m);
+#ifdef HAVE_VALGRIND
+				VALGRIND_CREATE_MEMPOOL(m, 0, 1);
+#endif
+			}
+			m=p->m[n];
+#if USE_LOCKS
+			RELEASE_LOCK(&p->mutex);
+#endif
+			if(!m) break;
+		}
+		if(!PREACTION(m))
+		{
+			if((ret=CallMalloc(m, size, alignment, flags)))
+				*mymspace=n;
+			POSTACTION(m);
+		}
+	}
+	return ret;
+}
+#endif
 
 typedef struct PoolList_t
 {
@@ -1666,17 +2232,27 @@ typedef struct PoolList_t
 } PoolList;
 #if USE_LOCKS
 static MLOCK_T poollistlock;
+static volatile int poollistlockinitialised;
 #endif
 static PoolList *poollist;
 NEDMALLOCNOALIASATTR NEDMALLOCPTRATTR nedpool *nedcreatepool(size_t capacity, int threads) THROWSPEC
+{
+	return nedcreatepool2(capacity, threads, 0);
+}
+NEDMALLOCNOALIASATTR NEDMALLOCPTRATTR nedpool *nedcreatepool2(size_t capacity, int threads, unsigned flags) THROWSPEC
 {
 	nedpool *ret=0;
+	if((flags & NP_RESERVE_CAPACITY) && !capacity) return 0;
 	if(!poollist)
 	{
 		PoolList *newpoollist=0;
 		if(!(newpoollist=(PoolList *) nedpcalloc(0, 1, sizeof(PoolList)+sizeof(nedpool *)))) return 0;
 #if USE_LOCKS
-		INITIAL_LOCK(&poollistlock);
+		if(!poollistlockinitialised)
+		{	/* Never reinitialised as the stats exporter may be holding it */
+			INITIAL_LOCK(&poollistlock);
+			poollistlockinitialised=1;
+		}
 		ACQUIRE_LOCK(&poollistlock);
 #endif
 		poollist=newpoollist;
@@ -1699,6 +2275,11 @@ NEDMALLOCNOALIASATTR NEDMALLOCPTRATTR nedpool *nedcreatepool(size_t capacity, in
 		assert(poollist->size>poollist->length);
 	}
 	if(!(ret=(nedpool *) nedpcalloc(0, 1, sizeof(nedpool)))) goto badexit;
+	if(flags & NP_RESERVE_CAPACITY)
+	{	/* The mspaces take their memory from the reservation, not capacity */
+		ret->reservationsize=capacity;
+		capacity=0;
+	}
 	if(!InitPool(ret, capacity, threads))
 	{
 		nedpfree(0, ret);
@@ -1716,7 +2297,25 @@ badexit:
 void neddestroypool(nedpool *p) THROWSPEC
 {
 	unsigned int n;
+	/* Unlist the pool first so nothing walking the pool list can see it being destroyed */
+#if USE_LOCKS
+	ACQUIRE_LOCK(&poollistlock);
+#endif
+	assert(poollist);
+	for(n=0; n<poollist->length && poollist->list[n]!=p; n++)
+		/* empty */;
+	assert(n!=poollist->length);
+	/* Don't read past the last entry, which may be the end of the block */
+	memmove(&poollist->list[n], &poollist->list[n+1], (size_t)&poollist->list[poollist->length-1]-(size_t)&poollist->list[n]);
+	poollist->list[poollist->length-1]=0;
+	if(!--poollist->length)
+	{
+		assert(!poollist->list[0]);
+		nedpfree(0, poollist);
+		poollist=0;
+	}
 #if USE_LOCKS
+	RELEASE_LOCK(&poollistlock);
 	ACQUIRE_LOCK(&p->mutex);
 #endif
 	DestroyCaches(p);
@@ -1730,29 +2329,16 @@ void neddestroypool(nedpool *p) THROWSPEC
 #endif
 		p->m[n]=0;
 	}
+#if USE_ALLOCATOR==1
+	if(p->reservation)
+		CALL_UNRESERVE(p->reservation, p->reservationsize);
+#endif
 #if USE_LOCKS
 	RELEASE_LOCK(&p->mutex);
 	DESTROY_LOCK(&p->mutex);
 #endif
 	if(TLSFREE(p->mycache)) abort();
 	nedpfree(0, p);
-#if USE_LOCKS
-	ACQUIRE_LOCK(&poollistlock);
-#endif
-	assert(poollist);
-	for(n=0; n<poollist->length && poollist->list[n]!=p; n++)
-		/* empty */;
-	assert(n!=poollist->length);
-	memmove(&poollist->list[n], &poollist->list[n+1], (size_t)&poollist->list[poollist->length]-(size_t)&poollist->list[n]);
-	if(!--poollist->length)
-	{
-		assert(!poollist->list[0]);
-		nedpfree(0, poollist);
-		poollist=0;
-	}
-#if USE_LOCKS
-	RELEASE_LOCK(&poollistlock);
-#endif
 }
 void neddestroysyspool() THROWSPEC
 {
@@ -1844,10 +2430,20 @@ void nedtrimthreadcache(nedpool *p, int disable) THROWSPEC
 		assert(!tc->freeInCache);
 		if(disable)
 		{
+#if ENABLE_LOGGING
+			StopLogRing(tc);
+#endif
+			/* Hold the pool lock so nedpgetstats() never reads a freed cache */
+#if USE_LOCKS
+			ACQUIRE_LOCK(&p->mutex);
+#endif
 			tc->mymspace=-1;
 			tc->threadid=0;
-			CallFree(0, p->caches[mycache-1], 0);
 			p->caches[mycache-1]=0;
+			CallFree(0, tc, 0);
+#if USE_LOCKS
+			RELEASE_LOCK(&p->mutex);
+#endif
 		}
 	}
 }
@@ -1878,7 +2474,11 @@ static FORCEINLINE mstate GetMSpace(nedpool *RESTRICT p, threadcache *RESTRICT t
 	mstate m=p->m[mymspace];
 	assert(m);
 #if USE_LOCKS && USE_ALLOCATOR==1
-	if(!TRY_LOCK(&p->m[mymspace]->mutex)) m=FindMSpace(p, tc, &mymspace, size);
+	if(!TRY_LOCK(&p->m[mymspace]->mutex))
+	{
+		NEDPROBE2(mspace_contended, p, mymspace);
+		m=FindMSpace(p, tc, &mymspace, size);
+	}
 	/*assert(IS_LOCKED(&p->m[mymspace]->mutex));*/
 #endif
 	return m;
@@ -1910,7 +2510,8 @@ static NOINLINE void GetThreadCache_cold2(nedpool *RESTRICT *RESTRICT p, threadc
 static FORCEINLINE void GetThreadCache(nedpool *RESTRICT *RESTRICT p, threadcache *RESTRICT *RESTRICT tc, int *RESTRICT mymspace, size_t *RESTRICT size) THROWSPEC
 {
 	int mycache;
-#if THREADCACHEMAX
+#if THREADCACHEMAX && !SMALLBLKMAX
+	/* The small block allocator instead serves requests too small for the thread cache exactly */
 	if(size && *size<sizeof(threadcacheblk)) *size=sizeof(threadcacheblk);
 #endif
 	if(!*p)
@@ -1943,24 +2544,64 @@ NEDMALLOCNOALIASATTR NEDMALLOCPTRATTR void * nedpmalloc2(nedpool *p, size_t size
 	threadcache *tc;
 	int mymspace;
 	GetThreadCache(&p, &tc, &mymspace, &size);
+#if THREADCACHEMAX && SMALLBLKMAX
+	if(alignment<=MALLOC_ALIGNMENT && !(flags & NM_FLAGS_MASK) && tc && size<=SMALLBLKMAX)
+	{	/* Small blocks come from this thread's list for their class, refilled from the runs a batch at a time */
+		unsigned int cls=size ? (unsigned int)((size-1)/MALLOC_ALIGNMENT) : 0, idx=size2binidx((cls+1)*MALLOC_ALIGNMENT);
+		if((size_t) 1<<(idx+4)<(cls+1)*MALLOC_ALIGNMENT) idx++;
+		++tc->mallocs;
+		if((ret=tc->smallblks[cls]))
+		{
+			tc->smallblks[cls]=*(void **) ret;
+			tc->smallcount[cls]--;
+			tc->smallInCache-=(cls+1)*MALLOC_ALIGNMENT;
+			++tc->successes;
+			++tc->binhits[idx];
+			NEDPROBE3(tcache_hit, p, size, ret);
+		}
+		else
+		{
+			++tc->binmisses[idx];
+			NEDPROBE2(tcache_miss, p, size);
+			GETMSPACE(m, p, tc, mymspace, size,
+					  ret=smallblk_cachemalloc(m, tc, cls));
+		}
+		if(ret)
+		{
+			size=(cls+1)*MALLOC_ALIGNMENT;
+			if((flags & M2_ZERO_MEMORY))
+				memset(ret, 0, size);
+			LogOperation(tc, p, LOGENTRY_THREADCACHE_MALLOC, mymspace, size, 0, alignment, flags, ret);
+		}
+	}
+	else
+#endif
 #if THREADCACHEMAX
-	if(alignment<=MALLOC_ALIGNMENT && !(flags & NM_FLAGS_MASK) && tc && size<=THREADCACHEMAX)
+	if(alignment<=MALLOC_ALIGNMENT && !(flags & NM_FLAGS_MASK) && tc && size>=THREADCACHEMIN && size<=THREADCACHEMAX)
 	{	/* Use the thread cache */
 		if((ret=threadcache_malloc(p, tc, &size)))
 		{
+			NEDPROBE3(tcache_hit, p, size, ret);
 			if((flags & M2_ZERO_MEMORY))
 				memset(ret, 0, size);
 			LogOperation(tc, p, LOGENTRY_THREADCACHE_MALLOC, mymspace, size, 0, alignment, flags, ret);
 		}
+		else
+			NEDPROBE2(tcache_miss, p, size);
 	}
 #endif
 	if(!ret)
 	{	/* Use this thread's mspace */
         GETMSPACE(m, p, tc, mymspace, size,
                   ret=CallMalloc(m, size, alignment, flags));
+#if USE_ALLOCATOR==1
+		if(!ret && p->reservation)
+			ret=MallocFromOtherShare(p, &mymspace, size, alignment, flags);
+#endif
 		if(ret)
 			LogOperation(tc, p, LOGENTRY_POOL_MALLOC, mymspace, size, 0, alignment, flags, ret);
 	}
+	HeapProfileMalloc(tc, ret, size);
 	LogOperation(tc, p, LOGENTRY_MALLOC, mymspace, size, 0, alignment, flags, ret);
 	return ret;
 }
@@ -1985,17 +2626,31 @@ NEDMALLOCNOALIASATTR NEDMALLOCPTRATTR void * nedprealloc2(nedpool *p, void *mem,
 		fprintf(stderr, "nedmalloc: nedprealloc() called with a block not created by nedmalloc!\n");
 		abort();
 	}
-	else if(size<=memsize && memsize-size<
-#ifdef DEBUG
-		32
-#else
-		1024
-#endif
-		)		/* If realloc size is within 1Kb smaller than existing, noop it */
-		return mem;
+	else if(size<=memsize && memsize-size<=(memsize>>REALLOCSLACKSHIFT))
+		return mem;		/* If realloc size is only a little smaller than existing, noop it */
 	GetThreadCache(&p, &tc, &mymspace, &size);
+#if USE_ALLOCATOR==1 && !USE_MAGIC_HEADERS
+	if(!isforeign
+#if SMALLBLKMAX
+		&& !SmallBlkRun(mem)
+#endif
+		&& (alignment<=MALLOC_ALIGNMENT || !((size_t) mem & (alignment-1))))
+	{	/* Try growing into a free successor or shrinking in place first as that needs no copy.
+		Shrinks return the tail to the mspace. */
+		if((ret=CallRealloc(p->m[mymspace], mem, isforeign, memsize, size, alignment, flags|M2_PREVENT_MOVE)))
+		{
+			HeapProfileFree(mem);
+			HeapProfileMalloc(tc, ret, size);
+			LogOperation(tc, p, LOGENTRY_POOL_REALLOC, mymspace, size, mem, alignment, flags, ret);
+			LogOperation(tc, p, LOGENTRY_REALLOC, mymspace, size, mem, alignment, flags, ret);
+			return ret;
+		}
+		if(flags & M2_PREVENT_MOVE)
+			return 0;
+	}
+#endif
 #if THREADCACHEMAX
-	if(alignment<=MALLOC_ALIGNMENT && !(flags & NM_FLAGS_MASK) && tc && size && size<=THREADCACHEMAX)
+	if(alignment<=MALLOC_ALIGNMENT && !(flags & NM_FLAGS_MASK) && tc && size>=THREADCACHEMIN && size<=THREADCACHEMAX)
 	{	/* Use the thread cache */
 		if((ret=threadcache_malloc(p, tc, &size)))
 		{
@@ -2004,7 +2659,9 @@ NEDMALLOCNOALIASATTR NEDMALLOCPTRATTR void * nedprealloc2(nedpool *p, void *mem,
 			if((flags & M2_ZERO_MEMORY) && size>memsize)
 				memset((void *)((size_t)ret+memsize), 0, size-memsize);
 			LogOperation(tc, p, LOGENTRY_THREADCACHE_MALLOC, mymspace, size, mem, alignment, flags, ret);
-			if(!isforeign && memsize>=sizeof(threadcacheblk) && memsize<=(THREADCACHEMAX+CHUNK_OVERHEAD))
+			HeapProfileFree(mem);
+			HeapProfileMalloc(tc, ret, size);
+			if(!isforeign && memsize>=THREADCACHEMIN && memsize<=(THREADCACHEMAX+CHUNK_OVERHEAD))
 			{
 				threadcache_free(p, tc, mymspace, mem, memsize, isforeign);
 				LogOperation(tc, p, LOGENTRY_THREADCACHE_FREE, mymspace, memsize, mem, 0, 0, 0);
@@ -2016,13 +2673,46 @@ NEDMALLOCNOALIASATTR NEDMALLOCPTRATTR void * nedprealloc2(nedpool *p, void *mem,
 			}
 		}
 	}
+#endif
+#if SMALLBLKMAX
+	if(!ret && !isforeign && SmallBlkRun(mem))
+	{	/* Small blocks can't be resized in place, so move them. This is logged as
+		the one realloc rather than as a malloc and a free. */
+#if ENABLE_LOGGING
+		logring *ring=tc ? tc->ring : 0;
+		if(ring) tc->ring=0;
+#endif
+		if((ret=nedpmalloc2(p, size, alignment, flags)))
+		{
+			memcpy(ret, mem, memsize<size ? memsize : size);
+			nedpfree2(p, mem, 0);
+		}
+#if ENABLE_LOGGING
+		if(ring) tc->ring=ring;
+#endif
+	}
+	else
 #endif
 	if(!ret)
 	{	/* Reallocs always happen in the mspace they happened in, so skip
 		locking the preferred mspace for this thread */
 		ret=CallRealloc(p->m[mymspace], mem, isforeign, memsize, size, alignment, flags);
+#if USE_ALLOCATOR==1
+		if(!ret && p->reservation && !(flags & M2_PREVENT_MOVE)
+			&& (ret=MallocFromOtherShare(p, &mymspace, size, alignment, flags)))
+		{	/* The block's own share is used up, so move it into another */
+			memcpy(ret, mem, memsize<size ? memsize : size);
+			if((flags & M2_ZERO_MEMORY) && size>memsize)
+				memset((void *)((size_t)ret+memsize), 0, size-memsize);
+			CallFree(0, mem, isforeign);
+		}
+#endif
 		if(ret)
+		{
+			HeapProfileFree(mem);
+			HeapProfileMalloc(tc, ret, size);
 			LogOperation(tc, p, LOGENTRY_POOL_REALLOC, mymspace, size, mem, alignment, flags, ret);
+		}
 	}
 	LogOperation(tc, p, LOGENTRY_REALLOC, mymspace, size, mem, alignment, flags, ret);
 	return ret;
@@ -2047,9 +2737,15 @@ NEDMALLOCNOALIASATTR void   nedpfree2(nedpool *p, void *mem, unsigned flags) THR
 		fprintf(stderr, "nedmalloc: nedpfree() called with a block not created by nedmalloc!\n");
 		abort();
 	}
+	HeapProfileFree(mem);
 	GetThreadCache(&p, &tc, &mymspace, 0);
+#if THREADCACHEMAX && SMALLBLKMAX
+	if(tc && !isforeign && memsize<=SMALLBLKMAX && smallblk_cachefree(p, tc, mem))
+		LogOperation(tc, p, LOGENTRY_THREADCACHE_FREE, mymspace, memsize, mem, 0, 0, 0);
+	else
+#endif
 #if THREADCACHEMAX
-	if(mem && tc && !isforeign && memsize>=sizeof(threadcacheblk) && memsize<=(THREADCACHEMAX+CHUNK_OVERHEAD))
+	if(mem && tc && !isforeign && memsize>=THREADCACHEMIN && memsize<=(THREADCACHEMAX+CHUNK_OVERHEAD))
 	{
 		threadcache_free(p, tc, mymspace, mem, memsize, isforeign);
 		LogOperation(tc, p, LOGENTRY_THREADCACHE_FREE, mymspace, memsize, mem, 0, 0, 0);
@@ -2119,6 +2815,331 @@ struct nedmallinfo nedpmallinfo(nedpool *p) THROWSPEC
 	}
 	return ret;
 }
+#if THREADCACHEMAXBINS+1>NEDSTATS_MAXBINS || MAXTHREADSINPOOL+1>NEDSTATS_MAXMSPACES
+#error NEDSTATS_MAXBINS or NEDSTATS_MAXMSPACES in nedmalloc.h is too small for this configuration
+#endif
+int nedpgetstats(nedpool *p, struct nedstats *stats) THROWSPEC
+{
+	int n;
+#if THREADCACHEMAX
+	int b;
+#endif
+	if(!stats) return 0;
+	if(!p) { p=&syspool; if(!syspool.threads) InitPool(&syspool, 0, -1); }
+	memset(stats, 0, sizeof(*stats));
+#if THREADCACHEMAX
+	stats->bins=THREADCACHEMAXBINS+1;
+	for(b=0; b<=THREADCACHEMAXBINS; b++)
+		stats->bin[b].blocksize=(size_t) 1<<(b+4);
+#if USE_LOCKS
+	/* Thread caches are only freed under the pool lock, so holding it keeps them
+	valid. Their counters are still written by their threads as we read them. */
+	ACQUIRE_LOCK(&p->mutex);
+#endif
+	for(n=0; n<THREADCACHEMAXCACHES; n++)
+	{
+		threadcache *tc=p->caches[n];
+		if(!tc) continue;
+		stats->cached+=tc->freeInCache;
+#if SMALLBLKMAX
+		stats->cached+=tc->smallInCache;
+#endif
+		for(b=0; b<=THREADCACHEMAXBINS; b++)
+		{
+			stats->bin[b].hits+=tc->binhits[b];
+			stats->bin[b].misses+=tc->binmisses[b];
+			stats->bin[b].cached+=tc->bincached[b];
+		}
+		if(stats->threadcaches<NEDSTATS_MAXTHREADCACHES)
+		{
+			struct nedstatsthreadcache *s=&stats->threadcache[stats->threadcaches++];
+			s->threadid=tc->threadid;
+			s->mspace=tc->mymspace;
+			s->mallocs=tc->mallocs;
+			s->successes=tc->successes;
+			s->frees=tc->frees;
+			s->cached=tc->freeInCache;
+#if SMALLBLKMAX
+			s->cached+=tc->smallInCache;
+#endif
+		}
+	}
+#if USE_LOCKS
+	RELEASE_LOCK(&p->mutex);
+#endif
+#endif
+	for(n=0; p->m[n]; n++)
+	{
+		struct nedstatsmspace *s=&stats->mspace[stats->mspaces++];
+#if USE_ALLOCATOR==1
+		mstate m=p->m[n];
+		/* The locks are recursive, so mallinfo's walk and the counters are read under one hold */
+		if(!PREACTION(m))
+		{
+#if !NO_MALLINFO
+			struct mallinfo t=mspace_mallinfo(m);
+			s->inuse=t.uordblks;
+			s->mmapped=t.hblkhd;
+#endif
+			s->footprint=m->footprint;
+			s->maxfootprint=m->max_footprint;
+			s->mmapallocs=m->mmap_allocs;
+			s->mmapfrees=m->mmap_frees;
+#if MMAP_CACHE_ENTRIES
+			s->mmapcachehits=m->mmcache_hits;
+#endif
+			s->trims=m->trims;
+			s->trimmed=m->trimmed;
+			POSTACTION(m);
+		}
+#endif
+		stats->footprint+=s->footprint;
+		stats->inuse+=s->inuse;
+	}
+	return 1;
+}
+static void StatsAppend(char *buffer, size_t len, size_t *used, const char *fmt, ...) THROWSPEC
+{	/* Appends like snprintf, carrying on counting once buffer is full */
+	va_list args;
+	int w;
+	va_start(args, fmt);
+	w=vsnprintf(*used<len ? buffer+*used : 0, *used<len ? len-*used : 0, fmt, args);
+	va_end(args);
+	if(w>0) *used+=w;
+}
+size_t nedstatsjson(const struct nedstats *stats, char *buffer, size_t len) THROWSPEC
+{
+	size_t used=0;
+	unsigned int n;
+	if(len) *buffer=0;
+	StatsAppend(buffer, len, &used, "{\"footprint\":%llu,\"inuse\":%llu,\"cached\":%llu,\"bins\":[",
+		(unsigned long long) stats->footprint, (unsigned long long) stats->inuse, (unsigned long long) stats->cached);
+	for(n=0; n<stats->bins; n++)
+	{
+		const struct nedstatsbin *s=&stats->bin[n];
+		StatsAppend(buffer, len, &used, "%s{\"blocksize\":%llu,\"hits\":%llu,\"misses\":%llu,\"cached\":%llu}", n ? "," : "",
+			(unsigned long long) s->blocksize, (unsigned long long) s->hits, (unsigned long long) s->misses, (unsigned long long) s->cached);
+	}
+	StatsAppend(buffer, len, &used, "],\"threadcaches\":[");
+	for(n=0; n<stats->threadcaches; n++)
+	{
+		const struct nedstatsthreadcache *s=&stats->threadcache[n];
+		StatsAppend(buffer, len, &used, "%s{\"threadid\":%ld,\"mspace\":%d,\"mallocs\":%llu,\"successes\":%llu,\"frees\":%llu,\"cached\":%llu}", n ? "," : "",
+			s->threadid, s->mspace, (unsigned long long) s->mallocs, (unsigned long long) s->successes, (unsigned long long) s->frees, (unsigned long long) s->cached);
+	}
+	StatsAppend(buffer, len, &used, "],\"mspaces\":[");
+	for(n=0; n<stats->mspaces; n++)
+	{
+		const struct nedstatsmspace *s=&stats->mspace[n];
+		StatsAppend(buffer, len, &used, "%s{\"footprint\":%llu,\"maxfootprint\":%llu,\"inuse\":%llu,\"mmapped\":%llu,\"mmapallocs\":%llu,\"mmapfrees\":%llu,\"mmapcachehits\":%llu,\"trims\":%llu,\"trimmed\":%llu}", n ? "," : "",
+			(unsigned long long) s->footprint, (unsigned long long) s->maxfootprint, (unsigned long long) s->inuse, (unsigned long long) s->mmapped,
+			(unsigned long long) s->mmapallocs, (unsigned long long) s->mmapfrees, (unsigned long long) s->mmapcachehits, (unsigned long long) s->trims, (unsigned long long) s->trimmed);
+	}
+	StatsAppend(buffer, len, &used, "]}");
+	return used;
+}
+#if USE_ALLOCATOR==1
+static void FragReportMSpace(mstate m, char *buffer, size_t len, size_t *used) THROWSPEC
+{	/* Walks m's segments chunk by chunk as traverse_and_check() does. m must be locked */
+	size_t histcount[sizeof(size_t)*8], histbytes[sizeof(size_t)*8];
+	size_t inuse=0, freebytes=0, freechunks=0, largestfree=0, topsize=is_initialized(m) ? m->topsize+TOP_FOOT_SIZE : 0;
+	msegmentptr s;
+	unsigned int n, segs=0, buckets=0;
+	memset(histcount, 0, sizeof(histcount));
+	memset(histbytes, 0, sizeof(histbytes));
+	StatsAppend(buffer, len, used, "{\"footprint\":%llu,\"top\":%llu,\"dv\":%llu,\"segments\":[",
+		(unsigned long long) m->footprint, (unsigned long long) topsize, (unsigned long long) m->dvsize);
+	for(s=is_initialized(m) ? &m->seg : 0; s; s=s->next, segs++)
+	{
+		mchunkptr q=align_as_chunk(s->base);
+		/* Only mmapped segments other than the one holding top are ever released */
+		int releasable=s!=&m->seg && is_mmapped_segment(s) && !is_extern_segment(s);
+		size_t seginuse=0, segfree=0, segchunks=0, segfreechunks=0, pins=0;
+		mchunkptr pinning[NEDMALLOC_FRAGREPORTPINS];
+		for(; segment_holds(s, q) && q!=m->top && q->head!=FENCEPOST_HEAD; q=next_chunk(q))
+		{
+			size_t sz=chunksize(q);
+			segchunks++;
+			if(is_inuse(q))
+			{
+				seginuse+=sz;
+				/* The segment record kept past the end of the last chunk and the
+				mstate itself are bookkeeping rather than pins */
+				if((char *) q<s->base+s->size-TOP_FOOT_SIZE && (void *) chunk2mem(q)!=(void *) m)
+				{
+					if(pins<NEDMALLOC_FRAGREPORTPINS) pinning[pins]=q;
+					pins++;
+				}
+			}
+			else
+			{
+				unsigned int bucket=0;
+				while((sz>>bucket)>1) bucket++;
+				histcount[bucket]++;
+				histbytes[bucket]+=sz;
+				segfree+=sz;
+				segfreechunks++;
+				if(sz>largestfree) largestfree=sz;
+			}
+		}
+		if(segment_holds(s, m->top))
+			segfree+=topsize;
+		inuse+=seginuse;
+		freebytes+=segfree;
+		freechunks+=segfreechunks;
+		StatsAppend(buffer, len, used, "%s{\"base\":\"0x%llx\",\"size\":%llu,\"inuse\":%llu,\"free\":%llu,\"utilisation\":%.3f,\"chunks\":%llu,\"freechunks\":%llu,\"mmapped\":%d,\"extern\":%d,\"releasable\":%d,\"pins\":%llu,\"pinning\":[",
+			segs ? "," : "", (unsigned long long)(size_t) s->base, (unsigned long long) s->size, (unsigned long long) seginuse, (unsigned long long) segfree,
+			s->size ? (double) seginuse/s->size : 0.0, (unsigned long long) segchunks, (unsigned long long) segfreechunks,
+			is_mmapped_segment(s) ? 1 : 0, is_extern_segment(s) ? 1 : 0, releasable, (unsigned long long)(releasable ? pins : 0));
+		/* Every allocated chunk pins a releasable segment, so name the first few */
+		for(n=0; releasable && n<pins && n<NEDMALLOC_FRAGREPORTPINS; n++)
+			StatsAppend(buffer, len, used, "%s{\"block\":\"0x%llx\",\"size\":%llu}", n ? "," : "",
+				(unsigned long long)(size_t) chunk2mem(pinning[n]), (unsigned long long) chunksize(pinning[n]));
+		StatsAppend(buffer, len, used, "]}");
+	}
+	StatsAppend(buffer, len, used, "],\"inuse\":%llu,\"free\":%llu,\"freechunks\":%llu,\"largestfree\":%llu,\"histogram\":[",
+		(unsigned long long) inuse, (unsigned long long) freebytes, (unsigned long long) freechunks, (unsigned long long) largestfree);
+	for(n=0; n<sizeof(size_t)*8; n++)
+	{
+		if(!histcount[n]) continue;
+		StatsAppend(buffer, len, used, "%s{\"size\":%llu,\"count\":%llu,\"bytes\":%llu}", buckets++ ? "," : "",
+			(unsigned long long)((size_t) 1<<n), (unsigned long long) histcount[n], (unsigned long long) histbytes[n]);
+	}
+	StatsAppend(buffer, len, used, "]}");
+}
+#endif
+size_t nedpfragreport(nedpool *p, char *buffer, size_t len) THROWSPEC
+{
+	size_t used=0;
+	int n, mspaces=0;
+	if(!p) { p=&syspool; if(!syspool.threads) InitPool(&syspool, 0, -1); }
+	if(len) *buffer=0;
+	StatsAppend(buffer, len, &used, "{\"mspaces\":[");
+	for(n=0; p->m[n]; n++)
+	{
+#if USE_ALLOCATOR==1
+		mstate m=p->m[n];
+		/* Each mspace is held only while it is walked */
+		if(!PREACTION(m))
+		{
+			if(mspaces++) StatsAppend(buffer, len, &used, ",");
+			FragReportMSpace(m, buffer, len, &used);
+			POSTACTION(m);
+		}
+#endif
+	}
+	StatsAppend(buffer, len, &used, "]}");
+	return used;
+}
+#if NEDMALLOC_STATSEXPORT
+static void *volatile statsexportstarted;
+static char statsexportname[64];
+static struct nedstatsexport statsexportnext;
+static void StatsExportPool(nedpool *p, struct nedstatsexportpool *ep) THROWSPEC
+{	/* Folds the counters each thread bumps in its own cache into one pool total. Only
+	counters are read here as mallinfo would walk every mspace under its lock each update. */
+	int n;
+	memset(ep, 0, sizeof(*ep));
+	if(!p->threads) return;
+	ep->pool=(p==&syspool) ? 0 : (size_t) p;
+#if THREADCACHEMAX
+#if USE_LOCKS
+	ACQUIRE_LOCK(&p->mutex);
+#endif
+	for(n=0; n<THREADCACHEMAXCACHES; n++)
+	{
+		threadcache *tc=p->caches[n];
+		if(!tc) continue;
+		ep->cached+=tc->freeInCache;
+#if SMALLBLKMAX
+		ep->cached+=tc->smallInCache;
+#endif
+		ep->mallocs+=tc->mallocs;
+		ep->cachehits+=tc->successes;
+		ep->frees+=tc->frees;
+		ep->threadcaches++;
+	}
+#if USE_LOCKS
+	RELEASE_LOCK(&p->mutex);
+#endif
+#endif
+	for(n=0; p->m[n]; n++)
+	{
+#if USE_ALLOCATOR==1
+		mstate m=p->m[n];
+		if(!PREACTION(m))
+		{
+			ep->footprint+=m->footprint;
+			ep->maxfootprint+=m->max_footprint;
+			ep->mmapallocs+=m->mmap_allocs;
+			ep->mmapfrees+=m->mmap_frees;
+			ep->trims+=m->trims;
+			ep->trimmed+=m->trimmed;
+			POSTACTION(m);
+		}
+#endif
+		ep->mspaces++;
+	}
+}
+static void UpdateStatsExport(struct nedstatsexport *e) THROWSPEC
+{
+	unsigned int n=0, i;
+	/* Gather everything first so the segment is only being written for a memcpy */
+	StatsExportPool(&syspool, &statsexportnext.pool[n++]);
+	if(poollistlockinitialised)
+	{
+		ACQUIRE_LOCK(&poollistlock);
+		for(i=0; poollist && i<poollist->length && n<NEDSTATSEXPORT_MAXPOOLS; i++)
+			StatsExportPool(poollist->list[i], &statsexportnext.pool[n++]);
+		RELEASE_LOCK(&poollistlock);
+	}
+	e->seq++;
+	__sync_synchronize();
+	memcpy(e->pool, statsexportnext.pool, n*sizeof(e->pool[0]));
+	e->pools=n;
+	e->updates++;
+	__sync_synchronize();
+	e->seq++;
+}
+static void StatsExportAtExit(void)
+{
+	shm_unlink(statsexportname);
+}
+static void *StatsExportThread(void *arg) THROWSPEC
+{
+	struct nedstatsexport *e;
+	int fd;
+	sprintf(statsexportname, NEDMALLOC_STATSEXPORTNAME, (unsigned int) getpid());
+	if(-1==(fd=shm_open(statsexportname, O_CREAT|O_TRUNC|O_RDWR, 0644))) return 0;
+	if(ftruncate(fd, sizeof(*e)) || MAP_FAILED==(e=(struct nedstatsexport *) mmap(0, sizeof(*e), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)))
+	{
+		close(fd);
+		shm_unlink(statsexportname);
+		return 0;
+	}
+	close(fd);
+	atexit(StatsExportAtExit);
+	e->size=sizeof(*e);
+	e->pid=(unsigned int) getpid();
+	e->interval=NEDMALLOC_STATSEXPORT;
+	UpdateStatsExport(e);
+	__sync_synchronize();
+	memcpy(e->magic, "NEDSTAT1", 8);
+	for(;;)
+	{
+		usleep(NEDMALLOC_STATSEXPORT*1000);
+		UpdateStatsExport(e);
+	}
+	return 0;
+}
+static void StartStatsExport(void) THROWSPEC
+{
+	pthread_t exporter;
+	if(__sync_bool_compare_and_swap(&statsexportstarted, (void *) 0, (void *) 1)
+		&& !pthread_create(&exporter, 0, StatsExportThread, 0))
+		pthread_detach(exporter);
+}
+#endif
 int    nedpmallopt(nedpool *p, int parno, int value) THROWSPEC
 {
 #if USE_ALLOCATOR==1
@@ -2191,11 +3212,13 @@ static FORCEINLINE NEDMALLOCNOALIASATTR NEDMALLOCPTRATTR void ** CallIndependent
     }
 #endif
 #endif
+#if !USE_PAGEMAP && !defined(ENABLE_FAST_HEAP_DETECTION)
     if(ret)
     {
   		if(!leastusedaddress || (void *)((mstate) m)->least_addr<leastusedaddress) leastusedaddress=(void *)((mstate) m)->least_addr;
 	  	/*if(!largestusedblock || truesize>largestusedblock) largestusedblock=(truesize+mparams.page_size) & ~(mparams.page_size-1);*/
     }
+#endif
     return ret;
 }
 NEDMALLOCNOALIASATTR NEDMALLOCPTRATTR void **nedpindependent_calloc(nedpool *p, size_t elemsno, size_t elemsize, void **chunks) THROWSPEC
@@ -2234,11 +3257,13 @@ static FORCEINLINE NEDMALLOCNOALIASATTR NEDMALLOCPTRATTR void **CallIndependentC
 	}
 #endif
 #endif
+#if !USE_PAGEMAP && !defined(ENABLE_FAST_HEAP_DETECTION)
 	if(ret)
 	{
 		if(!leastusedaddress || (void *)((mstate) m)->least_addr<leastusedaddress) leastusedaddress=(void *)((mstate) m)->least_addr;
 		/*if(!largestusedblock || truesize>largestusedblock) largestusedblock=(truesize+mparams.page_size) & ~(mparams.page_size-1);*/
 	}
+#endif
 	return ret;
 }
 NEDMALLOCNOALIASATTR NEDMALLOCPTRATTR void **nedpindependent_comalloc(nedpool *p, size_t elems, size_t *sizes, void **chunks) THROWSPEC
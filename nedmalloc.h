@@ -97,6 +97,25 @@ Define to enable the usage of &lt;type_traits&gt;. Automatically defined if __cp
 indicates a C++0x compiler, otherwise you'll need to set it yourself.
 */
 
+/*! \def HAVE_CPP0XTHREADLOCAL
+\ingroup C++
+\brief Enables thread_local and &lt;mutex&gt;
+
+Define to enable the usage of thread_local variables and std::mutex, which the
+nedpolicy::nodepool policy needs. Unlike the others this is never defined automatically,
+as it would pull &lt;mutex&gt; into every user of this header, so define it before
+including nedmalloc.h if you want nodepool.
+*/
+
+/*! \def HAVE_CPP17MEMORYRESOURCE
+\ingroup C++
+\brief Enables nedalloc::pool_resource and nedalloc::monotonic_pool_resource
+
+Define to enable the C++17 &lt;memory_resource&gt; adaptors. Automatically defined if
+__cplusplus indicates a C++17 compiler whose library provides &lt;memory_resource&gt;,
+otherwise you'll need to set it yourself.
+*/
+
 #if __cplusplus > 199711L || defined(HAVE_CPP0X) /* Do we have C++0x? */
 #undef HAVE_CPP0XRVALUEREFS
 #define HAVE_CPP0XRVALUEREFS 1
@@ -107,6 +126,11 @@ indicates a C++0x compiler, otherwise you'll need to set it yourself.
 #undef HAVE_CPP0XTYPETRAITS
 #define HAVE_CPP0XTYPETRAITS 1
 #endif
+#if (__cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)) && defined(__has_include)
+#if __has_include(<memory_resource>) && !defined(HAVE_CPP17MEMORYRESOURCE)
+#define HAVE_CPP17MEMORYRESOURCE 1
+#endif
+#endif
 
 #include <stddef.h>   /* for size_t */
 
@@ -255,10 +279,12 @@ Always turns on ENABLE_TOLERANT_NEDMALLOC.
 
 ENABLE_TOLERANT_NEDMALLOC is automatically turned on if REPLACE_SYSTEM_ALLOCATOR
 is set or the Windows DLL is being built. This causes nedmalloc to detect when a
-system allocator block is passed to it and to handle it appropriately. Note that
-without USE_MAGIC_HEADERS there is a very tiny chance that nedmalloc will segfault
-on non-Windows builds (it uses Win32 SEH to trap segfaults on Windows and there
-is no comparable system on POSIX).
+system allocator block is passed to it and to handle it appropriately. When
+USE_PAGEMAP is on (the default wherever mmap is available) detection is exact, as
+nedmalloc looks up the owner of a block's page rather than inspecting the block.
+Otherwise without USE_MAGIC_HEADERS there is a very tiny chance that nedmalloc will
+segfault on non-Windows builds (it uses Win32 SEH to trap segfaults on Windows and
+there is no comparable system on POSIX).
 */
 
 #if defined(__cplusplus)
@@ -277,6 +303,89 @@ struct nedmallinfo {
   size_t fordblks; /*!< total free space */
   size_t keepcost; /*!< releasable (via malloc_trim) space */
 };
+
+/*! \brief The most thread cache bins, thread caches and mspaces nedpgetstats() reports */
+#define NEDSTATS_MAXBINS 32
+#define NEDSTATS_MAXTHREADCACHES 256
+#define NEDSTATS_MAXMSPACES 32
+/*! \brief Statistics about one size of block kept by the thread caches */
+struct nedstatsbin {
+  size_t blocksize;   /*!< the size of block kept in this bin */
+  size_t hits;        /*!< mallocs of this size served by a thread cache */
+  size_t misses;      /*!< mallocs of this size which went to an mspace */
+  size_t cached;      /*!< bytes currently held in this bin by all thread caches */
+};
+/*! \brief Statistics about one thread cache */
+struct nedstatsthreadcache {
+  long threadid;      /*!< the thread owning this cache */
+  int mspace;         /*!< the mspace the thread last used */
+  size_t mallocs;     /*!< mallocs which tried this cache */
+  size_t successes;   /*!< mallocs served by this cache */
+  size_t frees;       /*!< frees into this cache */
+  size_t cached;      /*!< bytes currently held by this cache */
+};
+/*! \brief Statistics about one mspace */
+struct nedstatsmspace {
+  size_t footprint;     /*!< bytes currently obtained from the system */
+  size_t maxfootprint;  /*!< the most bytes ever obtained from the system */
+  size_t inuse;         /*!< bytes in allocated chunks, including direct mmaps */
+  size_t mmapped;       /*!< bytes in direct mmapped chunks */
+  size_t mmapallocs;    /*!< direct mmapped chunks allocated */
+  size_t mmapfrees;     /*!< direct mmapped chunks freed */
+  size_t mmapcachehits; /*!< direct mmapped chunks recycled from the mmap cache */
+  size_t trims;         /*!< times free memory was returned to the system */
+  size_t trimmed;       /*!< bytes returned to the system */
+};
+/*! \brief Statistics about a memory pool filled in by nedpgetstats() */
+struct nedstats {
+  size_t footprint;   /*!< total of mspace footprints */
+  size_t inuse;       /*!< total of mspace bytes in use, which includes thread cached blocks */
+  size_t cached;      /*!< total bytes held by thread caches */
+  unsigned int bins;         /*!< entries used in bin */
+  unsigned int threadcaches; /*!< entries used in threadcache */
+  unsigned int mspaces;      /*!< entries used in mspace */
+  struct nedstatsbin bin[NEDSTATS_MAXBINS];
+  struct nedstatsthreadcache threadcache[NEDSTATS_MAXTHREADCACHES];
+  struct nedstatsmspace mspace[NEDSTATS_MAXMSPACES];
+};
+
+/*! \brief The most pools published in the shared memory segment when NEDMALLOC_STATSEXPORT is set */
+#define NEDSTATSEXPORT_MAXPOOLS 64
+/*! \brief One pool's counters in the shared memory segment. Thread cache counters are
+totals over the pool's live thread caches. */
+struct nedstatsexportpool {
+  unsigned long long pool;          /*!< address of the pool, zero for the system pool */
+  unsigned long long footprint;     /*!< as nedpmalloc_footprint() */
+  unsigned long long maxfootprint;  /*!< the most bytes ever obtained from the system */
+  unsigned long long cached;        /*!< bytes held by thread caches */
+  unsigned long long mallocs;       /*!< mallocs which tried a thread cache */
+  unsigned long long cachehits;     /*!< mallocs served by a thread cache */
+  unsigned long long frees;         /*!< frees into a thread cache */
+  unsigned long long mmapallocs;    /*!< direct mmapped chunks allocated */
+  unsigned long long mmapfrees;     /*!< direct mmapped chunks freed */
+  unsigned long long trims;         /*!< times free memory was returned to the system */
+  unsigned long long trimmed;       /*!< bytes returned to the system */
+  unsigned int threadcaches;        /*!< live thread caches */
+  unsigned int mspaces;             /*!< mspaces in use */
+};
+/*! \brief The layout of the shared memory segment published when NEDMALLOC_STATSEXPORT
+is set. It is the same for 32 and 64 bit processes.
+
+The segment is updated with seqlock semantics: seq is odd while an update is in progress,
+so a reader copies the segment, checks seq was even and unchanged either side of the
+copy, and retries otherwise.
+*/
+struct nedstatsexport {
+  char magic[8];                    /*!< "NEDSTAT1" */
+  unsigned int size;                /*!< sizeof(struct nedstatsexport) */
+  volatile unsigned int seq;        /*!< odd while being updated */
+  unsigned int pid;                 /*!< the exporting process */
+  unsigned int interval;            /*!< milliseconds between updates */
+  unsigned int pools;               /*!< entries used in pool */
+  unsigned int padding;
+  unsigned long long updates;       /*!< updates so far */
+  struct nedstatsexportpool pool[NEDSTATSEXPORT_MAXPOOLS];
+};
 #if defined(__cplusplus)
 }
 #endif
@@ -407,7 +516,22 @@ flag at the beginning along with one of the M2_RESERVE_* flags below. This can
 <strong>greatly</strong> improve performance for large arrays.
 */
 #define M2_ALWAYS_MMAP          (1<<2)
-#define M2_RESERVED1            (1<<3)
+
+/*! \def M2_PREFAULT
+\ingroup v2malloc
+\brief Populates the pages backing the allocated block (or any increase in the 
+allocated block) at allocation time rather than on first touch.
+
+Fresh mmapped chunks are requested using MAP_POPULATE where available, while 
+memory carved from existing segments is populated using MADV_POPULATE_WRITE, 
+falling back to MADV_WILLNEED plus touching each page where that is unsupported.
+
+\li <strong>Rationale:</strong> Latency sensitive threads can take the page 
+faults for their buffers up front during setup rather than on first touch in 
+their hot loop. Note that this flag inhibits the threadcache, so it is best used 
+for large, long lived allocations.
+*/
+#define M2_PREFAULT             (1<<3)
 #define M2_RESERVED2            (1<<4)
 #define M2_RESERVED3            (1<<5)
 #define M2_RESERVED4            (1<<6)
@@ -529,6 +653,27 @@ where bursts of concurrent threads use a pool at once.
 */
 NEDMALLOCEXTSPEC NEDMALLOCNOALIASATTR NEDMALLOCPTRATTR nedpool *nedcreatepool(size_t capacity, int threads) THROWSPEC;
 
+/*! \def NP_RESERVE_CAPACITY
+\brief Causes nedcreatepool2() to reserve capacity bytes of contiguous address space
+up front from which the pool will obtain all of its memory.
+
+The reservation is divided equally between the pool's \em threads mspaces, each of
+which grows by committing further pages of its share rather than mapping new
+segments, and is trimmed by decommitting them again. No block is ever directly
+mmapped, so every block allocated from the pool lies within the reservation.
+Once an mspace's share is exhausted its allocations are served from the other shares,
+and they fail only when no share has room. Each share must be at least the mspace
+granularity (1Mb by default) otherwise pool creation fails.
+*/
+#define NP_RESERVE_CAPACITY     (1<<0)
+
+/*! \brief Creates a memory pool for use with the nedp* functions below, as
+nedcreatepool() but with flags.
+
+Flags may be NP_RESERVE_CAPACITY.
+*/
+NEDMALLOCEXTSPEC NEDMALLOCNOALIASATTR NEDMALLOCPTRATTR nedpool *nedcreatepool2(size_t capacity, int threads, unsigned flags) THROWSPEC;
+
 /*! \brief Destroys a memory pool previously created by nedcreatepool().
 */
 NEDMALLOCEXTSPEC void neddestroypool(nedpool *p) THROWSPEC;
@@ -571,15 +716,28 @@ NEDMALLOCEXTSPEC void neddisablethreadcache(nedpool *p) THROWSPEC;
 /*! \brief Releases all memory in all threadcaches in the pool, and writes all
 accumulated memory operations to the log if enabled.
 
-You can pass zero for filepath to use the compiled default, or else a char[MAX_PATH]
-containing the path you wish to use for the log file. The log file is always
-appended to if it already exists. After writing the logs, the logging ability
-is disabled for that pool.
+Logged operations are kept in a lock-free ring per thread which a background thread
+drains into a compact binary trace file every NEDMALLOC_LOGFLUSHINTERVAL milliseconds.
+This call drains them immediately. Use nedtrace2csv to convert the trace into CSV.
+
+You can pass zero for filepath to use the compiled default, or else the path you
+wish to use for the log file from now on. The log file is always appended to if it
+already exists. After writing the logs, the logging ability is disabled for that pool.
 
 \warning Do NOT call this if the pool is in use - this call is NOT threadsafe.
 */
 NEDMALLOCEXTSPEC size_t nedflushlogs(nedpool *p, char *filepath) THROWSPEC;
 
+/*! \brief Writes the sampled heap profile to path, returning zero on failure or if
+NEDMALLOC_HEAPPROFILE was not set when nedalloc was built.
+
+The output is the legacy text heap profile which pprof reads, so
+<tt>pprof --inuse_space yourprogram path</tt> shows live memory by call site and
+<tt>--alloc_space</tt> shows where memory was allocated over the life of the process.
+Only allocations made by threads with a thread cache are sampled.
+*/
+NEDMALLOCEXTSPEC int nedheapprofile_dump(const char *path) THROWSPEC;
+
 
 /*! \brief Equivalent to nedpmalloc2(p, size, 0, 0) */
 NEDMALLOCEXTSPEC NEDMALLOCNOALIASATTR NEDMALLOCPTRATTR void * nedpmalloc(nedpool *p, size_t size) THROWSPEC;
@@ -609,6 +767,36 @@ NEDMALLOCEXTSPEC NEDMALLOCNOALIASATTR void   nedpfree2(nedpool *p, void *mem, un
 #endif
 /*! \brief Returns information about the memory pool */
 NEDMALLOCEXTSPEC struct nedmallinfo nedpmallinfo(nedpool *p) THROWSPEC;
+/*! \brief Fills in \em stats with per bin, per thread cache and per mspace statistics
+for the memory pool, returning zero on failure.
+
+Each mspace is read under its lock so its figures are consistent, but thread cache
+counters are read without stopping their threads and so may be slightly stale. This
+call is threadsafe and cheap enough to poll.
+*/
+NEDMALLOCEXTSPEC int    nedpgetstats(nedpool *p, struct nedstats *stats) THROWSPEC;
+/*! \brief Writes \em stats as a JSON object into \em buffer, returning the length
+of the JSON excluding the terminating null.
+
+Like snprintf(), at most \em len bytes including the null are written and a return
+of \em len or more means \em buffer was too small.
+*/
+NEDMALLOCEXTSPEC size_t nedstatsjson(const struct nedstats *stats, char *buffer, size_t len) THROWSPEC;
+/*! \brief Writes a JSON report of how fragmented each mspace in the memory pool is
+into \em buffer, returning its length excluding the terminating null.
+
+For each mspace this walks every chunk of every segment, giving a histogram of free
+chunk sizes by power of two, the largest free chunk, the top chunk and per segment
+utilisation. Segments which could be returned to the system if they were empty
+also list how many allocated chunks pin them and the first NEDMALLOC_FRAGREPORTPINS
+of those. Blocks held by thread caches count as allocated.
+
+Each mspace is locked only while it is walked, so this is safe to call on a live
+process but the mspaces are not captured at the same instant. Like snprintf(), at most
+\em len bytes are written, so call with a generous buffer as the heap may have grown
+since a sizing call.
+*/
+NEDMALLOCEXTSPEC size_t nedpfragreport(nedpool *p, char *buffer, size_t len) THROWSPEC;
 /*! \brief Changes the operational parameters of the memory pool */
 NEDMALLOCEXTSPEC int    nedpmallopt(nedpool *p, int parno, int value) THROWSPEC;
 /*! \brief Tries to release as much free memory back to the system as possible, leaving \em pad remaining per threadpool. */
@@ -733,9 +921,22 @@ NEDMALLOCEXTSPEC NEDMALLOCNOALIASATTR NEDMALLOCPTRATTR void **nedpindependent_co
 } /* namespace or extern "C" */
 #include <new>
 #include <memory>
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include <string.h>
 #ifdef HAVE_CPP0XTYPETRAITS
 #include <type_traits>
 #endif
+#ifdef HAVE_CPP0XVARIADICTEMPLATES
+#include <tuple>
+#endif
+#ifdef HAVE_CPP0XTHREADLOCAL
+#include <mutex>
+#endif
+#ifdef HAVE_CPP17MEMORYRESOURCE
+#include <memory_resource>
+#endif
 
 // Touch into existence for future platforms
 namespace std { namespace tr1 { } }
@@ -1062,6 +1263,45 @@ policies...
 		template<typename U> T *allocate(const size_t n, const U * /* hint */) const {
 			return allocate(n);
 		}
+		/*! \brief Allocates \em n separately freeable T's next to one another with nedpindependent_comalloc().
+
+		Fills in and returns \em chunks, or if that is zero an array allocated by nedmalloc which
+		must be freed with nedfree(). Each T must be freed with nedfree(). The memory is not
+		zeroed as the caller constructs over every element. Returns zero on failure if the
+		policy does not throw. */
+		T **allocate_batch(const size_t n, T **chunks) const {
+			const size_t t_size = sizeof(T);
+			size_t size = _this()->policy_granularity(t_size);
+			nedpool *pool = _this()->policy_nedpool(size);
+			size_t localsizes[64], *sizes = localsizes;
+			if(n > sizeof(localsizes)/sizeof(localsizes[0])) {
+				if(n > ((size_t)-1)/sizeof(size_t) || !(sizes = static_cast<size_t *>(nedpmalloc(pool, n*sizeof(size_t))))) {
+					_this()->policy_throwbadalloc(n*size);
+					return 0;
+				}
+			}
+			for(size_t i = 0; i < n; i++)
+				sizes[i] = size;
+			void **ptr = nedpindependent_comalloc(pool, n, sizes, reinterpret_cast<void **>(chunks));
+			if(sizes != localsizes)
+				nedpfree(pool, sizes);
+			if(!ptr) {
+				_this()->policy_throwbadalloc(n*size);
+				return 0;
+			}
+			// The allocation functions are marked as returning unaliased memory, so hand back
+			// chunks itself if the caller supplied it rather than the copy of it in ptr
+			if(chunks)
+				ptr = reinterpret_cast<void **>(chunks);
+			// The pointers were written as void *, so rewrite each as a T * to keep strict aliasing happy
+			T **ret = reinterpret_cast<T **>(ptr);
+			for(size_t i = 0; i < n; i++) {
+				void *p;
+				memcpy(&p, ptr + i, sizeof(p));
+				ret[i] = static_cast<T *>(p);
+			}
+			return ret;
+		}
 	private:
 		baseimplementation &operator=(const baseimplementation &);
 	};
@@ -1153,6 +1393,22 @@ namespace nedpolicy
 			}
 		};
 	};
+	/*! \class prefault
+	\ingroup C++
+	\brief A policy causing the pages of the allocated memory to be populated up front.
+	*/
+	template<bool doprefault=true> struct prefault
+	{
+		template<class Base> class policy : public Base
+		{
+			template<class implementation> friend class nedallocatorI::baseimplementation;
+		protected:
+			unsigned policy_flags(size_t bytes) const
+			{
+				return doprefault ? Base::policy_flags(bytes)|M2_PREFAULT : Base::policy_flags(bytes);
+			}
+		};
+	};
 	/*! \class reserveX
 	\ingroup C++
 	\brief A policy causing the address reservation of X times the allocated memory.
@@ -1233,6 +1489,149 @@ namespace nedpolicy
 			static const bool policy_typeIsPOD=ispod;
 		};
 	};
+#ifdef HAVE_CPP0XTHREADLOCAL
+	/*! \class nodepool
+	\ingroup C++
+	\brief A policy carving single object allocations from slabs of N objects.
+
+	Node based containers such as std::list, std::map and std::set allocate one node at a
+	time. With this policy each node comes from a slab of N nodes allocated in one go from
+	the policy's nedpool, so nodes allocated together sit together in memory, and freed nodes
+	go onto a freelist kept by each thread for the next allocation of the same type. Each
+	distinct allocator type, i.e. each node type and set of policies, has its own slabs.
+	Once a thread holds more than 2N free nodes it passes N of them to a shared list, and a
+	thread which runs out takes a batch from there before allocating a new slab. A thread's
+	free nodes are passed to the shared list when it exits. The shared list is never
+	destroyed, so threads exiting and containers destroyed during static destruction can
+	still free nodes into it.
+
+	Allocations of more than one object, such as an unordered container's bucket array, go
+	to nedmalloc as usual. Slabs are kept until the process exits, so memory used for nodes
+	is never returned to the system, but it is reused for the same node type. Of the flag
+	policies only zero applies to pooled nodes.
+	\code
+	typedef std::pair<const int, Foo> value;
+	std::map<int, Foo, std::less<int>, nedallocator<value, nedpolicy::nodepool<256>::policy> > m;
+	\endcode
+	*/
+	template<size_t N> struct nodepool
+	{
+		template<class Base> class policy : public Base
+		{
+			template<class implementation> friend class nedallocatorI::baseimplementation;
+			typedef typename Base::value_type T;
+			struct freelist
+			{
+				void *head;
+				size_t count;
+				bool dead;					// Containers destroyed after this thread's thread_locals bypass it
+				freelist() : head(0), count(0), dead(false) { }
+				~freelist() { if(head) policy::release(head); head=0; dead=true; }
+			};
+			struct sharedlist
+			{
+				std::mutex lock;
+				void *batches;				// The second pointer of each batch's first node links to the next batch
+				sharedlist() : batches(0) { }
+			};
+			static freelist &local() { static thread_local freelist l; return l; }
+			static sharedlist &shared() { static sharedlist &s=*new sharedlist; return s; }
+			static void *&next(void *node) { return *static_cast<void **>(node); }
+			static void *&nextbatch(void *node) { return static_cast<void **>(node)[1]; }
+			static size_t alignment()
+			{
+				size_t a=std::alignment_of<T>::value;
+				return a<sizeof(void *) ? sizeof(void *) : a;
+			}
+			static size_t stride()
+			{
+				size_t size=sizeof(T)<2*sizeof(void *) ? 2*sizeof(void *) : sizeof(T), a=alignment();
+				return (size+a-1) & ~(a-1);
+			}
+			static void release(void *batch)
+			{
+				sharedlist &s=shared();
+				std::lock_guard<std::mutex> g(s.lock);
+				nextbatch(batch)=s.batches;
+				s.batches=batch;
+			}
+			bool refill(freelist &l) const
+			{
+				sharedlist &s=shared();
+				{
+					std::lock_guard<std::mutex> g(s.lock);
+					if((l.head=s.batches))
+						s.batches=nextbatch(l.head);
+				}
+				if(l.head)
+				{
+					for(void *node=l.head; node; node=next(node))
+						l.count++;
+					return true;
+				}
+				const size_t bytes=N*stride();
+				size_t a=this->policy_alignment(bytes);
+				if(a<alignment()) a=alignment();
+				char *slab=static_cast<char *>(nedpmalloc2(this->policy_nedpool(bytes), bytes, a>2*sizeof(void *) ? a : 0, 0));
+				if(!slab)
+				{
+					this->policy_throwbadalloc(bytes);
+					return false;
+				}
+				for(size_t n=0; n<N-1; n++)
+					next(slab+n*stride())=slab+(n+1)*stride();
+				next(slab+(N-1)*stride())=0;
+				l.head=slab;
+				l.count=N;
+				return true;
+			}
+		public:
+			T *allocate(const size_t n) const
+			{
+				if(n!=1)
+					return Base::allocate(n);
+				freelist &l=local();
+				if(l.dead)
+					return Base::allocate(n);
+				if(!l.head && !refill(l))
+					return 0;
+				void *ret=l.head;
+				l.head=next(ret);
+				l.count--;
+				if(this->policy_flags(sizeof(T)) & M2_ZERO_MEMORY)
+					memset(ret, 0, sizeof(T));
+				return static_cast<T *>(ret);
+			}
+			void deallocate(T *p, const size_t n) const
+			{
+				if(n!=1)
+				{
+					Base::deallocate(p, n);
+					return;
+				}
+				freelist &l=local();
+				if(l.dead)
+				{
+					next(p)=0;
+					release(p);
+					return;
+				}
+				next(p)=l.head;
+				l.head=p;
+				if(++l.count>=2*N)
+				{	// Hand the oldest N nodes to the other threads
+					void *last=l.head;
+					for(size_t i=1; i<l.count-N; i++)
+						last=next(last);
+					void *batch=next(last);
+					next(last)=0;
+					l.count-=N;
+					release(batch);
+				}
+			}
+		};
+	};
+#endif
 }
 
 /*! \class nedallocator
@@ -1340,6 +1739,141 @@ public:
 	};
 };
 
+/*! \class nedpoolallocator
+\ingroup C++
+\brief A nedallocator which allocates from and frees to a nedpool chosen at runtime
+
+nedallocator takes its pool from the policy_nedpool() policy, so every instance of a
+given type uses the same pool and all compare equal. nedpoolallocator instead carries
+the pool it was constructed with, so containers of the same type can each live in a
+different pool, for example one per request which is simply destroyed afterwards:
+\code
+nedpool *pool=nedcreatepool(0, 1);
+{
+	nedpoolallocator<int> alloc(pool);
+	std::vector<int, nedpoolallocator<int> > a(alloc), b(alloc);
+	...
+}
+neddestroypool(pool);
+\endcode
+Instances compare equal only when they use the same pool. Copy assignment, move assignment
+and swap of containers carry the allocator, and so the pool, along with the contents, and
+copy constructed containers use the same pool as the original. Blocks are freed through
+nedpfree2() with the pool so they return to that pool's thread cache. The other policies
+apply as they do to nedallocator, except that policy_nedpool() is ignored.
+*/
+template<typename T,
+#ifdef HAVE_CPP0XVARIADICTEMPLATES
+	template<class> class... policies
+#else
+	template<class> class policy1=nedpolicy::empty,
+	template<class> class policy2=nedpolicy::empty,
+	template<class> class policy3=nedpolicy::empty,
+	template<class> class policy4=nedpolicy::empty,
+	template<class> class policy5=nedpolicy::empty,
+	template<class> class policy6=nedpolicy::empty,
+	template<class> class policy7=nedpolicy::empty,
+	template<class> class policy8=nedpolicy::empty,
+	template<class> class policy9=nedpolicy::empty,
+	template<class> class policy10=nedpolicy::empty,
+	template<class> class policy11=nedpolicy::empty,
+	template<class> class policy12=nedpolicy::empty,
+	template<class> class policy13=nedpolicy::empty,
+	template<class> class policy14=nedpolicy::empty,
+	template<class> class policy15=nedpolicy::empty
+#endif
+> class nedpoolallocator : public nedallocator<T,
+#ifdef HAVE_CPP0XVARIADICTEMPLATES
+	policies...
+#else
+	policy1, policy2, policy3, policy4, policy5,
+	policy6, policy7, policy8, policy9, policy10,
+	policy11, policy12, policy13, policy14, policy15
+#endif
+>
+{
+	typedef nedallocator<T,
+#ifdef HAVE_CPP0XVARIADICTEMPLATES
+		policies...
+#else
+		policy1, policy2, policy3, policy4, policy5,
+		policy6, policy7, policy8, policy9, policy10,
+		policy11, policy12, policy13, policy14, policy15
+#endif
+	> Base;
+	nedpool *pool;
+public:
+#ifdef HAVE_CPP0XTYPETRAITS
+	typedef std::true_type propagate_on_container_copy_assignment;
+	typedef std::true_type propagate_on_container_move_assignment;
+	typedef std::true_type propagate_on_container_swap;
+	typedef std::false_type is_always_equal;
+#endif
+	//! Allocates from \em _pool, or the system pool if zero
+	explicit nedpoolallocator(nedpool *_pool=0) : pool(_pool) { }
+	nedpoolallocator(const nedpoolallocator &o) : Base(o), pool(o.pool) { }
+	template<typename U> nedpoolallocator(const nedpoolallocator<U,
+#ifdef HAVE_CPP0XVARIADICTEMPLATES
+		policies...
+#else
+		policy1, policy2, policy3, policy4, policy5,
+		policy6, policy7, policy8, policy9, policy10,
+		policy11, policy12, policy13, policy14, policy15
+#endif
+	> &o) : pool(o.get_pool()) { }
+	nedpoolallocator &operator=(const nedpoolallocator &o) { pool=o.pool; return *this; }
+	//! Returns the pool allocated from, which is zero for the system pool
+	nedpool *get_pool() const { return pool; }
+	//! Allocators of any type compare equal when they use the same pool, as either can free the other's blocks
+	template<typename U> bool operator==(const nedpoolallocator<U,
+#ifdef HAVE_CPP0XVARIADICTEMPLATES
+		policies...
+#else
+		policy1, policy2, policy3, policy4, policy5,
+		policy6, policy7, policy8, policy9, policy10,
+		policy11, policy12, policy13, policy14, policy15
+#endif
+	> &o) const { return pool==o.get_pool(); }
+	template<typename U> bool operator!=(const nedpoolallocator<U,
+#ifdef HAVE_CPP0XVARIADICTEMPLATES
+		policies...
+#else
+		policy1, policy2, policy3, policy4, policy5,
+		policy6, policy7, policy8, policy9, policy10,
+		policy11, policy12, policy13, policy14, policy15
+#endif
+	> &o) const { return pool!=o.get_pool(); }
+
+	T *allocate(const size_t n) const {
+		const size_t t_size = sizeof(T);
+		size_t size = this->policy_granularity(n*t_size);
+		size_t alignment = this->policy_alignment(size);
+		unsigned flags = this->policy_flags(size);
+		void *ptr = nedpmalloc2(pool, size, alignment, flags);
+		if(!ptr)
+			this->policy_throwbadalloc(size);
+		return static_cast<T *>(ptr);
+	}
+	void deallocate(T *p, const size_t n) const {
+		nedpfree2(pool, p, 0);
+	}
+	template<typename U> T *allocate(const size_t n, const U * /* hint */) const {
+		return allocate(n);
+	}
+
+	template<typename U> struct rebind {
+		typedef nedpoolallocator<U,
+#ifdef HAVE_CPP0XVARIADICTEMPLATES
+			policies...
+#else
+			policy1, policy2, policy3, policy4, policy5,
+			policy6, policy7, policy8, policy9, policy10,
+			policy11, policy12, policy13, policy14, policy15
+#endif
+		> other;
+	};
+};
+
 namespace nedallocatorI {
 	// Holds a static allocator instance shared by anything allocating from allocator
 	template<class allocator> struct StaticAllocator
@@ -1473,6 +2007,137 @@ template<class allocator, typename T> inline void Delete(const T *_obj)
 }
 template<typename T> inline void Delete(const T *obj) { Delete<nedallocator<T> >(obj); }
 
+/*! \brief Allocates the memory for \em n instances of object \em T next to one another and constructs them.
+
+The memory comes from a single nedpindependent_comalloc() in the allocator's pool, so all
+\em n objects cost one trip into the pool rather than \em n, and they sit together in
+memory in order. Each object can still be destroyed and freed on its own by Delete() or
+all at once by DeleteArray(). Pointers to the objects are written into \em objs, which
+must have room for \em n of them, or if \em objs is zero into an array allocated by
+nedmalloc which you must nedfree() afterwards. If a constructor throws, the objects
+already constructed are destroyed and everything is freed before rethrowing.
+\code
+	Node **nodes=NewArray<Node>(count, 0, parent);
+	...
+	DeleteArray(nodes, count);
+	nedfree(nodes);
+\endcode
+The blocks are aligned as nedmalloc() would align them, so over-aligned types can't be used.
+*/
+#ifdef HAVE_CPP0XVARIADICTEMPLATES
+template<typename T, class allocator=nedallocator<T>, typename... Parameters> inline T **NewArray(size_t n, T **objs, const Parameters&... parameters)
+#else
+template<typename T, class allocator> inline T **NewArray(size_t n, T **objs)
+#endif
+{
+#ifdef HAVE_CPP0XTYPETRAITS
+	NEDSTATIC_ASSERT(std::alignment_of<T>::value<=2*sizeof(void *), Type_is_too_aligned_for_NewArray);
+#endif
+	allocator &a=nedallocatorI::StaticAllocator<allocator>::get();
+	T **ret=a.allocate_batch(n, objs);
+	size_t done=0;
+	if(!ret) return 0;
+	try
+	{
+		for(; done<n; done++)
+#ifdef HAVE_CPP0XVARIADICTEMPLATES
+			new((void *) ret[done]) T(parameters...);
+#else
+			new((void *) ret[done]) T;
+#endif
+	}
+	catch(...)
+	{
+		for(size_t i=0; i<n; i++)
+		{
+			if(i<done) ret[i]->~T();
+			nedfree(ret[i]);
+		}
+		if(!objs) nedfree(ret);
+		throw;
+	}
+	return ret;
+}
+#ifndef HAVE_CPP0XVARIADICTEMPLATES
+template<typename T> inline T **NewArray(size_t n, T **objs)
+{
+	return NewArray<T, nedallocator<T> >(n, objs);
+}
+#endif
+
+/*! \brief Destructs and frees the \em n instances of object T in \em objs, skipping any which are zero.
+
+The array \em objs itself is not freed.
+*/
+template<typename T> inline void DeleteArray(T *const *objs, size_t n)
+{
+	for(size_t i=0; i<n; i++)
+	{
+		if(objs[i])
+		{
+			objs[i]->~T();
+			nedfree(objs[i]);
+		}
+	}
+}
+
+#if defined(HAVE_CPP0XVARIADICTEMPLATES) && defined(HAVE_CPP0XRVALUEREFS)
+namespace nedallocatorI {
+	// Constructs each value into its chunk in turn, destroying those already constructed if one throws
+	template<size_t idx, class Tuple> inline void BatchConstruct(void **, Tuple &) { }
+	template<size_t idx, class Tuple, typename A, typename... Rest> inline void BatchConstruct(void **chunks, Tuple &ret, A &&a, Rest&&... rest)
+	{
+		typedef typename std::decay<A>::type type;
+		NEDSTATIC_ASSERT(std::alignment_of<type>::value<=2*sizeof(void *), Type_is_too_aligned_for_NewBatch);
+		type *obj=new(chunks[idx]) type(std::forward<A>(a));
+		try
+		{
+			BatchConstruct<idx+1>(chunks, ret, std::forward<Rest>(rest)...);
+		}
+		catch(...)
+		{
+			obj->~type();
+			throw;
+		}
+		std::get<idx>(ret)=obj;
+	}
+}
+/*! \brief Allocates one object of each type from \em pool next to one another, constructing each from the matching value.
+
+This is nedpindependent_comalloc() for objects of differing types which are always created
+together, such as a graph node and its edge list or an AST node and its operands. One trip
+into the pool allocates the lot and they sit together in memory in the order given. Each
+object is copy or move constructed from its value and can be destroyed and freed on its own
+with Delete(). Throws std::bad_alloc if the memory can't be allocated, and if a constructor
+throws then the objects already constructed are destroyed and everything is freed first.
+\code
+	Node *node;
+	Edges *edges;
+	std::tie(node, edges)=NewBatch(pool, Node(id), Edges());
+\endcode
+The blocks are aligned as nedmalloc() would align them, so over-aligned types can't be used.
+*/
+template<typename... Types> inline std::tuple<typename std::decay<Types>::type *...> NewBatch(nedpool *pool, Types&&... values)
+{
+	size_t sizes[sizeof...(Types)+1]={ sizeof(typename std::decay<Types>::type)... };
+	void *chunks[sizeof...(Types)+1];
+	std::tuple<typename std::decay<Types>::type *...> ret;
+	if(!nedpindependent_comalloc(pool, sizeof...(Types), sizes, chunks))
+		throw std::bad_alloc();
+	try
+	{
+		nedallocatorI::BatchConstruct<0>(chunks, ret, std::forward<Types>(values)...);
+	}
+	catch(...)
+	{
+		for(size_t n=0; n<sizeof...(Types); n++)
+			nedpfree(pool, chunks[n]);
+		throw;
+	}
+	return ret;
+}
+#endif
+
 /*! \class nedallocatorise
 \ingroup C++
 \brief Reimplements a given STL container to make full and efficient usage of nedalloc
@@ -1547,6 +2212,392 @@ public:
 		> > value;
 };
 
+/*! \class nedvector
+\ingroup C++
+\brief A std::vector workalike which grows relocatable types with nedprealloc2()
+
+std::vector only ever sees allocate() and deallocate(), so however an allocator is
+configured each growth allocates new storage, copies or moves every element across and
+frees the old storage. When the type is treated as Plain Old Data, either by default on
+C++0x compilers for trivially copyable types or through the nedpolicy::typeIsPOD policy,
+nedvector instead grows its storage with nedprealloc2(). That extends in place wherever
+possible, and with address space reservation large vectors are extended by the kernel
+remapping pages rather than by copying. If the policies ask for no M2_RESERVE_* flag,
+M2_RESERVE_MULT(8) is used just as nedrealloc() does. Any slack nedmalloc rounds a block
+up by is used as capacity, so nedvector overallocates by less than std::vector.
+
+Types not treated as POD are grown as std::vector would grow them.
+\code
+nedvector<unsigned int> a;      // Grown using nedprealloc2()
+nedvector<std::string> b;       // Grown by moving its elements
+nedvector<Foo, nedpolicy::typeIsPOD<true>::policy, nedpolicy::reserveN<26>::policy> c;
+\endcode
+Most of the std::vector interface is provided. insert() only takes a range and,
+as with std::vector, the range may not come from the vector itself.
+*/
+template<typename T,
+#ifdef HAVE_CPP0XVARIADICTEMPLATES
+	template<class> class... policies
+#else
+	template<class> class policy1=nedpolicy::empty,
+	template<class> class policy2=nedpolicy::empty,
+	template<class> class policy3=nedpolicy::empty,
+	template<class> class policy4=nedpolicy::empty,
+	template<class> class policy5=nedpolicy::empty,
+	template<class> class policy6=nedpolicy::empty,
+	template<class> class policy7=nedpolicy::empty,
+	template<class> class policy8=nedpolicy::empty,
+	template<class> class policy9=nedpolicy::empty,
+	template<class> class policy10=nedpolicy::empty,
+	template<class> class policy11=nedpolicy::empty,
+	template<class> class policy12=nedpolicy::empty,
+	template<class> class policy13=nedpolicy::empty,
+	template<class> class policy14=nedpolicy::empty,
+	template<class> class policy15=nedpolicy::empty
+#endif
+> class nedvector : private nedallocator<T,
+#ifdef HAVE_CPP0XVARIADICTEMPLATES
+	policies...
+#else
+	policy1, policy2, policy3, policy4, policy5,
+	policy6, policy7, policy8, policy9, policy10,
+	policy11, policy12, policy13, policy14, policy15
+#endif
+>
+{
+public:
+	typedef nedallocator<T,
+#ifdef HAVE_CPP0XVARIADICTEMPLATES
+		policies...
+#else
+		policy1, policy2, policy3, policy4, policy5,
+		policy6, policy7, policy8, policy9, policy10,
+		policy11, policy12, policy13, policy14, policy15
+#endif
+	> allocator_type;
+	typedef T value_type;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+	typedef T &reference;
+	typedef const T &const_reference;
+	typedef T *pointer;
+	typedef const T *const_pointer;
+	typedef T *iterator;
+	typedef const T *const_iterator;
+	typedef std::reverse_iterator<iterator> reverse_iterator;
+	typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+private:
+	typedef allocator_type Base;
+	static const bool relocatable=Base::policy_typeIsPOD;
+	T *_begin, *_end, *_capacity;
+
+	// The capacity to grow to when \em n elements are needed
+	size_type growth(size_type n) const
+	{
+		size_type c=capacity();
+		c+=c/2;
+		return c<n ? n : c;
+	}
+	// How many elements a range holds, if that can be known without consuming it
+	template<class Iterator> static size_type rangelength(Iterator first, Iterator last, std::forward_iterator_tag) { return std::distance(first, last); }
+	template<class Iterator> static size_type rangelength(Iterator, Iterator, std::input_iterator_tag) { return 0; }
+	// Resizes the storage to hold at least n>=size() elements, returning false if
+	// that failed under a policy which doesn't throw
+	bool reallocate(size_type n)
+	{
+		const size_type count=size();
+		T *mem;
+		if(!n)
+		{
+			if(_begin) Base::deallocate(_begin, capacity());
+			_begin=_end=_capacity=0;
+			return true;
+		}
+		if(relocatable)
+		{
+			size_t bytes=this->policy_granularity(n*sizeof(T));
+			unsigned flags=this->policy_flags(bytes);
+			if(!(flags & M2_RESERVE_MASK))
+				flags|=M2_RESERVE_MULT(8);
+			if(!(mem=static_cast<T *>(nedprealloc2(this->policy_nedpool(bytes), _begin, bytes, this->policy_alignment(bytes), flags))))
+			{
+				this->policy_throwbadalloc(bytes);
+				return false;
+			}
+		}
+		else
+		{
+			size_type done=0;
+			if(!(mem=Base::allocate(n)))
+				return false;
+			try
+			{
+				for(; done<count; done++)
+#ifdef HAVE_CPP0XRVALUEREFS
+					new(mem+done) T(std::move(_begin[done]));
+#else
+					new(mem+done) T(_begin[done]);
+#endif
+			}
+			catch(...)
+			{
+				while(done)
+					mem[--done].~T();
+				Base::deallocate(mem, n);
+				throw;
+			}
+			for(done=0; done<count; done++)
+				_begin[done].~T();
+			if(_begin) Base::deallocate(_begin, capacity());
+		}
+		_begin=mem;
+		_end=mem+count;
+		{
+			int isforeign;
+			size_type usable=nedblksize(&isforeign, mem)/sizeof(T);
+			_capacity=mem+(usable>n ? usable : n);
+		}
+		return true;
+	}
+public:
+	nedvector() : _begin(0), _end(0), _capacity(0) { }
+	explicit nedvector(size_type n, const T &v=T()) : _begin(0), _end(0), _capacity(0) { resize(n, v); }
+	nedvector(const nedvector &o) : Base(o), _begin(0), _end(0), _capacity(0) { insert(_end, o.begin(), o.end()); }
+#ifdef HAVE_CPP0XRVALUEREFS
+	nedvector(nedvector &&o) : _begin(o._begin), _end(o._end), _capacity(o._capacity) { o._begin=o._end=o._capacity=0; }
+	nedvector &operator=(nedvector &&o) { swap(o); return *this; }
+#endif
+	~nedvector() { clear(); reallocate(0); }
+	nedvector &operator=(const nedvector &o)
+	{
+		if(this!=&o)
+		{
+			clear();
+			insert(_end, o.begin(), o.end());
+		}
+		return *this;
+	}
+	void swap(nedvector &o)
+	{
+		T *t;
+		t=_begin; _begin=o._begin; o._begin=t;
+		t=_end; _end=o._end; o._end=t;
+		t=_capacity; _capacity=o._capacity; o._capacity=t;
+	}
+	allocator_type get_allocator() const { return *this; }
+
+	iterator begin() { return _begin; }
+	const_iterator begin() const { return _begin; }
+	iterator end() { return _end; }
+	const_iterator end() const { return _end; }
+	reverse_iterator rbegin() { return reverse_iterator(_end); }
+	const_reverse_iterator rbegin() const { return const_reverse_iterator(_end); }
+	reverse_iterator rend() { return reverse_iterator(_begin); }
+	const_reverse_iterator rend() const { return const_reverse_iterator(_begin); }
+
+	size_type size() const { return _end-_begin; }
+	size_type capacity() const { return _capacity-_begin; }
+	size_type max_size() const { return Base::max_size(); }
+	bool empty() const { return _begin==_end; }
+	void reserve(size_type n) { if(n>capacity()) reallocate(n); }
+	//! Releases unused capacity, which for relocatable types is done in place
+	void shrink_to_fit() { if(_end<_capacity) reallocate(size()); }
+	void resize(size_type n, const T &v=T())
+	{
+		if(n<size())
+		{
+			while(_end>_begin+n)
+				(--_end)->~T();
+		}
+		else
+		{
+			if(n>capacity() && !reallocate(n))
+				return;
+			for(; _end<_begin+n; _end++)
+				new(_end) T(v);
+		}
+	}
+	void clear() { while(_end>_begin) (--_end)->~T(); }
+
+	reference operator[](size_type n) { return _begin[n]; }
+	const_reference operator[](size_type n) const { return _begin[n]; }
+	reference at(size_type n) { if(n>=size()) throw std::out_of_range("nedvector::at"); return _begin[n]; }
+	const_reference at(size_type n) const { if(n>=size()) throw std::out_of_range("nedvector::at"); return _begin[n]; }
+	reference front() { return *_begin; }
+	const_reference front() const { return *_begin; }
+	reference back() { return _end[-1]; }
+	const_reference back() const { return _end[-1]; }
+	T *data() { return _begin; }
+	const T *data() const { return _begin; }
+
+	void push_back(const T &v)
+	{
+		if(_end==_capacity)
+		{
+			if(&v>=_begin && &v<_end)
+			{	// v lives in the storage about to be released, so copy it out first
+				T temp(v);
+				if(!reallocate(growth(size()+1)))
+					return;
+#ifdef HAVE_CPP0XRVALUEREFS
+				new(_end) T(std::move(temp));
+#else
+				new(_end) T(temp);
+#endif
+				++_end;
+				return;
+			}
+			if(!reallocate(growth(size()+1)))
+				return;
+		}
+		new(_end) T(v);
+		++_end;
+	}
+#ifdef HAVE_CPP0XRVALUEREFS
+	void push_back(T &&v)
+	{
+		if(_end==_capacity)
+		{
+			if(&v>=_begin && &v<_end)
+			{
+				T temp(std::move(v));
+				if(!reallocate(growth(size()+1)))
+					return;
+				new(_end) T(std::move(temp));
+				++_end;
+				return;
+			}
+			if(!reallocate(growth(size()+1)))
+				return;
+		}
+		new(_end) T(std::move(v));
+		++_end;
+	}
+#ifdef HAVE_CPP0XVARIADICTEMPLATES
+	template<typename... Args> void emplace_back(Args&&... args)
+	{
+		if(_end==_capacity)
+		{	// Any of args may refer into the storage about to be released, so construct first
+			T temp(std::forward<Args>(args)...);
+			if(!reallocate(growth(size()+1)))
+				return;
+			new(_end) T(std::move(temp));
+			++_end;
+			return;
+		}
+		new(_end) T(std::forward<Args>(args)...);
+		++_end;
+	}
+#endif
+#endif
+	//! Removes the last element. Capacity is only given back by shrink_to_fit().
+	void pop_back() { (--_end)->~T(); }
+	//! Inserts the range [first, last) before pos, which must not be a range of this vector
+	template<class InputIterator> iterator insert(iterator pos, InputIterator first, InputIterator last)
+	{
+		size_type idx=pos-_begin, oldsize=size(), n=rangelength(first, last, typename std::iterator_traits<InputIterator>::iterator_category());
+		if(oldsize+n>capacity() && !reallocate(growth(oldsize+n)))
+			return _begin+idx;
+		for(; first!=last; ++first)
+		{
+			if(_end==_capacity && !reallocate(growth(size()+1)))
+				break;
+			new(_end) T(*first);
+			++_end;
+		}
+		std::rotate(_begin+idx, _begin+oldsize, _end);
+		return _begin+idx;
+	}
+	iterator erase(iterator first, iterator last)
+	{
+		if(first!=last)
+		{
+#ifdef HAVE_CPP0XRVALUEREFS
+			iterator newend=std::move(last, _end, first);
+#else
+			iterator newend=std::copy(last, _end, first);
+#endif
+			while(_end>newend)
+				(--_end)->~T();
+		}
+		return first;
+	}
+	iterator erase(iterator pos) { return erase(pos, pos+1); }
+};
+
+#ifdef HAVE_CPP17MEMORYRESOURCE
+/*! \class pool_resource
+\ingroup C++
+\brief A std::pmr::memory_resource which allocates from a nedpool
+
+This lets the C++17 polymorphic allocator containers share a nedpool, and with it
+nedalloc's thread caches, without baking the pool into their type as nedallocator
+must:
+\code
+nedalloc::pool_resource res(pool);
+std::pmr::vector<int> a(&res);
+std::pmr::map<int, std::pmr::string> b(&res);
+\endcode
+Alignments up to the pool's natural alignment cost nothing extra. The pool is not
+owned and must outlive the resource. Two resources compare equal when they allocate
+from the same pool, as either can then free the other's blocks.
+*/
+class pool_resource : public std::pmr::memory_resource
+{
+	nedpool *pool;
+public:
+	//! Allocates from \em _pool, or the system pool if zero
+	explicit pool_resource(nedpool *_pool=0) noexcept : pool(_pool) { }
+	//! Returns the pool allocated from, which is zero for the system pool
+	nedpool *get_pool() const noexcept { return pool; }
+protected:
+	virtual void *do_allocate(size_t bytes, size_t alignment) override
+	{
+		void *ret=nedpmalloc2(pool, bytes, alignment, 0);
+		if(!ret) throw std::bad_alloc();
+		return ret;
+	}
+	virtual void do_deallocate(void *p, size_t, size_t) override
+	{
+		nedpfree2(pool, p, 0);
+	}
+	virtual bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+	{
+		const pool_resource *o=dynamic_cast<const pool_resource *>(&other);
+		return o && o->pool==pool;
+	}
+};
+
+namespace nedallocatorI
+{
+	// Constructs the upstream before the std::pmr::monotonic_buffer_resource which uses it
+	struct monotonic_pool_resource_upstream
+	{
+		pool_resource upstream;
+		explicit monotonic_pool_resource_upstream(nedpool *pool) noexcept : upstream(pool) { }
+	};
+}
+
+/*! \class monotonic_pool_resource
+\ingroup C++
+\brief A std::pmr::monotonic_buffer_resource whose chunks come from a nedpool
+
+Individual deallocations are ignored and everything is returned to the pool at once by
+release() or destruction, so this suits building up short lived structures quickly.
+Each chunk is a single nedpmalloc2() so large chunks come straight from mmap() and go
+straight back to the system when released.
+*/
+class monotonic_pool_resource : private nedallocatorI::monotonic_pool_resource_upstream, public std::pmr::monotonic_buffer_resource
+{
+public:
+	//! Allocates chunks of at least \em initial_size bytes, doubling each time, from \em pool, or the system pool if zero
+	explicit monotonic_pool_resource(nedpool *pool=0, size_t initial_size=4096)
+		: nedallocatorI::monotonic_pool_resource_upstream(pool), std::pmr::monotonic_buffer_resource(initial_size, &upstream) { }
+	//! Returns the pool chunks are allocated from, which is zero for the system pool
+	nedpool *get_pool() const noexcept { return upstream.get_pool(); }
+};
+#endif
+
 } /* namespace */
 #endif
 
@@ -1607,9 +2658,76 @@ so you probably don't need to override this
 */
 #define NEDMALLOC_TESTLOGENTRY(tc, np, type, mspace, size, mem, alignment, flags, returned) ((type)&ENABLE_LOGGING)
 
+/*! \def NEDMALLOC_LOGRINGSIZE
+\brief The number of records in each thread's log ring. Must be a power of two.
+
+Operations logged while a ring is full are dropped rather than waiting for the
+background writer, and the decoder reports how many were lost, unless
+NEDMALLOC_LOGLOSSLESS is set.
+*/
+#define NEDMALLOC_LOGRINGSIZE 16384
+
+/*! \def NEDMALLOC_LOGLOSSLESS
+\brief Has a thread whose log ring is full drain the rings itself rather than drop records.
+
+Set this when recording a trace for nedreplay, which replays the malloc, realloc and free
+operations of ENABLE_LOGGING=7 against nedmalloc, the system allocator or dlmalloc and
+reports throughput, latency percentiles and peak RSS.
+*/
+#define NEDMALLOC_LOGLOSSLESS 0
+
+/*! \def NEDMALLOC_HEAPPROFILE
+\brief Turns on the sampling heap profiler read by nedheapprofile_dump().
+
+One allocation is sampled per this many bytes on average, with the gaps between samples
+exponentially distributed. Each sample captures a raw stack backtrace of up to
+NEDMALLOC_HEAPPROFILEDEPTH return addresses and stays in a side table until freed.
+Something around 512Kb keeps the overhead well under one percent.
+*/
+#define NEDMALLOC_HEAPPROFILE 0
+
+/*! \def NEDMALLOC_STATSEXPORT
+\brief Publishes pool statistics to a POSIX shared memory segment every this many milliseconds.
+
+A background thread started with the system pool folds the counters each thread keeps
+in its own thread cache into per pool totals along with each mspace's footprint and
+counters, and writes them into the segment named by NEDMALLOC_STATSEXPORTNAME as a
+struct nedstatsexport. It never walks the heap, so bytes in use are left to explicit
+nedpgetstats() queries. The allocation paths themselves do no extra work. Run <tt>nedtop pid</tt> to watch them live.
+Needs POSIX, and -lrt for shm_open() on older glibc.
+*/
+#define NEDMALLOC_STATSEXPORT 0
+
+/*! \def NEDMALLOC_STATSEXPORTNAME
+\brief The name of the shared memory segment used by NEDMALLOC_STATSEXPORT, formatted with the process id.
+*/
+#define NEDMALLOC_STATSEXPORTNAME "/nedmalloc.%u"
+
+/*! \def NEDMALLOC_USDT
+\brief Compiles in USDT (SystemTap/DTrace style) static probes under the provider \c nedmalloc.
+
+Needs <sys/sdt.h>. A probe not being traced costs a single nop, so these can be left on in
+production builds. The probes and their arguments are:
+- \c tcache_hit(pool, size, mem) and \c tcache_miss(pool, size) on every malloc through a thread cache.
+- \c mspace_contended(pool, index) when the thread's preferred mspace was locked by someone else.
+- \c mspace_blocked(pool, index) when every mspace was locked and the thread had to wait on one,
+followed by \c mspace_acquired(pool, index) once it got it, so the two bracket the wait.
+- \c mspace_create(pool, index, mstate) when a new mspace is added to a pool.
+- \c segment_alloc(mstate, base, size) and \c segment_release(mstate, base, size) when an mspace
+obtains or returns a segment of memory from or to the system.
+- \c sys_trim(mstate, released) when an mspace trims its top segment.
+- \c tcache_flush(pool, threadid, age, bytes) when a thread cache evicts old blocks.
+
+For example, <tt>bpftrace -e 'usdt:./app:nedmalloc:mspace_blocked { @[ustack] = count(); }'</tt>
+shows where threads queue for an mspace.
+*/
+#define NEDMALLOC_USDT 0
+
 /*! \def NEDMALLOC_STACKBACKTRACEDEPTH
 \brief Turns on stack backtracing in the logger.
 
+Only return addresses are recorded, so use a symboliser such as addr2line on the output.
+
 You almost certainly want to constrain what gets logged using NEDMALLOC_TESTLOGENTRY
 if you turn this on as the sheer volume of data output can make execution very slow.
 */
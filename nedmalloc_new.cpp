@@ -0,0 +1,102 @@
+/* nedmalloc_new.cpp
+Replaces the global C++ operators new and delete with nedmalloc
+
+Compile this file into your program (or the ELF shared object which everything else
+links against) exactly once and every new and delete in the process, including those
+inside the STL, goes to nedmalloc's system pool and its thread caches. It is not
+built into the nedmalloc library itself as that would replace operator new in every
+program which links nedmalloc whether it wanted it or not.
+
+Every standard form is covered: single and array, throwing and nothrow, and where the
+compiler supports them the C++14 sized and the C++17 std::align_val_t overloads.
+Over-aligned types are allocated by nedpmalloc2() with the alignment, so alignments no
+larger than the pool's natural alignment still come from the thread cache. nedmalloc
+finds a block's size from its own headers, so sized delete costs nothing extra but gains
+nothing either.
+*/
+
+#include "nedmalloc.h"
+#include <new>
+
+#if __cplusplus > 199711L || (defined(_MSC_VER) && _MSC_VER>=1900)
+#define NEDNEWTHROWSPEC
+#else
+#define NEDNEWTHROWSPEC throw(std::bad_alloc)
+#endif
+#if defined(__cpp_sized_deallocation) || (defined(_MSC_VER) && _MSC_VER>=1900)
+#define NEDNEWSIZED 1
+#endif
+#if defined(__cpp_aligned_new)
+#define NEDNEWALIGNED 1
+#endif
+#ifndef NO_NED_NAMESPACE
+using namespace nedalloc;
+#endif
+
+namespace {
+	/* Calls the new handler until it either allocates or there is no handler left */
+	inline void *nednew(size_t size, size_t alignment)
+	{
+		void *ret;
+		if(!size) size=1;
+		while(!(ret=nedpmalloc2(0, size, alignment, 0)))
+		{
+#if __cplusplus > 199711L || (defined(_MSC_VER) && _MSC_VER>=1900)
+			std::new_handler handler=std::get_new_handler();
+#else
+			std::new_handler handler=std::set_new_handler(0);
+			std::set_new_handler(handler);
+#endif
+			if(!handler) throw std::bad_alloc();
+			handler();
+		}
+		return ret;
+	}
+	inline void *nednew(size_t size, size_t alignment, const std::nothrow_t &) THROWSPEC
+	{
+		try
+		{
+			return nednew(size, alignment);
+		}
+		catch(...)
+		{
+			return 0;
+		}
+	}
+	inline void neddelete(void *mem) THROWSPEC
+	{
+		if(mem) nedpfree2(0, mem, 0);
+	}
+}
+
+void *operator new(size_t size) NEDNEWTHROWSPEC { return nednew(size, 0); }
+void *operator new[](size_t size) NEDNEWTHROWSPEC { return nednew(size, 0); }
+void *operator new(size_t size, const std::nothrow_t &nt) THROWSPEC { return nednew(size, 0, nt); }
+void *operator new[](size_t size, const std::nothrow_t &nt) THROWSPEC { return nednew(size, 0, nt); }
+void operator delete(void *mem) THROWSPEC { neddelete(mem); }
+void operator delete[](void *mem) THROWSPEC { neddelete(mem); }
+void operator delete(void *mem, const std::nothrow_t &) THROWSPEC { neddelete(mem); }
+void operator delete[](void *mem, const std::nothrow_t &) THROWSPEC { neddelete(mem); }
+#ifdef NEDNEWSIZED
+void operator delete(void *mem, size_t) THROWSPEC { neddelete(mem); }
+void operator delete[](void *mem, size_t) THROWSPEC { neddelete(mem); }
+#endif
+
+#ifdef NEDNEWALIGNED
+void *operator new(size_t size, std::align_val_t alignment) { return nednew(size, (size_t) alignment); }
+void *operator new[](size_t size, std::align_val_t alignment) { return nednew(size, (size_t) alignment); }
+void *operator new(size_t size, std::align_val_t alignment, const std::nothrow_t &nt) THROWSPEC { return nednew(size, (size_t) alignment, nt); }
+void *operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t &nt) THROWSPEC { return nednew(size, (size_t) alignment, nt); }
+void operator delete(void *mem, std::align_val_t) THROWSPEC { neddelete(mem); }
+void operator delete[](void *mem, std::align_val_t) THROWSPEC { neddelete(mem); }
+void operator delete(void *mem, std::align_val_t, const std::nothrow_t &) THROWSPEC { neddelete(mem); }
+void operator delete[](void *mem, std::align_val_t, const std::nothrow_t &) THROWSPEC { neddelete(mem); }
+#ifdef NEDNEWSIZED
+void operator delete(void *mem, size_t, std::align_val_t) THROWSPEC { neddelete(mem); }
+void operator delete[](void *mem, size_t, std::align_val_t) THROWSPEC { neddelete(mem); }
+#endif
+#endif
+
+#undef NEDNEWTHROWSPEC
+#undef NEDNEWSIZED
+#undef NEDNEWALIGNED
@@ -0,0 +1,433 @@
+/* nedmembench.cpp
+Measures how much memory an allocator costs over a phased workload rather than how fast
+it is. Each thread runs the phases together with the others:
+
+rampup      Allocate blocks until the threads hold the target number of bytes between them.
+churn       Repeatedly free a random block and allocate another of random size.
+massfree    Free all but one in every MASSFREE_KEEP blocks, as a cache being dropped would.
+regrowth    Allocate back up to the target with larger blocks than before, which can't
+            all reuse the holes the survivors of massfree pin.
+freeall     Free everything, to see what the allocator holds on to.
+
+Bytes requested and not yet freed, RSS and, where the allocator can say, its footprint are
+sampled throughout. At the end of each phase RSS growth over the start of the run is
+compared with the live bytes to give the overhead ratio, and after massfree how much of
+the freed memory went back to the system is reported. The samples can be written out as
+CSV to plot.
+*/
+
+#define FORCEINLINE
+#define NOINLINE
+
+#include "nedmalloc.c"
+#include <vector>
+#ifdef WIN32
+#include <psapi.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#define TARGET (256*1024*1024)		/* Live bytes after rampup, shared between threads */
+#define MINSIZE 16
+#define MAXSIZE 4096				/* Sizes are log uniform between these ... */
+#define LARGESIZE 65536				/* ... with one in 64 being up to this */
+#define CHURN 4						/* Churn replaces this many times as many blocks as rampup allocated */
+#define MASSFREE_KEEP 16
+
+#ifdef WIN32
+typedef unsigned __int64 usCount;
+static usCount GetUsCount()
+{
+	static LARGE_INTEGER ticksPerSec;
+	static double scalefactor;
+	LARGE_INTEGER val;
+	if(!scalefactor)
+	{
+		if(QueryPerformanceFrequency(&ticksPerSec))
+			scalefactor=ticksPerSec.QuadPart/1000000000000.0;
+		else
+			scalefactor=1;
+	}
+	if(!QueryPerformanceCounter(&val))
+		return (usCount) GetTickCount() * 1000000000;
+	return (usCount) (val.QuadPart/scalefactor);
+}
+static DWORD WINAPI _threadcode(LPVOID a);
+#define THREADVAR HANDLE
+#define THREADINIT(v, t) (*v=CreateThread(NULL, 0, _threadcode, (LPVOID)(t), 0, NULL))
+#define THREADSLEEP(v) SleepEx(v, FALSE)
+#define THREADYIELD() SleepEx(0, FALSE)
+#define THREADWAIT(v) (WaitForSingleObject(v, INFINITE), CloseHandle(v))
+/* MSVC gives volatile accesses acquire and release semantics */
+#define MEMBENCH_LOAD(p)		(*(p))
+#define MEMBENCH_STORE(p, v)	(*(p)=(v))
+#define MEMBENCH_ADD(p, v)		(InterlockedExchangeAdd((volatile LONG *)(p), (LONG)(v))+(LONG)(v))
+#else
+#include <sys/time.h>
+
+typedef unsigned long long usCount;
+static usCount GetUsCount()
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((usCount) ts.tv_sec*1000000000000LL)+ts.tv_nsec*1000LL;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return ((usCount) tv.tv_sec*1000000000000LL)+tv.tv_usec*1000000LL;
+#endif
+}
+static void *_threadcode(void *a);
+#define THREADVAR pthread_t
+#define THREADINIT(v, t) pthread_create(v, NULL, _threadcode, (void *)(t))
+#define THREADSLEEP(v) usleep(v*1000)
+#define THREADYIELD() sched_yield()
+#define THREADWAIT(v) pthread_join(v, NULL)
+#define MEMBENCH_LOAD(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define MEMBENCH_STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define MEMBENCH_ADD(p, v)		__atomic_add_fetch((p), (v), __ATOMIC_ACQ_REL)
+#endif
+
+static size_t CurrentRSS()
+{
+#ifdef WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	return GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)) ? pmc.WorkingSetSize : 0;
+#elif defined(__linux__)
+	unsigned long pages=0, resident=0;
+	FILE *ih=fopen("/proc/self/statm", "r");
+	if(!ih) return 0;
+	if(2!=fscanf(ih, "%lu %lu", &pages, &resident)) resident=0;
+	fclose(ih);
+	return (size_t) resident*sysconf(_SC_PAGESIZE);
+#else
+	return 0;
+#endif
+}
+
+static void *nedmalloc_wrapper(size_t size)
+{
+	return nedalloc::nedpmalloc(0, size);
+}
+static void nedfree_wrapper(void *mem)
+{
+	nedalloc::nedpfree(0, mem);
+}
+static size_t nedfootprint_wrapper()
+{
+	return nedalloc::nedpmalloc_footprint(0);
+}
+static void *sysmalloc_wrapper(size_t size)
+{
+	return malloc(size);
+}
+static void sysfree_wrapper(void *mem)
+{
+	free(mem);
+}
+static mspace mymspace = create_mspace(0,1);
+static void *dlmalloc_wrapper(size_t size)
+{
+	return mspace_malloc(mymspace, size);
+}
+static void dlfree_wrapper(void *mem)
+{
+	mspace_free(mymspace, mem);
+}
+static size_t dlfootprint_wrapper()
+{
+	return mspace_footprint(mymspace);
+}
+
+struct Allocator
+{
+	const char *name, *shortname;
+	void *(*malloc)(size_t size);
+	void (*free)(void *mem);
+	size_t (*footprint)();			/* Zero if the allocator can't say */
+};
+static Allocator allocators[]={
+	{ "nedmalloc", "nedmalloc", &nedmalloc_wrapper, &nedfree_wrapper, &nedfootprint_wrapper },
+	{ "System allocator", "sysalloc", &sysmalloc_wrapper, &sysfree_wrapper, 0 },
+	{ "dlmalloc", "dlmalloc", &dlmalloc_wrapper, &dlfree_wrapper, &dlfootprint_wrapper }
+};
+
+enum Phase
+{
+	PHASE_RAMPUP,
+	PHASE_CHURN,
+	PHASE_MASSFREE,
+	PHASE_REGROWTH,
+	PHASE_FREEALL,
+	PHASES
+};
+static const char *phasenames[]={ "rampup", "churn", "massfree", "regrowth", "freeall" };
+
+struct Sample
+{
+	unsigned int ms, phase;
+	size_t live, rss, footprint;
+};
+struct MemThread
+{
+	unsigned int seed;
+	std::vector<void *> blocks;
+	std::vector<size_t> sizes;
+	THREADVAR thread;
+};
+
+static Allocator *memallocator;
+static std::vector<MemThread> threads;
+static size_t target=TARGET;
+static volatile long live;			/* Bytes requested and not yet freed */
+static volatile unsigned int phase, arrived, done;
+static std::vector<Sample> samples;
+static Sample phaseend[PHASES];	/* Taken by the last thread to finish each phase */
+static usCount start;
+static size_t baserss;
+static unsigned int interval=10;
+
+static inline unsigned int rnd(unsigned int &seed)
+{	/* xorshift32 */
+	seed^=seed<<13;
+	seed^=seed>>17;
+	seed^=seed<<5;
+	return seed;
+}
+static size_t blocksize(unsigned int &seed, size_t scale)
+{
+	size_t size=MINSIZE<<(rnd(seed)%12), max=(rnd(seed)%64) ? MAXSIZE : LARGESIZE;
+	size+=rnd(seed)%size;
+	if(size>max) size=max;
+	return size*scale;
+}
+static inline void *touch(void *mem, size_t size)
+{	/* Programs write to what they allocate, so fault it in as they would */
+	const size_t pagesize=mparams.page_size;
+	for(volatile char *p=(volatile char *) mem, *pend=(volatile char *) mem+size; mem && p<pend; p+=pagesize)
+		*p=1;
+	return mem;
+}
+static void allocate(MemThread &t, size_t i, size_t size)
+{
+	if((t.blocks[i]=touch(memallocator->malloc(size), size)))
+	{
+		t.sizes[i]=size;
+		MEMBENCH_ADD(&live, (long) size);
+	}
+}
+static void release(MemThread &t, size_t i)
+{
+	if(t.blocks[i])
+	{
+		memallocator->free(t.blocks[i]);
+		MEMBENCH_ADD(&live, -(long) t.sizes[i]);
+		t.blocks[i]=0;
+	}
+}
+static void snapshot(Sample &s, unsigned int p)
+{
+	s.ms=(unsigned int)((GetUsCount()-start)/1000000000);
+	s.phase=p;
+	s.live=(size_t) MEMBENCH_LOAD(&live);
+	s.rss=CurrentRSS();
+	s.footprint=memallocator->footprint ? memallocator->footprint() : 0;
+}
+static void nextphase()
+{	/* The last thread to finish a phase records where it ended and starts the next */
+	unsigned int p=phase;
+	if((size_t) MEMBENCH_ADD(&arrived, 1)==threads.size())
+	{
+		snapshot(phaseend[p], p);
+		MEMBENCH_STORE(&arrived, 0);
+		MEMBENCH_STORE(&phase, p+1);
+	}
+	else
+		while(MEMBENCH_LOAD(&phase)==p)
+			THREADYIELD();
+}
+static void membench(MemThread &t)
+{
+	size_t i, n, share=target/threads.size(), mine=0;
+	while(mine<share)
+	{
+		t.blocks.push_back(0);
+		t.sizes.push_back(0);
+		allocate(t, t.blocks.size()-1, blocksize(t.seed, 1));
+		mine+=t.sizes.back();
+	}
+	nextphase();
+	for(n=0; n<CHURN*t.blocks.size(); n++)
+	{
+		i=rnd(t.seed)%t.blocks.size();
+		release(t, i);
+		allocate(t, i, blocksize(t.seed, 1));
+	}
+	nextphase();
+	for(i=0; i<t.blocks.size(); i++)
+		if(i%MASSFREE_KEEP) release(t, i);
+	nextphase();
+	for(i=0, mine=0; i<t.blocks.size(); i++)
+		if(t.blocks[i]) mine+=t.sizes[i];
+	for(i=0; mine<share; i=(i+1)%t.blocks.size())
+		if(!t.blocks[i])
+		{
+			allocate(t, i, blocksize(t.seed, 2));
+			mine+=t.sizes[i];
+		}
+	nextphase();
+	for(i=0; i<t.blocks.size(); i++)
+		release(t, i);
+	nextphase();
+}
+#ifdef WIN32
+static DWORD WINAPI _threadcode(LPVOID a)
+#else
+static void *_threadcode(void *a)
+#endif
+{
+	if(a) membench(*(MemThread *) a);
+	else
+	{	/* Sampler */
+		while(!MEMBENCH_LOAD(&done))
+		{
+			Sample s;
+			snapshot(s, MEMBENCH_LOAD(&phase));
+			samples.push_back(s);
+			THREADSLEEP(interval);
+		}
+	}
+	return 0;
+}
+
+static void usage(const char *argv0)
+{
+	unsigned int n;
+	fprintf(stderr, "Usage: %s [-a <allocator>] [-t <threads>] [-m <target Mb>] [-i <sample interval ms>] [-o <csv file>]\n\nAllocators are", argv0);
+	for(n=0; n<sizeof(allocators)/sizeof(Allocator); n++)
+		fprintf(stderr, " %s", allocators[n].shortname);
+	fprintf(stderr, ", defaulting to nedmalloc. The CSV file gets every sample.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *csvfile=0;
+	unsigned int threadcount=1, n;
+	int i;
+	memallocator=allocators;
+	for(i=1; i<argc; i++)
+	{
+		const char *arg=argv[i+1];
+		if(i+1==argc || argv[i][0]!='-' || !argv[i][1] || argv[i][2])
+		{
+			usage(argv[0]);
+			return 1;
+		}
+		switch(argv[i++][1])
+		{
+		case 'a':
+			for(n=0; n<sizeof(allocators)/sizeof(Allocator) && strcmp(arg, allocators[n].shortname); n++);
+			if(n==sizeof(allocators)/sizeof(Allocator))
+			{
+				fprintf(stderr, "Unknown allocator %s\n", arg);
+				return 1;
+			}
+			memallocator=allocators+n;
+			break;
+		case 't':
+			if(!(threadcount=(unsigned int) atoi(arg)))
+			{
+				fprintf(stderr, "Bad thread count %s\n", arg);
+				return 1;
+			}
+			break;
+		case 'm':
+			if(!(target=(size_t) atoi(arg)*1024*1024))
+			{
+				fprintf(stderr, "Bad target %s\n", arg);
+				return 1;
+			}
+			break;
+		case 'i':
+			if(!(interval=(unsigned int) atoi(arg)))
+			{
+				fprintf(stderr, "Bad interval %s\n", arg);
+				return 1;
+			}
+			break;
+		case 'o':
+			csvfile=arg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	printf("Running %s on %u threads up to %lu Mb live ...\n", memallocator->name, threadcount, (unsigned long)(target/1024/1024));
+	samples.reserve(65536);
+	threads.resize(threadcount);
+	for(n=0; n<threadcount; n++)
+		threads[n].seed=n*2654435761U+1;
+	baserss=CurrentRSS();
+	start=GetUsCount();
+	THREADVAR sampler;
+	THREADINIT(&sampler, 0);
+	for(n=0; n<threadcount; n++)
+		THREADINIT(&threads[n].thread, &threads[n]);
+	for(n=0; n<threadcount; n++)
+		THREADWAIT(threads[n].thread);
+	MEMBENCH_STORE(&done, 1);
+	THREADWAIT(sampler);
+
+	/* Peaks come from the samples, which may miss a short phase altogether */
+	Sample peak[PHASES];
+	memcpy(peak, phaseend, sizeof(peak));
+	for(std::vector<Sample>::const_iterator s=samples.begin(); s!=samples.end(); ++s)
+	{
+		Sample &p=peak[s->phase<PHASES ? s->phase : PHASES-1];
+		if(s->live>p.live) p.live=s->live;
+		if(s->rss>p.rss) p.rss=s->rss;
+		if(s->footprint>p.footprint) p.footprint=s->footprint;
+	}
+#define RATIO(a, b) ((b) ? (double)(a)/(b) : 0.0)
+#define GROWTH(rss) ((rss)>baserss ? (rss)-baserss : 0)
+	printf("%-9s %12s %12s %12s %14s %14s %12s\n", "Phase", "Live Kb", "RSS Kb", "Footprint Kb", "RSS/live", "Footprint/live", "Peak RSS Kb");
+	for(n=0; n<PHASES; n++)
+	{
+		const Sample &l=phaseend[n];
+		printf("%-9s %12lu %12lu ", phasenames[n], (unsigned long)(l.live/1024), (unsigned long)(GROWTH(l.rss)/1024));
+		if(memallocator->footprint)
+			printf("%12lu %14.3f %14.3f", (unsigned long)(l.footprint/1024), RATIO(GROWTH(l.rss), l.live), RATIO(l.footprint, l.live));
+		else
+			printf("%12s %14.3f %14s", "-", RATIO(GROWTH(l.rss), l.live), "-");
+		printf(" %12lu\n", (unsigned long)(GROWTH(peak[n].rss)/1024));
+	}
+	{
+		const Sample &before=phaseend[PHASE_CHURN], &after=phaseend[PHASE_MASSFREE], &end=phaseend[PHASE_FREEALL];
+		size_t freed=before.live>after.live ? before.live-after.live : 0;
+		size_t returned=before.rss>after.rss ? before.rss-after.rss : 0;
+		printf("\nAfter massfree %.1f%% of the %lu Kb freed went back to the system", 100*RATIO(returned, freed), (unsigned long)(freed/1024));
+		printf(", and %lu Kb of RSS growth remains after everything was freed.\n", (unsigned long)(GROWTH(end.rss)/1024));
+	}
+	if(csvfile)
+	{
+		FILE *oh=fopen(csvfile, "w");
+		if(!oh)
+		{
+			fprintf(stderr, "Couldn't open %s\n", csvfile);
+			return 1;
+		}
+		fprintf(oh, "ms,phase,live,rssgrowth,footprint\n");
+		for(std::vector<Sample>::const_iterator s=samples.begin(); s!=samples.end(); ++s)
+			fprintf(oh, "%u,%s,%lu,%lu,%lu\n", s->ms, phasenames[s->phase<PHASES ? s->phase : PHASES-1], (unsigned long) s->live,
+				(unsigned long) GROWTH(s->rss), (unsigned long) s->footprint);
+		fclose(oh);
+		printf("Wrote %lu samples to %s\n", (unsigned long) samples.size(), csvfile);
+	}
+#undef GROWTH
+#undef RATIO
+	return 0;
+}
@@ -0,0 +1,482 @@
+/* nedreplay.cpp
+Replays an allocation trace written by nedmalloc's ENABLE_LOGGING against nedmalloc,
+the system allocator or dlmalloc and reports throughput, latency percentiles and peak
+RSS, so allocator changes can be checked against real workloads without their data.
+
+Record a trace by building the program with ENABLE_LOGGING=7 (malloc, realloc and free)
+and NEDMALLOC_LOGLOSSLESS=1 so no records are dropped. Only threads with a thread cache
+are recorded.
+
+Records from all threads are put back into timestamp order and each block is given an
+identity from its address, so a block freed by another thread than allocated it is
+still the same object. Every recorded thread is then replayed on one of the replay
+threads, and an operation on a block waits until the operations before it on that block
+have been replayed, wherever they were.
+*/
+
+#define FORCEINLINE
+#define NOINLINE
+
+#include "nedmalloc.c"
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <vector>
+#ifdef WIN32
+#include <psapi.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#ifdef WIN32
+typedef unsigned __int64 usCount;
+static usCount GetUsCount()
+{
+	static LARGE_INTEGER ticksPerSec;
+	static double scalefactor;
+	LARGE_INTEGER val;
+	if(!scalefactor)
+	{
+		if(QueryPerformanceFrequency(&ticksPerSec))
+			scalefactor=ticksPerSec.QuadPart/1000000000000.0;
+		else
+			scalefactor=1;
+	}
+	if(!QueryPerformanceCounter(&val))
+		return (usCount) GetTickCount() * 1000000000;
+	return (usCount) (val.QuadPart/scalefactor);
+}
+static DWORD WINAPI _threadcode(LPVOID a);
+#define THREADVAR HANDLE
+#define THREADINIT(v, id) (*v=CreateThread(NULL, 0, _threadcode, (LPVOID)(size_t) id, 0, NULL))
+#define THREADSLEEP(v) SleepEx(v, FALSE)
+#define THREADYIELD() SleepEx(0, FALSE)
+#define THREADWAIT(v) (WaitForSingleObject(v, INFINITE), 0)
+/* Volatile only orders accesses on x86 and ARM with /volatile:ms, so fence explicitly */
+template<typename T> static inline T ReplayLoad(T *p)
+{
+	T v=*(volatile T *) p;
+	MemoryBarrier();
+	return v;
+}
+template<typename T> static inline void ReplayStore(T *p, T v)
+{
+	MemoryBarrier();
+	*(volatile T *) p=v;
+}
+#define REPLAY_LOAD(p)		ReplayLoad(p)
+#define REPLAY_STORE(p, v)	ReplayStore((p), (v))
+#else
+#include <sys/time.h>
+
+typedef unsigned long long usCount;
+static usCount GetUsCount()
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((usCount) ts.tv_sec*1000000000000LL)+ts.tv_nsec*1000LL;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return ((usCount) tv.tv_sec*1000000000000LL)+tv.tv_usec*1000000LL;
+#endif
+}
+static void *_threadcode(void *a);
+#define THREADVAR pthread_t
+#define THREADINIT(v, id) pthread_create(v, NULL, _threadcode, (void *)(size_t) id)
+#define THREADSLEEP(v) usleep(v*1000)
+#define THREADYIELD() sched_yield()
+#define THREADWAIT(v) pthread_join(v, NULL)
+#define REPLAY_LOAD(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define REPLAY_STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+
+static size_t CurrentRSS()
+{
+#ifdef WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	return GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)) ? pmc.WorkingSetSize : 0;
+#elif defined(__linux__)
+	unsigned long pages=0, resident=0;
+	FILE *ih=fopen("/proc/self/statm", "r");
+	if(!ih) return 0;
+	if(2!=fscanf(ih, "%lu %lu", &pages, &resident)) resident=0;
+	fclose(ih);
+	return (size_t) resident*sysconf(_SC_PAGESIZE);
+#else
+	return 0;
+#endif
+}
+
+static void *nedmalloc_wrapper(size_t size, size_t alignment, unsigned flags)
+{
+	return nedalloc::nedpmalloc2(0, size, alignment, flags);
+}
+static void *nedrealloc_wrapper(void *mem, size_t size, size_t alignment, unsigned flags)
+{
+	return nedalloc::nedprealloc2(0, mem, size, alignment, flags);
+}
+static void nedfree_wrapper(void *mem)
+{
+	nedalloc::nedpfree2(0, mem, 0);
+}
+static void *sysmalloc_wrapper(size_t size, size_t alignment, unsigned flags)
+{
+	void *ret;
+#ifndef WIN32
+	if(alignment>MALLOC_ALIGNMENT)
+	{
+		if(posix_memalign(&ret, alignment, size)) return 0;
+		if(flags & M2_ZERO_MEMORY) memset(ret, 0, size);
+		return ret;
+	}
+#endif
+	return (flags & M2_ZERO_MEMORY) ? calloc(1, size) : malloc(size);
+}
+static void *sysrealloc_wrapper(void *mem, size_t size, size_t alignment, unsigned flags)
+{
+	return realloc(mem, size);
+}
+static void sysfree_wrapper(void *mem)
+{
+	free(mem);
+}
+static mspace mymspace = create_mspace(0,1);
+static void *dlmalloc_wrapper(size_t size, size_t alignment, unsigned flags)
+{
+	if(alignment>MALLOC_ALIGNMENT)
+	{
+		void *ret=mspace_memalign(mymspace, alignment, size);
+		if(ret && (flags & M2_ZERO_MEMORY)) memset(ret, 0, size);
+		return ret;
+	}
+	return (flags & M2_ZERO_MEMORY) ? mspace_calloc(mymspace, 1, size) : mspace_malloc(mymspace, size);
+}
+static void *dlrealloc_wrapper(void *mem, size_t size, size_t alignment, unsigned flags)
+{
+	return mspace_realloc(mymspace, mem, size);
+}
+static void dlfree_wrapper(void *mem)
+{
+	mspace_free(mymspace, mem);
+}
+
+struct Allocator
+{
+	const char *name, *shortname;
+	void *(*malloc)(size_t size, size_t alignment, unsigned flags);
+	void *(*realloc)(void *mem, size_t size, size_t alignment, unsigned flags);
+	void (*free)(void *mem);
+};
+/* The page allocators in scalingtest.cpp can't serve small blocks and the user mode one
+isn't threadsafe, so only general purpose allocators are here */
+static Allocator allocators[]={
+	{ "nedmalloc", "nedmalloc", &nedmalloc_wrapper, &nedrealloc_wrapper, &nedfree_wrapper },
+	{ "System allocator", "sysalloc", &sysmalloc_wrapper, &sysrealloc_wrapper, &sysfree_wrapper },
+	{ "dlmalloc", "dlmalloc", &dlmalloc_wrapper, &dlrealloc_wrapper, &dlfree_wrapper }
+};
+
+struct ReplayOp
+{
+	unsigned int type;				/* Bit index of the LogEntryType */
+	unsigned int flags;
+	size_t object;					/* Index into objects */
+	size_t seq;						/* Operations on object before this one */
+	size_t size, alignment;
+};
+struct ReplayObject
+{
+	void *mem;
+	size_t seq;						/* Operations on this object replayed so far */
+};
+struct ReplayThread
+{
+	std::vector<ReplayOp> ops;
+	std::vector<unsigned int> latencies;	/* Nanoseconds per operation */
+	size_t failures;
+	THREADVAR thread;
+};
+
+static Allocator *replayallocator;
+static std::vector<ReplayObject> objects;
+static std::vector<ReplayThread> threads;
+static int go, done;
+static size_t peakrss;
+
+static void replay(ReplayThread &t)
+{
+	const size_t pagesize=mparams.page_size;
+	t.latencies.reserve(t.ops.size());
+	while(!REPLAY_LOAD(&go)) THREADYIELD();
+	for(std::vector<ReplayOp>::const_iterator op=t.ops.begin(); op!=t.ops.end(); ++op)
+	{
+		ReplayObject &o=objects[op->object];
+		void *mem;
+		size_t touch=op->size;
+		usCount start, end;
+		while(REPLAY_LOAD(&o.seq)!=op->seq)
+			THREADYIELD();
+		mem=o.mem;
+		start=GetUsCount();
+		if((1<<op->type)==nedalloc::LOGENTRY_MALLOC)
+			mem=replayallocator->malloc(op->size, op->alignment, op->flags);
+		else if((1<<op->type)==nedalloc::LOGENTRY_REALLOC)
+		{
+			void *newmem=replayallocator->realloc(mem, op->size, op->alignment, op->flags);
+			if(newmem) mem=newmem;
+			else
+			{	/* The old block is kept, which may be smaller than the new size */
+				touch=0;
+				t.failures++;
+			}
+		}
+		else
+		{
+			replayallocator->free(mem);
+			mem=0;
+		}
+		end=GetUsCount();
+		t.latencies.push_back((unsigned int)((end-start)/1000));
+		if(mem && (1<<op->type)!=nedalloc::LOGENTRY_FREE)
+		{	/* Programs write to what they allocate, so fault it in as they would */
+			for(volatile char *p=(volatile char *) mem, *pend=(volatile char *) mem+touch; p<pend; p+=pagesize)
+				*p=1;
+		}
+		else if((1<<op->type)==nedalloc::LOGENTRY_MALLOC)
+			t.failures++;
+		o.mem=mem;
+		REPLAY_STORE(&o.seq, op->seq+1);
+	}
+}
+#ifdef WIN32
+static DWORD WINAPI _threadcode(LPVOID a)
+{
+	if(a) replay(threads[(size_t) a-1]);
+	else
+#else
+static void *_threadcode(void *a)
+{
+	if(a) replay(threads[(size_t) a-1]);
+	else
+#endif
+	{	/* RSS sampler */
+		size_t rss;
+		while(!REPLAY_LOAD(&done))
+		{
+			if((rss=CurrentRSS())>peakrss) peakrss=rss;
+			THREADSLEEP(1);
+		}
+	}
+	return 0;
+}
+
+static FILE *ih;
+static int truncated;
+static unsigned long long getvarint()
+{
+	unsigned long long v=0;
+	int shift=0, c;
+	do
+	{
+		if(EOF==(c=getc(ih)))
+		{
+			truncated=1;
+			return 0;
+		}
+		v|=(unsigned long long)(c & 0x7f)<<shift;
+		shift+=7;
+	} while(c & 0x80);
+	return v;
+}
+static int getbyte()
+{
+	int c=getc(ih);
+	if(EOF==c)
+	{
+		truncated=1;
+		return 0;
+	}
+	return c;
+}
+
+struct TraceRecord
+{
+	unsigned long long timestamp, threadid, size, mem, alignment, flags, returned;
+	unsigned int type;
+	bool operator<(const TraceRecord &o) const { return timestamp<o.timestamp; }
+};
+
+int main(int argc, char *argv[])
+{
+	using namespace std;
+	vector<TraceRecord> records;
+	map<unsigned long long, unsigned int> recordedthreads;
+	map<unsigned long long, deque<size_t> > live;
+	vector<size_t> seqs;
+	unsigned long long dropped=0, unmatched=0;
+	unsigned int threadcount=0, n;
+	char magic[8];
+	int c;
+	if(argc<2 || argc>4)
+	{
+		fprintf(stderr, "Usage: %s <trace file> [<allocator> [<threads>]]\n\nAllocators are", argv[0]);
+		for(n=0; n<sizeof(allocators)/sizeof(Allocator); n++)
+			fprintf(stderr, " %s", allocators[n].shortname);
+		fprintf(stderr, ". Threads defaults to one per recorded thread.\n");
+		return 1;
+	}
+	replayallocator=allocators;
+	if(argc>2)
+	{
+		for(n=0; n<sizeof(allocators)/sizeof(Allocator) && strcmp(argv[2], allocators[n].shortname); n++);
+		if(n==sizeof(allocators)/sizeof(Allocator))
+		{
+			fprintf(stderr, "Unknown allocator %s\n", argv[2]);
+			return 1;
+		}
+		replayallocator=allocators+n;
+	}
+	if(argc>3) threadcount=atoi(argv[3]);
+	if(!(ih=fopen(argv[1], "rb")))
+	{
+		fprintf(stderr, "Couldn't open %s\n", argv[1]);
+		return 1;
+	}
+	if(8!=fread(magic, 1, 8, ih) || memcmp(magic, "NEDTRC01", 8))
+	{
+		fprintf(stderr, "%s is not a nedmalloc trace\n", argv[1]);
+		return 1;
+	}
+	while(EOF!=(c=getc(ih)))
+	{
+		unsigned long long count, threadid, timestamp, i;
+		ungetc(c, ih);
+		count=getvarint();
+		getvarint();				/* Pool */
+		threadid=getvarint();
+		timestamp=getvarint();
+		dropped+=getvarint();
+		for(i=0; i<count && !truncated; i++)
+		{
+			TraceRecord r;
+			int frames;
+			timestamp+=getvarint();
+			r.timestamp=timestamp;
+			r.threadid=threadid;
+			r.type=getbyte();
+			getvarint();			/* MSpace */
+			r.size=getvarint();
+			r.mem=getvarint();
+			r.alignment=getvarint();
+			r.flags=getvarint();
+			r.returned=getvarint();
+			for(frames=getbyte(); frames>0; frames--)
+				getvarint();
+			if(truncated) break;
+			if((1<<r.type) & (nedalloc::LOGENTRY_MALLOC|nedalloc::LOGENTRY_REALLOC|nedalloc::LOGENTRY_FREE))
+				records.push_back(r);
+		}
+		if(truncated) break;
+	}
+	fclose(ih);
+	if(truncated)
+		fprintf(stderr, "Warning: trace is truncated\n");
+	if(dropped)
+		fprintf(stderr, "Warning: %llu records were dropped when recording, so build with NEDMALLOC_LOGLOSSLESS=1\n", dropped);
+
+	/* Work out which object each record is about. A block's address can be handed out
+	again before the free of its previous life is logged, so addresses map to a queue of
+	objects and a free or realloc always takes the oldest. */
+	stable_sort(records.begin(), records.end());
+	for(vector<TraceRecord>::const_iterator r=records.begin(); r!=records.end(); ++r)
+		if(recordedthreads.find(r->threadid)==recordedthreads.end())
+		{
+			unsigned int idx=(unsigned int) recordedthreads.size();
+			recordedthreads[r->threadid]=idx;
+		}
+	if(!threadcount) threadcount=(unsigned int) recordedthreads.size();
+	if(!threadcount) threadcount=1;
+	threads.resize(threadcount);
+	for(vector<TraceRecord>::const_iterator r=records.begin(); r!=records.end(); ++r)
+	{
+		ReplayOp op;
+		op.type=r->type;
+		op.flags=(unsigned int) r->flags;
+		op.size=(size_t) r->size;
+		op.alignment=(size_t) r->alignment;
+		if((1<<r->type)!=nedalloc::LOGENTRY_MALLOC)
+		{
+			map<unsigned long long, deque<size_t> >::iterator it=live.find(r->mem);
+			if(it==live.end())
+			{	/* Allocated before recording began or by an unrecorded thread */
+				unmatched++;
+				if((1<<r->type)==nedalloc::LOGENTRY_FREE || !r->returned) continue;
+				op.type=0;		/* Bit index of LOGENTRY_MALLOC */
+				op.object=seqs.size();
+				seqs.push_back(0);
+			}
+			else
+			{
+				if(!r->returned && (1<<r->type)==nedalloc::LOGENTRY_REALLOC) continue;
+				op.object=it->second.front();
+				it->second.pop_front();
+				if(it->second.empty()) live.erase(it);
+			}
+		}
+		else
+		{
+			if(!r->returned) continue;
+			op.object=seqs.size();
+			seqs.push_back(0);
+		}
+		if((1<<r->type)!=nedalloc::LOGENTRY_FREE)
+			live[r->returned].push_back(op.object);
+		op.seq=seqs[op.object]++;
+		threads[recordedthreads[r->threadid] % threadcount].ops.push_back(op);
+	}
+	if(unmatched)
+		fprintf(stderr, "Warning: %llu records were about blocks allocated before recording began\n", unmatched);
+	objects.resize(seqs.size());
+	vector<TraceRecord>().swap(records);
+	live.clear();
+
+	size_t ops=0;
+	for(n=0; n<threadcount; n++)
+		ops+=threads[n].ops.size();
+	printf("Replaying %lu operations from %u recorded threads on %u threads with %s ...\n",
+		(unsigned long) ops, (unsigned int) recordedthreads.size(), threadcount, replayallocator->name);
+	size_t baserss=peakrss=CurrentRSS();
+	THREADVAR sampler;
+	THREADINIT(&sampler, 0);
+	for(n=0; n<threadcount; n++)
+		THREADINIT(&threads[n].thread, (n+1));
+	THREADSLEEP(100);
+	usCount start=GetUsCount();
+	REPLAY_STORE(&go, 1);
+	for(n=0; n<threadcount; n++)
+		THREADWAIT(threads[n].thread);
+	usCount end=GetUsCount();
+	REPLAY_STORE(&done, 1);
+	THREADWAIT(sampler);
+
+	vector<unsigned int> latencies;
+	size_t failures=0;
+	for(n=0; n<threadcount; n++)
+	{
+		latencies.insert(latencies.end(), threads[n].latencies.begin(), threads[n].latencies.end());
+		failures+=threads[n].failures;
+	}
+	sort(latencies.begin(), latencies.end());
+	for(vector<ReplayObject>::iterator o=objects.begin(); o!=objects.end(); ++o)
+		if(o->mem) replayallocator->free(o->mem);
+#define PERCENTILE(p) (latencies.empty() ? 0 : latencies[(size_t)((latencies.size()-1)*(p))])
+	printf("Operations:   %lu (%lu failed)\n", (unsigned long) latencies.size(), (unsigned long) failures);
+	printf("Throughput:   %.0f ops/sec\n", end>start ? latencies.size()/((double)(end-start)/1000000000000.0) : 0.0);
+	printf("Latency (ns): p50 %u, p90 %u, p99 %u, p99.9 %u, max %u\n",
+		PERCENTILE(0.5), PERCENTILE(0.9), PERCENTILE(0.99), PERCENTILE(0.999), PERCENTILE(1.0));
+	printf("Peak RSS:     %lu Kb (%lu Kb before replay)\n", (unsigned long)(peakrss/1024), (unsigned long)(baserss/1024));
+#undef PERCENTILE
+	return 0;
+}
@@ -0,0 +1,255 @@
+/* nedstlbench.cpp
+Times STL containers using std::allocator, the default nedallocator and nedallocator with
+each combination of the typeIsPOD, mmap and reserveN policies, at several element sizes.
+
+vector-pushback    push_back() from empty, so growing by reallocation
+vector-reserve     reserve() then push_back()
+map                insert() and then erase() keys in pseudo random order
+unordered-map      the same, C++11 only
+list-churn         pop_front() and push_back() on a list of LISTSIZE elements
+
+The mmap and reserveN policies turn each allocation into its own mapping, which only
+makes sense for arrays, so the node based containers are only run with typeIsPOD, and
+with nodepool which in turn only makes sense for them.
+Each result is the best of REPEATS runs in nanoseconds per operation.
+*/
+
+#define _CRT_SECURE_NO_WARNINGS 1	/* Don't care about MSVC warnings on POSIX functions */
+#if __cplusplus > 199711L
+#define HAVE_CPP0XTHREADLOCAL 1		/* Opts in to nedpolicy::nodepool */
+#endif
+#include "nedmalloc.c"
+#include <list>
+#include <map>
+#include <vector>
+#ifdef HAVE_CPP0XRVALUEREFS
+#include <unordered_map>
+#endif
+
+#define VECTORBYTES (16*1024*1024)	/* Vectors are grown to this size whatever their element */
+#define MAPELEMENTS 100000
+#define LISTSIZE 1000
+#define LISTOPS 1000000
+#define REPEATS 3
+
+#ifdef WIN32
+typedef unsigned __int64 usCount;
+static usCount GetUsCount()
+{
+	static LARGE_INTEGER ticksPerSec;
+	static double scalefactor;
+	LARGE_INTEGER val;
+	if(!scalefactor)
+	{
+		if(QueryPerformanceFrequency(&ticksPerSec))
+			scalefactor=ticksPerSec.QuadPart/1000000000000.0;
+		else
+			scalefactor=1;
+	}
+	if(!QueryPerformanceCounter(&val))
+		return (usCount) GetTickCount() * 1000000000;
+	return (usCount) (val.QuadPart/scalefactor);
+}
+#else
+#include <sys/time.h>
+
+typedef unsigned long long usCount;
+static usCount GetUsCount()
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((usCount) ts.tv_sec*1000000000000LL)+ts.tv_nsec*1000LL;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return ((usCount) tv.tv_sec*1000000000000LL)+tv.tv_usec*1000000LL;
+#endif
+}
+#endif
+
+using namespace nedalloc;
+
+/* Has a copy constructor so it isn't trivially copyable, which makes typeIsPOD matter */
+template<size_t N> struct Element
+{
+	unsigned char data[N];
+	Element() { data[0]=1; }
+	Element(const Element &o) { memcpy(data, o.data, N); }
+	Element &operator=(const Element &o) { memcpy(data, o.data, N); return *this; }
+};
+
+static double scale=1;
+static unsigned int mask=~0U;		/* Which of the tests below to run */
+
+/* Each of these returns the nanoseconds per operation */
+template<class vectortype> double vector_pushback()
+{
+	size_t n, count=(size_t)(scale*VECTORBYTES/sizeof(typename vectortype::value_type));
+	typename vectortype::value_type e;
+	usCount start=GetUsCount();
+	{
+		vectortype v;
+		for(n=0; n<count; n++)
+			v.push_back(e);
+	}
+	return (GetUsCount()-start)/1000.0/count;
+}
+template<class vectortype> double vector_reserve()
+{
+	size_t n, count=(size_t)(scale*VECTORBYTES/sizeof(typename vectortype::value_type));
+	typename vectortype::value_type e;
+	usCount start=GetUsCount();
+	{
+		vectortype v;
+		v.reserve(count);
+		for(n=0; n<count; n++)
+			v.push_back(e);
+	}
+	return (GetUsCount()-start)/1000.0/count;
+}
+template<class maptype> double map_inserterase()
+{
+	size_t n, count=(size_t)(scale*MAPELEMENTS);
+	typename maptype::mapped_type e;
+	unsigned int key=1;
+	usCount start=GetUsCount();
+	{
+		maptype m;
+		for(n=0; n<count; n++)
+		{
+			key=key*1103515245+12345;
+			m.insert(typename maptype::value_type(key, e));
+		}
+		key=1;
+		for(n=0; n<count; n++)
+		{
+			key=key*1103515245+12345;
+			m.erase(key);
+		}
+	}
+	return (GetUsCount()-start)/1000.0/(2*count);
+}
+template<class listtype> double list_churn()
+{
+	size_t n, count=(size_t)(scale*LISTOPS);
+	typename listtype::value_type e;
+	usCount start=GetUsCount();
+	{
+		listtype l(LISTSIZE);
+		for(n=0; n<count; n++)
+		{
+			l.pop_front();
+			l.push_back(e);
+		}
+	}
+	return (GetUsCount()-start)/1000.0/(2*count);
+}
+
+static const char *testnames[]={ "vector-pushback", "vector-reserve", "map", "unordered-map", "list-churn" };
+static int csv;
+static void report(unsigned int test, const char *allocator, size_t elemsize, double (*fn)())
+{
+	double best=0;
+	if(!(mask & (1<<test))) return;
+	for(int n=0; n<REPEATS; n++)
+	{
+		double t=fn();
+		if(!n || t<best) best=t;
+	}
+	if(csv)
+		printf("%s,%s,%u,%f\n", testnames[test], allocator, (unsigned) elemsize, best);
+	else
+		printf("%-16s %-36s %8u %10.2f\n", testnames[test], allocator, (unsigned) elemsize, best);
+	fflush(stdout);
+}
+
+template<size_t N> void run()
+{
+	typedef Element<N> E;
+	typedef std::pair<const unsigned int, E> P;
+	report(0, "std::allocator", N, &vector_pushback<std::vector<E> >);
+	report(0, "nedallocator", N, &vector_pushback<std::vector<E, nedallocator<E> > >);
+	report(0, "typeIsPOD", N, &vector_pushback<std::vector<E, nedallocator<E, nedpolicy::typeIsPOD<true>::policy> > >);
+	report(0, "mmap", N, &vector_pushback<std::vector<E, nedallocator<E, nedpolicy::mmap<>::policy> > >);
+	report(0, "reserveN<26>", N, &vector_pushback<std::vector<E, nedallocator<E, nedpolicy::reserveN<26>::policy> > >);
+	report(0, "typeIsPOD,mmap", N, &vector_pushback<std::vector<E, nedallocator<E, nedpolicy::typeIsPOD<true>::policy, nedpolicy::mmap<>::policy> > >);
+	report(0, "typeIsPOD,reserveN<26>", N, &vector_pushback<std::vector<E, nedallocator<E, nedpolicy::typeIsPOD<true>::policy, nedpolicy::reserveN<26>::policy> > >);
+	report(0, "mmap,reserveN<26>", N, &vector_pushback<std::vector<E, nedallocator<E, nedpolicy::mmap<>::policy, nedpolicy::reserveN<26>::policy> > >);
+	report(0, "typeIsPOD,mmap,reserveN<26>", N, &vector_pushback<std::vector<E, nedallocator<E, nedpolicy::typeIsPOD<true>::policy, nedpolicy::mmap<>::policy, nedpolicy::reserveN<26>::policy> > >);
+
+	report(1, "std::allocator", N, &vector_reserve<std::vector<E> >);
+	report(1, "nedallocator", N, &vector_reserve<std::vector<E, nedallocator<E> > >);
+	report(1, "typeIsPOD", N, &vector_reserve<std::vector<E, nedallocator<E, nedpolicy::typeIsPOD<true>::policy> > >);
+	report(1, "mmap", N, &vector_reserve<std::vector<E, nedallocator<E, nedpolicy::mmap<>::policy> > >);
+	report(1, "reserveN<26>", N, &vector_reserve<std::vector<E, nedallocator<E, nedpolicy::reserveN<26>::policy> > >);
+	report(1, "typeIsPOD,mmap", N, &vector_reserve<std::vector<E, nedallocator<E, nedpolicy::typeIsPOD<true>::policy, nedpolicy::mmap<>::policy> > >);
+	report(1, "typeIsPOD,reserveN<26>", N, &vector_reserve<std::vector<E, nedallocator<E, nedpolicy::typeIsPOD<true>::policy, nedpolicy::reserveN<26>::policy> > >);
+	report(1, "mmap,reserveN<26>", N, &vector_reserve<std::vector<E, nedallocator<E, nedpolicy::mmap<>::policy, nedpolicy::reserveN<26>::policy> > >);
+	report(1, "typeIsPOD,mmap,reserveN<26>", N, &vector_reserve<std::vector<E, nedallocator<E, nedpolicy::typeIsPOD<true>::policy, nedpolicy::mmap<>::policy, nedpolicy::reserveN<26>::policy> > >);
+
+	report(2, "std::allocator", N, &map_inserterase<std::map<unsigned int, E> >);
+	report(2, "nedallocator", N, &map_inserterase<std::map<unsigned int, E, std::less<unsigned int>, nedallocator<P> > >);
+	report(2, "typeIsPOD", N, &map_inserterase<std::map<unsigned int, E, std::less<unsigned int>, nedallocator<P, nedpolicy::typeIsPOD<true>::policy> > >);
+#ifdef HAVE_CPP0XTHREADLOCAL
+	report(2, "nodepool<256>", N, &map_inserterase<std::map<unsigned int, E, std::less<unsigned int>, nedallocator<P, nedpolicy::nodepool<256>::policy> > >);
+#endif
+
+#ifdef HAVE_CPP0XRVALUEREFS
+	report(3, "std::allocator", N, &map_inserterase<std::unordered_map<unsigned int, E> >);
+	report(3, "nedallocator", N, &map_inserterase<std::unordered_map<unsigned int, E, std::hash<unsigned int>, std::equal_to<unsigned int>, nedallocator<P> > >);
+	report(3, "typeIsPOD", N, &map_inserterase<std::unordered_map<unsigned int, E, std::hash<unsigned int>, std::equal_to<unsigned int>, nedallocator<P, nedpolicy::typeIsPOD<true>::policy> > >);
+#ifdef HAVE_CPP0XTHREADLOCAL
+	report(3, "nodepool<256>", N, &map_inserterase<std::unordered_map<unsigned int, E, std::hash<unsigned int>, std::equal_to<unsigned int>, nedallocator<P, nedpolicy::nodepool<256>::policy> > >);
+#endif
+#endif
+
+	report(4, "std::allocator", N, &list_churn<std::list<E> >);
+	report(4, "nedallocator", N, &list_churn<std::list<E, nedallocator<E> > >);
+	report(4, "typeIsPOD", N, &list_churn<std::list<E, nedallocator<E, nedpolicy::typeIsPOD<true>::policy> > >);
+#ifdef HAVE_CPP0XTHREADLOCAL
+	report(4, "nodepool<256>", N, &list_churn<std::list<E, nedallocator<E, nedpolicy::nodepool<256>::policy> > >);
+#endif
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+	for(i=1; i<argc; i++)
+	{
+		if(!strcmp(argv[i], "-f") && i+1<argc && (!strcmp(argv[i+1], "csv") || !strcmp(argv[i+1], "text")))
+			csv=!strcmp(argv[++i], "csv");
+		else if(!strcmp(argv[i], "-s") && i+1<argc && (scale=atof(argv[i+1]))>0)
+			i++;
+		else if(!strcmp(argv[i], "-t") && i+1<argc)
+		{
+			unsigned int n;
+			for(n=0; n<sizeof(testnames)/sizeof(testnames[0]) && strcmp(argv[i+1], testnames[n]); n++);
+			if(n==sizeof(testnames)/sizeof(testnames[0]))
+			{
+				fprintf(stderr, "Unknown test %s\n", argv[i+1]);
+				return 1;
+			}
+			if(mask==~0U) mask=0;
+			mask|=1<<n;
+			i++;
+		}
+		else
+		{
+			fprintf(stderr, "Usage: %s [-t <test>]... [-s <scale>] [-f text|csv]\n\nTests are", argv[0]);
+			for(unsigned int n=0; n<sizeof(testnames)/sizeof(testnames[0]); n++)
+				fprintf(stderr, " %s", testnames[n]);
+			fprintf(stderr, ", defaulting to all of them.\n");
+			return 1;
+		}
+	}
+	if(csv)
+		printf("test,allocator,elementsize,nsperop\n");
+	else
+		printf("%-16s %-36s %8s %10s\n", "Test", "Allocator", "Element", "ns/op");
+	run<4>();
+	run<16>();
+	run<64>();
+	run<256>();
+	return 0;
+}
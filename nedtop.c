@@ -0,0 +1,133 @@
+/* nedtop.c
+Shows live per pool statistics of a process whose nedmalloc was built with
+NEDMALLOC_STATSEXPORT, read from the shared memory segment it publishes them to.
+Rates are per second over each refresh.
+*/
+
+#include "nedmalloc.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#ifndef NEDMALLOC_STATSEXPORTNAME
+#define NEDMALLOC_STATSEXPORTNAME "/nedmalloc.%u"
+#endif
+
+/* Copies the segment out, retrying while the exporter is part way through an update */
+static int snapshot(const struct nedstatsexport *seg, struct nedstatsexport *out)
+{
+	int tries;
+	for(tries=0; tries<1000; tries++)
+	{
+		unsigned int seq=seg->seq;
+		if(!(seq & 1))
+		{
+			__sync_synchronize();
+			memcpy(out, (const void *) seg, sizeof(*out));
+			__sync_synchronize();
+			if(seg->seq==seq) return 1;
+		}
+		usleep(100);
+	}
+	return 0;
+}
+static const char *bytes(char *buffer, unsigned long long v)
+{
+	static const char units[]="KMGT";
+	double d=(double) v;
+	int n=-1;
+	while(d>=1024 && n<3)
+	{
+		d/=1024;
+		n++;
+	}
+	if(n<0)
+		sprintf(buffer, "%llu", v);
+	else
+		sprintf(buffer, "%.1f%c", d, units[n]);
+	return buffer;
+}
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+int main(int argc, char *argv[])
+{
+	static struct nedstatsexport cur, prev;
+	const struct nedstatsexport *seg;
+	char name[64], b1[16], b2[16], b3[16], b4[16];
+	unsigned int pid, interval=1, iterations=0, iteration;
+	double lasttime=0;
+	int fd;
+	if(argc<2 || argc>4)
+	{
+		fprintf(stderr, "Usage: %s <pid> [<seconds between refreshes> [<refreshes>]]\n", argv[0]);
+		return 1;
+	}
+	pid=(unsigned int) atoi(argv[1]);
+	if(argc>2) interval=(unsigned int) atoi(argv[2]);
+	if(argc>3) iterations=(unsigned int) atoi(argv[3]);
+	sprintf(name, NEDMALLOC_STATSEXPORTNAME, pid);
+	if(-1==(fd=shm_open(name, O_RDONLY, 0)))
+	{
+		fprintf(stderr, "Couldn't open %s. Is process %u running with NEDMALLOC_STATSEXPORT?\n", name, pid);
+		return 1;
+	}
+	if(MAP_FAILED==(seg=(const struct nedstatsexport *) mmap(0, sizeof(*seg), PROT_READ, MAP_SHARED, fd, 0)))
+	{
+		fprintf(stderr, "Couldn't map %s\n", name);
+		return 1;
+	}
+	close(fd);
+	for(iteration=0; !iterations || iteration<iterations; iteration++)
+	{
+		double t;
+		unsigned int n, i;
+		if(iteration) sleep(interval);
+		t=now();
+		if(!snapshot(seg, &cur) || memcmp(cur.magic, "NEDSTAT1", 8) || cur.size!=sizeof(cur))
+		{
+			fprintf(stderr, "%s is not a nedmalloc stats segment of this version\n", name);
+			return 1;
+		}
+		if(isatty(1)) printf("\033[H\033[J");
+		printf("nedmalloc in process %u, updated every %u ms (update %llu)%s\n\n", cur.pid, cur.interval, cur.updates,
+			(kill((pid_t) cur.pid, 0) && ESRCH==errno) ? ", process has exited" : "");
+		printf("%-18s %9s %9s %9s %6s %11s %8s %11s %8s %8s %6s %9s\n", "Pool", "Footprint", "Peak", "Cached", "Caches",
+			"Mallocs/s", "Hit rate", "Frees/s", "Mmaps", "Munmaps", "Trims", "Trimmed");
+		for(n=0; n<cur.pools; n++)
+		{
+			const struct nedstatsexportpool *p=&cur.pool[n], *o=0;
+			double elapsed=t-lasttime, mallocrate=0, freerate=0;
+			char poolname[24];
+			for(i=0; lasttime && i<prev.pools && !o; i++)
+				if(prev.pool[i].pool==p->pool) o=&prev.pool[i];
+			if(o && elapsed>0)
+			{	/* Caches of threads which have exited take their counts with them */
+				if(p->mallocs>=o->mallocs) mallocrate=(p->mallocs-o->mallocs)/elapsed;
+				if(p->frees>=o->frees) freerate=(p->frees-o->frees)/elapsed;
+			}
+			if(p->pool)
+				sprintf(poolname, "0x%llx", p->pool);
+			else
+				strcpy(poolname, "system");
+			printf("%-18s %9s %9s %9s %6u %11.0f %7.1f%% %11.0f %8llu %8llu %6llu %9s\n", poolname,
+				bytes(b1, p->footprint), bytes(b2, p->maxfootprint), bytes(b3, p->cached), p->threadcaches,
+				mallocrate, p->mallocs ? 100.0*p->cachehits/p->mallocs : 0.0, freerate,
+				p->mmapallocs, p->mmapfrees, p->trims, bytes(b4, p->trimmed));
+		}
+		fflush(stdout);
+		prev=cur;
+		lasttime=t;
+	}
+	return 0;
+}
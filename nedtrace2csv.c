@@ -0,0 +1,137 @@
+/* nedtrace2csv.c
+Converts a binary trace written by nedmalloc's ENABLE_LOGGING into the CSV
+columns which nedflushlogs() used to write directly.
+
+The trace starts with the eight bytes "NEDTRC01" followed by any number of
+blocks, every number being an unsigned LEB128 varint. Each block is headed by
+its record count, the pool, the thread id, the timestamp preceding its first
+record and how many records were dropped since the previous block from that
+thread. Each record is then its timestamp delta, a one byte LogEntryType bit
+index, the mspace, size, block, alignment, flags and returned pointer, and a
+one byte count of stack frames followed by that many return addresses.
+*/
+
+#define _CRT_SECURE_NO_WARNINGS 1	/* Don't care about MSVC warnings on POSIX functions */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *LogEntryTypeStrings[]={
+	"LOGENTRY_MALLOC",
+	"LOGENTRY_REALLOC",
+	"LOGENTRY_FREE",
+
+	"LOGENTRY_THREADCACHE_MALLOC",
+	"LOGENTRY_THREADCACHE_FREE",
+	"LOGENTRY_THREADCACHE_CLEAN",
+
+	"LOGENTRY_POOL_MALLOC",
+	"LOGENTRY_POOL_REALLOC",
+	"LOGENTRY_POOL_FREE"
+};
+
+static FILE *ih;
+static int truncated;
+
+static unsigned long long getvarint(void)
+{
+	unsigned long long v=0;
+	int shift=0, c;
+	do
+	{
+		if(EOF==(c=getc(ih)))
+		{
+			truncated=1;
+			return 0;
+		}
+		v|=(unsigned long long)(c & 0x7f)<<shift;
+		shift+=7;
+	} while(c & 0x80);
+	return v;
+}
+static int getbyte(void)
+{
+	int c=getc(ih);
+	if(EOF==c)
+	{
+		truncated=1;
+		return 0;
+	}
+	return c;
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *oh=stdout;
+	char magic[8];
+	unsigned long long records=0, dropped=0;
+	int c;
+	if(argc<2 || argc>3)
+	{
+		fprintf(stderr, "Usage: %s <trace file> [<csv file>]\n", argv[0]);
+		return 1;
+	}
+	if(!(ih=fopen(argv[1], "rb")))
+	{
+		fprintf(stderr, "Couldn't open %s\n", argv[1]);
+		return 1;
+	}
+	if(8!=fread(magic, 1, 8, ih) || memcmp(magic, "NEDTRC01", 8))
+	{
+		fprintf(stderr, "%s is not a nedmalloc trace\n", argv[1]);
+		return 1;
+	}
+	if(3==argc && !(oh=fopen(argv[2], "w")))
+	{
+		fprintf(stderr, "Couldn't open %s\n", argv[2]);
+		return 1;
+	}
+	fprintf(oh, "Timestamp, Pool, Operation, MSpace, Size, Block, Alignment, Flags, Returned,\"Stack Backtrace\"\n");
+	while(EOF!=(c=getc(ih)))
+	{
+		unsigned long long count, pool, timestamp, n;
+		ungetc(c, ih);
+		count=getvarint();
+		pool=getvarint();
+		getvarint();				/* Thread id */
+		timestamp=getvarint();
+		dropped+=getvarint();
+		for(n=0; n<count && !truncated; n++)
+		{
+			unsigned long long mspace, size, mem, alignment, flags, returned;
+			int type, frames, i;
+			timestamp+=getvarint();
+			type=getbyte();
+			mspace=getvarint();
+			size=getvarint();
+			mem=getvarint();
+			alignment=getvarint();
+			flags=getvarint();
+			returned=getvarint();
+			frames=getbyte();
+			if(truncated) break;
+			fprintf(oh, "%llu, 0x%llx, %s, %d, %llu, 0x%llx, %llu, 0x%x, 0x%llx,\"",
+				timestamp, pool, type<(int)(sizeof(LogEntryTypeStrings)/sizeof(LogEntryTypeStrings[0])) ? LogEntryTypeStrings[type] : "******************",
+				(int) mspace, size, mem, alignment, (unsigned int) flags, returned);
+			if(!frames)
+				fprintf(oh, "?");
+			else
+			{
+				for(i=0; i<frames; i++)
+					fprintf(oh, "0x%llx,", getvarint());
+				fprintf(oh, "<backtrace ends>");
+			}
+			fprintf(oh, "\"\n");
+			records++;
+		}
+		if(truncated) break;
+	}
+	if(truncated)
+		fprintf(stderr, "Warning: trace is truncated\n");
+	if(dropped)
+		fprintf(stderr, "Warning: %llu records were dropped because a log ring was full\n", dropped);
+	fprintf(stderr, "Converted %llu records\n", records);
+	if(oh!=stdout) fclose(oh);
+	fclose(ih);
+	return 0;
+}
@@ -1,6 +1,10 @@
 /* scalingtest.cpp
 Tests how various allocators scale according to block size using a monte-carlo approach
 (C) 2010 Niall Douglas
+
+Run with no arguments to choose an allocator interactively, or see -h for running it from
+scripts with a choice of thread counts and block size distribution. Latencies are kept
+per power of two bin in log-linear histograms so the tail is reported as well as the mean.
 */
 
 #define FORCEINLINE
@@ -13,6 +17,10 @@ Tests how various allocators scale according to block size using a monte-carlo a
 #include "nedmalloc.c"
 #include <math.h>
 #include <vector>
+#ifndef WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
 #define LOOPS 25000
 #define MAXBLOCKSIZE (8*1024*1024)
@@ -35,6 +43,16 @@ static usCount GetUsCount()
 		return (usCount) GetTickCount() * 1000000000;
 	return (usCount) (val.QuadPart/scalefactor);
 }
+static DWORD WINAPI _threadcode(LPVOID a);
+#define THREADVAR HANDLE
+#define THREADINIT(v, t) (*v=CreateThread(NULL, 0, _threadcode, (LPVOID)(t), 0, NULL))
+#define THREADWAIT(v) (WaitForSingleObject(v, INFINITE), CloseHandle(v))
+static unsigned int CPUs()
+{
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return si.dwNumberOfProcessors;
+}
 #else
 #include <sys/time.h>
 
@@ -51,6 +69,15 @@ static usCount GetUsCount()
 	return ((usCount) tv.tv_sec*1000000000000LL)+tv.tv_usec*1000000LL;
 #endif
 }
+static void *_threadcode(void *a);
+#define THREADVAR pthread_t
+#define THREADINIT(v, t) pthread_create(v, NULL, _threadcode, (void *)(t))
+#define THREADWAIT(v) pthread_join(v, NULL)
+static unsigned int CPUs()
+{
+	long n=sysconf(_SC_NPROCESSORS_ONLN);
+	return n>0 ? (unsigned int) n : 1;
+}
 #endif
 
 template<void (*_free)(void *)> void wrapfree(void *mem, size_t size)
@@ -111,108 +138,338 @@ struct Allocator
 {
 	const char *name, *shortname;
 	size_t minsize, minsizeshift;
-	bool traverse;
+	bool traverse, threadsafe;
 	void *(*malloc)(size_t);
 	void (*free)(void *, size_t);
 };
 static Allocator allocators[]={
-	{ "System allocator", "sysalloc", 0, 0, true, &malloc, &wrapfree<free> },
-	{ "nedmalloc", "nedmalloc", 0, 0, true, &nedalloc::nedmalloc, &wrapfree<nedalloc::nedfree> },
-	{ "dlmalloc", "dlmalloc", 0, 0, true, &dlmalloc, &dlfree },
+	{ "System allocator", "sysalloc", 0, 0, true, true, &malloc, &wrapfree<free> },
+	{ "nedmalloc", "nedmalloc", 0, 0, true, true, &nedalloc::nedmalloc, &wrapfree<nedalloc::nedfree> },
+	{ "dlmalloc", "dlmalloc", 0, 0, true, false, &dlmalloc, &dlfree },
 #ifndef WIN32
-	{ "System mmap()", "sysmmap", PAGE_SIZE, 0, true, &mmap_wrapper, &munmap_wrapper },
-	{ "System mmap(MAP_POPULATE)", "sysmmappop", PAGE_SIZE, 0, true, &mmappop_wrapper, &munmap_wrapper },
-	{ "System mmap(MAP_POPULATE, notraverse)", "sysmmappop_notraverse", PAGE_SIZE, 0, false, &mmappop_wrapper, &munmap_wrapper },
+	{ "System mmap()", "sysmmap", PAGE_SIZE, 0, true, true, &mmap_wrapper, &munmap_wrapper },
+	{ "System mmap(MAP_POPULATE)", "sysmmappop", PAGE_SIZE, 0, true, true, &mmappop_wrapper, &munmap_wrapper },
+	{ "System mmap(MAP_POPULATE, notraverse)", "sysmmappop_notraverse", PAGE_SIZE, 0, false, true, &mmappop_wrapper, &munmap_wrapper },
 #else
-	{ "System VirtualAlloc()", "sysmmap", PAGE_SIZE, 0, true, &mmap_wrapper, &munmap_wrapper },
+	{ "System VirtualAlloc()", "sysmmap", PAGE_SIZE, 0, true, true, &mmap_wrapper, &munmap_wrapper },
 #endif
-	{ "User mode page allocator", "usermodemmap", PAGE_SIZE, 0, true, &userpagemalloc_wrapper, &userpagefree_wrapper },
-	{ "User mode page allocator (notraverse)", "usermodemmap_notraverse", PAGE_SIZE, 0, true, &userpagemalloc_wrapper, &userpagefree_wrapper },
-	{ "Nothing", "nothing", 0, 0, false, &nothing_malloc, &nothing_free }
+	{ "User mode page allocator", "usermodemmap", PAGE_SIZE, 0, true, false, &userpagemalloc_wrapper, &userpagefree_wrapper },
+	{ "User mode page allocator (notraverse)", "usermodemmap_notraverse", PAGE_SIZE, 0, true, false, &userpagemalloc_wrapper, &userpagefree_wrapper },
+	{ "Nothing", "nothing", 0, 0, false, true, &nothing_malloc, &nothing_free }
 };
 
-int main(void)
+/* Latencies in nanoseconds are counted in log-linear buckets in the style of HdrHistogram.
+Below 2^HISTOGRAM_SUBBITS they are exact, and above that each power of two is split into
+2^(HISTOGRAM_SUBBITS-1) buckets, so each is kept to within 1.6% */
+#define HISTOGRAM_SUBBITS 7
+#define HISTOGRAM_BUCKETS ((34-HISTOGRAM_SUBBITS)<<(HISTOGRAM_SUBBITS-1))
+struct Histogram
 {
-	using namespace std;
-	printf("What would you like to test?\n");
-	for(unsigned n=0; n<sizeof(allocators)/sizeof(Allocator); n++)
+	std::vector<size_t> counts;
+	size_t count;
+	usCount total;
+	unsigned int max;
+	Histogram() : counts(HISTOGRAM_BUCKETS), count(0), total(0), max(0) { }
+	static size_t bucket(unsigned int v)
+	{
+		unsigned int shift=0;
+		while(v>>shift>=(1U<<HISTOGRAM_SUBBITS)) shift++;
+		return ((size_t) shift<<(HISTOGRAM_SUBBITS-1))+(v>>shift);
+	}
+	static unsigned int highest(size_t idx)
+	{	/* The largest value counted in bucket idx */
+		if(idx<(1U<<HISTOGRAM_SUBBITS)) return (unsigned int) idx;
+		unsigned int shift=(unsigned int)(idx>>(HISTOGRAM_SUBBITS-1))-1;
+		return (unsigned int)(((idx-((size_t) shift<<(HISTOGRAM_SUBBITS-1))+1)<<shift)-1);
+	}
+	void record(usCount ns)
+	{
+		unsigned int v=ns>0xffffffff ? 0xffffffff : (unsigned int) ns;
+		counts[bucket(v)]++;
+		count++;
+		total+=v;
+		if(v>max) max=v;
+	}
+	void add(const Histogram &o)
 	{
-		printf("   %u. %s\n", n+1, allocators[n].name);
+		for(size_t n=0; n<HISTOGRAM_BUCKETS; n++)
+			counts[n]+=o.counts[n];
+		count+=o.count;
+		total+=o.total;
+		if(o.max>max) max=o.max;
 	}
-	unsigned allocatoridx=getchar()-'1';
-	if(allocatoridx>sizeof(allocators)/sizeof(Allocator)) return 1;
-	Allocator &allocator=allocators[allocatoridx];
-	allocator.minsizeshift=allocator.minsize ? nedtriebitscanr(allocator.minsize) : (allocator.minsize=1<<3, 3);
-	printf("\nYou chose allocator %u (%s) with minsizeshift=%lu\n", allocatoridx+1, allocator.name, (unsigned long) allocator.minsizeshift);
-	//if(allocator.malloc==&userpagemalloc_wrapper)
+	unsigned int percentile(double p) const
 	{
-		//printf("Preallocating user mode page allocator memory ... \n");
-		//userpage_free(userpage_malloc(3ULL*1024*1024*1024, 0), 3ULL*1024*1024*1024);
+		size_t target=(size_t) ceil(p*count), seen=0;
+		if(!count) return 0;
+		if(!target) target=1;
+		for(size_t n=0; n<HISTOGRAM_BUCKETS; n++)
+			if((seen+=counts[n])>=target)
+				return highest(n)<max ? highest(n) : max;
+		return max;
 	}
-	for(usCount s=GetUsCount(); GetUsCount()-s<3000000000000ULL;);
-	printf("Testing ...\n");
+};
 
-	vector<pair<usCount, size_t> > bins(nedtriebitscanr(MAXBLOCKSIZE)+1);
+enum Distribution
+{
+	DIST_LOG,		/* What this test has always done */
+	DIST_SMALL,		/* Log uniform up to 1Kb, like most C++ objects */
+	DIST_UNIFORM
+};
+static const char *distributions[]={ "log", "small", "uniform" };
+
+struct ScalingThread
+{
+	std::vector<Histogram> mallocs, frees;	/* Per power of two bin */
+	unsigned int seed;
+	THREADVAR thread;
+};
+static Allocator *testallocator;
+static Distribution distribution=DIST_LOG;
+static int loops=LOOPS;
+static std::vector<ScalingThread> threads;
+
+static inline unsigned int rnd(unsigned int &seed)
+{	/* xorshift32, as rand() isn't threadsafe */
+	seed^=seed<<13;
+	seed^=seed>>17;
+	seed^=seed<<5;
+	return seed;
+}
+static size_t blocksize(unsigned int &seed)
+{
+	size_t blksize, smallshift=testallocator->minsizeshift<10 ? 10 : testallocator->minsizeshift+1;
+	do
+	{
+		double randval=rnd(seed)/4294967296.0;
+		switch(distribution)
+		{
+		case DIST_LOG:
+			blksize=((size_t) pow(2, randval*8*sizeof(size_t)+testallocator->minsizeshift)) & (MAXBLOCKSIZE-1);
+			break;
+		case DIST_SMALL:
+			blksize=(size_t) pow(2, testallocator->minsizeshift+randval*(smallshift-testallocator->minsizeshift));
+			break;
+		default:
+			blksize=testallocator->minsize+(size_t)(randval*(MAXBLOCKSIZE-testallocator->minsize));
+			break;
+		}
+		blksize&=~(testallocator->minsize-1);
+	} while(blksize<testallocator->minsize);
+	return blksize;
+}
+static void scalingtest(ScalingThread &t)
+{
 	struct Ptrs_t { void *mem; size_t size; } ptrs[512], *ptrp;
 	memset(ptrs, 0, sizeof(ptrs));
 	ptrp=ptrs;
-	for(int n=0; n<LOOPS; n++)
+	for(int n=0; n<loops; n++)
 	{
-		size_t blksize;
-		do
-		{
-			double randval=(double) rand()/(RAND_MAX/(8*sizeof(size_t)))+allocator.minsizeshift;
-			blksize=((size_t) pow(2, randval)) & (MAXBLOCKSIZE-1);
-			blksize&=~(allocator.minsize-1);
-		} while(blksize<allocator.minsize);
+		size_t blksize=blocksize(t.seed);
 		usCount start, end;
-		if(n>LOOPS/2 && blksize<32)
-		{
-			int a=1;
-		}
 		if(ptrp->mem)
 		{
 			start=GetUsCount();
-			allocator.free(ptrp->mem, ptrp->size);
+			testallocator->free(ptrp->mem, ptrp->size);
 			end=GetUsCount();
-			pair<usCount, size_t> &v=bins[nedtriebitscanr(ptrp->size)];
-			v.first+=end-start;
+			t.frees[nedtriebitscanr(ptrp->size)].record((end-start)/1000);
 			ptrp->mem=0; ptrp->size=0;
 		}
 		start=GetUsCount();
-		ptrp->mem=allocator.malloc(blksize);
+		ptrp->mem=testallocator->malloc(blksize);
 		ptrp->size=blksize;
-		//if(allocator.malloc!=&userpagemalloc_wrapper)
+		if(ptrp->mem && testallocator->traverse)
 		{
-			if(ptrp->mem && allocator.traverse)
-			{
-				for(volatile char *p=(volatile char *)ptrp->mem, *pend=(volatile char *)ptrp->mem+blksize; p<pend; p+=PAGE_SIZE)
-					*p=1;
-			}
+			for(volatile char *p=(volatile char *)ptrp->mem, *pend=(volatile char *)ptrp->mem+blksize; p<pend; p+=PAGE_SIZE)
+				*p=1;
 		}
 		end=GetUsCount();
 		if(++ptrp==ptrs+512) ptrp=ptrs;
-		pair<usCount, size_t> &v=bins[blksize ? nedtriebitscanr(blksize) : 0];
-		v.first+=end-start;
-		v.second++;
+		t.mallocs[blksize ? nedtriebitscanr(blksize) : 0].record((end-start)/1000);
+	}
+	for(ptrp=ptrs; ptrp<ptrs+512; ptrp++)
+		if(ptrp->mem) testallocator->free(ptrp->mem, ptrp->size);
+}
+#ifdef WIN32
+static DWORD WINAPI _threadcode(LPVOID a)
+#else
+static void *_threadcode(void *a)
+#endif
+{
+	scalingtest(*(ScalingThread *) a);
+	return 0;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-a <allocator>] [-t <threads>|<from>-<to>|cores] [-d log|small|uniform] [-l <loops per thread>] [-w <warm up ms>] [-o <csv file>|-]\n\n"
+		"A range of threads runs with each power of two from the first to the last, and cores is 1-%u.\nAllocators are", argv0, CPUs());
+	for(unsigned n=0; n<sizeof(allocators)/sizeof(Allocator); n++)
+		fprintf(stderr, " %s", allocators[n].shortname);
+	fprintf(stderr, ".\n");
+}
+
+int main(int argc, char *argv[])
+{
+	using namespace std;
+	vector<unsigned int> threadcounts;
+	const char *csvfile=0;
+	unsigned int warmup=0, allocatoridx=(unsigned int) -1;
+	if(argc<2)
+	{
+		printf("What would you like to test?\n");
+		for(unsigned n=0; n<sizeof(allocators)/sizeof(Allocator); n++)
+		{
+			printf("   %u. %s\n", n+1, allocators[n].name);
+		}
+		allocatoridx=getchar()-'1';
+		if(allocatoridx>=sizeof(allocators)/sizeof(Allocator)) return 1;
+		warmup=3000;
+	}
+	for(int i=1; i<argc; i++)
+	{
+		const char *arg=argv[i+1];
+		if(i+1==argc || argv[i][0]!='-' || !argv[i][1] || argv[i][2])
+		{
+			usage(argv[0]);
+			return 1;
+		}
+		switch(argv[i++][1])
+		{
+		case 'a':
+			for(allocatoridx=0; allocatoridx<sizeof(allocators)/sizeof(Allocator) && strcmp(arg, allocators[allocatoridx].shortname); allocatoridx++);
+			if(allocatoridx==sizeof(allocators)/sizeof(Allocator))
+			{
+				fprintf(stderr, "Unknown allocator %s\n", arg);
+				return 1;
+			}
+			break;
+		case 't':
+		{
+			char *end;
+			unsigned int from=1, to=CPUs();
+			if(strcmp(arg, "cores"))
+			{
+				from=to=(unsigned int) strtoul(arg, &end, 10);
+				if('-'==*end) to=(unsigned int) strtoul(end+1, &end, 10);
+				if(*end || !from || to<from)
+				{
+					fprintf(stderr, "Bad thread count %s\n", arg);
+					return 1;
+				}
+			}
+			for(unsigned int n=from; n<to; n*=2)
+				threadcounts.push_back(n);
+			threadcounts.push_back(to);
+			break;
+		}
+		case 'd':
+		{
+			unsigned int n;
+			for(n=0; n<sizeof(distributions)/sizeof(distributions[0]) && strcmp(arg, distributions[n]); n++);
+			if(n==sizeof(distributions)/sizeof(distributions[0]))
+			{
+				fprintf(stderr, "Unknown distribution %s\n", arg);
+				return 1;
+			}
+			distribution=(Distribution) n;
+			break;
+		}
+		case 'l':
+			if((loops=atoi(arg))<=0)
+			{
+				fprintf(stderr, "Bad loop count %s\n", arg);
+				return 1;
+			}
+			break;
+		case 'w':
+			warmup=(unsigned int) atoi(arg);
+			break;
+		case 'o':
+			csvfile=arg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if(allocatoridx==(unsigned int) -1)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	if(threadcounts.empty()) threadcounts.push_back(1);
+	testallocator=&allocators[allocatoridx];
+	testallocator->minsizeshift=testallocator->minsize ? nedtriebitscanr(testallocator->minsize) : (testallocator->minsize=1<<3, 3);
+	if(!testallocator->threadsafe && threadcounts.back()>1)
+	{
+		fprintf(stderr, "%s can only be tested on one thread\n", testallocator->name);
+		return 1;
 	}
 	char filename[256];
-	sprintf(filename, "scalingtest%s_%s.csv",
+	if(!csvfile)
+	{
+		sprintf(filename, "scalingtest%s_%s.csv",
 #ifdef WIN32
-		"_win32",
+			"_win32",
 #else
-		"_posix",
+			"_posix",
 #endif
-		allocator.shortname);
-	printf("\nWriting results to %s ...\n", filename);
-	FILE *oh=fopen(filename, "w");
-	fprintf(oh, "Bin,Latency,Count\n");
-	int n=0;
-	for(vector<pair<usCount, size_t> >::const_iterator it=bins.begin(); it!=bins.end(); ++it, n++)
+			testallocator->shortname);
+		csvfile=filename;
+	}
+	FILE *oh=strcmp(csvfile, "-") ? fopen(csvfile, "w") : stdout;
+	if(!oh)
+	{
+		fprintf(stderr, "Couldn't open %s\n", csvfile);
+		return 1;
+	}
+	FILE *info=oh==stdout ? stderr : stdout;		/* Keep the CSV clean when it goes to stdout */
+	fprintf(info, "\nYou chose allocator %u (%s) with minsizeshift=%lu and %s block sizes\n", allocatoridx+1, testallocator->name, (unsigned long) testallocator->minsizeshift, distributions[distribution]);
+	for(usCount s=GetUsCount(); GetUsCount()-s<warmup*1000000000ULL;);
+	fprintf(oh, "Threads,Bin,Op,Count,Average,p50,p99,p99.9,Max\n");
+	for(vector<unsigned int>::const_iterator tc=threadcounts.begin(); tc!=threadcounts.end(); ++tc)
+	{
+		vector<Histogram> mallocs(nedtriebitscanr(MAXBLOCKSIZE)+1), frees(mallocs.size());
+		Histogram allmallocs, allfrees;
+		unsigned int n;
+		fprintf(info, "Testing with %u threads ...\n", *tc);
+		threads.clear();
+		threads.resize(*tc);
+		for(n=0; n<*tc; n++)
+		{
+			threads[n].mallocs.resize(mallocs.size());
+			threads[n].frees.resize(frees.size());
+			threads[n].seed=n*2654435761U+1;
+		}
+		for(n=0; n<*tc; n++)
+			THREADINIT(&threads[n].thread, &threads[n]);
+		for(n=0; n<*tc; n++)
+			THREADWAIT(threads[n].thread);
+		for(n=0; n<*tc; n++)
+			for(size_t b=0; b<mallocs.size(); b++)
+			{
+				mallocs[b].add(threads[n].mallocs[b]);
+				frees[b].add(threads[n].frees[b]);
+			}
+		for(size_t b=0; b<mallocs.size(); b++)
+		{
+			const Histogram *h[2]={ &mallocs[b], &frees[b] };
+			for(int op=0; op<2; op++)
+				if(h[op]->count)
+					fprintf(oh, "%u,%u,%s,%lu,%f,%u,%u,%u,%u\n", *tc, 1<<b, op ? "free" : "malloc", (unsigned long) h[op]->count,
+						(double) h[op]->total/h[op]->count, h[op]->percentile(0.5), h[op]->percentile(0.99), h[op]->percentile(0.999), h[op]->max);
+			allmallocs.add(mallocs[b]);
+			allfrees.add(frees[b]);
+		}
+		fprintf(info, "   malloc latency (ns): p50 %u, p99 %u, p99.9 %u, max %u\n", allmallocs.percentile(0.5), allmallocs.percentile(0.99), allmallocs.percentile(0.999), allmallocs.max);
+		fprintf(info, "   free latency (ns):   p50 %u, p99 %u, p99.9 %u, max %u\n", allfrees.percentile(0.5), allfrees.percentile(0.99), allfrees.percentile(0.999), allfrees.max);
+	}
+	if(oh!=stdout)
 	{
-		fprintf(oh, "%u,%f,%lu\n", 1<<n, (double) it->first/it->second, (unsigned long) it->second);
+		fprintf(info, "\nWrote results to %s\n", csvfile);
+		fclose(oh);
 	}
-	fclose(oh);
-	printf("Done!\n");
+	fprintf(info, "Done!\n");
 	return 0;
 }
@@ -0,0 +1,43 @@
+/* smallobjtest.cpp
+Measures the memory overhead of holding millions of small objects. Build once as
+is and once with -DSMALLBLKMAX=0 to compare against plain dlmalloc chunks.
+*/
+
+#include "nedmalloc.c"
+#include <vector>
+
+#define BLOCKS (4*1024*1024)
+#define MINBLOCKSIZE 16
+#define MAXBLOCKSIZE 64
+
+using namespace nedalloc;
+
+int main(int argc, char *argv[])
+{
+	nedpool *pool=nedcreatepool(0, 1);
+	std::vector<void *> blocks(BLOCKS);
+	size_t n, requested=0, footprint, inuse;
+	unsigned int seed=1;
+	printf("Allocating %u blocks of %u-%u bytes with SMALLBLKMAX=%u ...\n", (unsigned) BLOCKS, MINBLOCKSIZE, MAXBLOCKSIZE, (unsigned) SMALLBLKMAX);
+	for(n=0; n<BLOCKS; n++)
+	{
+		size_t size;
+		seed=seed*1103515245+12345;
+		size=MINBLOCKSIZE+((seed>>16) % (MAXBLOCKSIZE-MINBLOCKSIZE+1));
+		if(!(blocks[n]=nedpmalloc(pool, size)))
+		{
+			fprintf(stderr, "Out of memory after %u blocks\n", (unsigned) n);
+			return 1;
+		}
+		requested+=size;
+	}
+	footprint=nedpmalloc_footprint(pool);
+	inuse=nedpmallinfo(pool).uordblks;
+	printf("Requested: %.1f Mb\n", requested/1048576.0);
+	printf("In use:    %.1f Mb (%.1f%% overhead)\n", inuse/1048576.0, 100.0*(inuse-requested)/requested);
+	printf("Footprint: %.1f Mb (%.1f%% overhead)\n", footprint/1048576.0, 100.0*(footprint-requested)/requested);
+	for(n=0; n<BLOCKS; n++)
+		nedpfree(pool, blocks[n]);
+	neddestroypool(pool);
+	return 0;
+}
@@ -236,6 +236,15 @@ int main(void)
 		SSEVectorType *foo2=New<SSEVectorType, std::allocator<SSEVectorType> >(4, 5, 6, 7);
 		Delete<std::allocator<SSEVectorType> >(foo2);
 
+		/* When you need many objects at once, NewArray<type>(n, ...)
+		allocates them next to one another in one trip into the pool
+		and constructs them all, yet each can still be Delete()d on its
+		own. NewBatch() does the same for one object each of several
+		types. */
+		UIntish **foo3=NewArray<UIntish>(1000, 0);
+		DeleteArray(foo3, 1000);
+		nedfree(foo3);
+
 
 
 		/* Here comes the real magic! Let us try comparing the
@@ -251,6 +260,16 @@ int main(void)
 			nedpolicy::reserveN<26>::policy			// 1<<26 = 64Mb. 10,000,000 * sizeof(unsigned int) = 38Mb.
 		>::value>("nedallocatorise<vector, UIntish, nedpolicy::typeIsPOD<true>>");
 
+		/* nedvector<> grows POD types with realloc, so with address space
+		reserved a large vector is extended in place rather than copied */
+		test<nedvector<UIntish,
+			nedpolicy::typeIsPOD<true>::policy
+		> >("nedvector<UIntish, nedpolicy::typeIsPOD<true>>");
+		test<nedvector<UIntish,
+			nedpolicy::typeIsPOD<true>::policy,
+			nedpolicy::reserveN<26>::policy
+		> >("nedvector<UIntish, nedpolicy::typeIsPOD<true>, nedpolicy::reserveN<26>>");
+
 		printf("\nPress a key to trim\n");
 		getchar();
 		nedmalloc_trim(0);
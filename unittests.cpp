@@ -6,14 +6,37 @@ Catch various bugs reported over the years
 #define NEDMALLOCDEPRECATED
 #define NEDMALLOC_DEBUG 1
 #define FULLSANITYCHECKS
+#if __cplusplus > 199711L
+#define HAVE_CPP0XTHREADLOCAL 1		/* Opts in to nedpolicy::nodepool */
+#endif
 
 #include "nedmalloc.h"
 #include <stdio.h>
+#include <string.h>
+#include <list>
+#include <map>
+#include <string>
 #include <vector>
+#ifdef HAVE_CPP0XTHREADLOCAL
+#include <set>
+#include <thread>
+#endif
 
 #if !defined(USE_NEDMALLOC_DLL)
 #include "nedmalloc.c"
 #endif
+#include "nedmalloc_new.cpp"
+
+// Counts live instances and can be told to throw from its constructor
+struct counted
+{
+  static int live, throwat;
+  size_t value;
+  counted(size_t v=1) : value(v) { if(live==throwat) throw std::bad_alloc(); live++; }
+  counted(const counted &o) : value(o.value) { live++; }
+  ~counted() { live--; }
+};
+int counted::live=0, counted::throwat=-1;
 
 int main(void)
 {
@@ -60,6 +83,573 @@ int main(void)
     }
   }
 
+  // Large blocks should be recycled from the mmap cache rather than remapped
+  printf("Testing: Freed large blocks are reused from the mmap cache ...\n");
+  {
+    const size_t size=1024*1024;
+    nedpool *pool=nedcreatepool(0, 1);
+    size_t footprint;
+    unsigned char *a, *b;
+    // An ordinary free caches the block though it raises the mmap threshold past it,
+    // and the next malloc of that size gets it straight back
+    if(!(a=(unsigned char *) nedpmalloc(pool, size))) abort();
+    if(!is_mmapped(mem2chunk(a))) abort();
+    nedpfree(pool, a);
+    footprint=nedpmalloc_footprint(pool);
+    if(!(b=(unsigned char *) nedpmalloc(pool, size))) abort();
+    if(b!=a || !is_mmapped(mem2chunk(b))) abort();
+    if(nedpmalloc_footprint(pool)!=footprint) abort();
+    nedpfree(pool, b);
+    // As are blocks which must be mmapped
+    if(!(a=(unsigned char *) nedpmalloc2(pool, size, 0, M2_ALWAYS_MMAP))) abort();
+    memset(a, 0xaa, size);
+    nedpfree(pool, a);
+    footprint=nedpmalloc_footprint(pool);
+    if(!(b=(unsigned char *) nedpmalloc2(pool, size, 0, M2_ALWAYS_MMAP|M2_ZERO_MEMORY))) abort();
+    if(b!=a) abort();
+    for(size_t n=0; n<size; n++)
+      if(b[n]) abort();
+    if(nedpmalloc_footprint(pool)!=footprint) abort();
+    nedpfree(pool, b);
+    nedpmalloc_trim(pool, 0);
+    if(nedpmalloc_footprint(pool)>=footprint) abort();
+    neddestroypool(pool);
+  }
+
+  // Freeing a directly mmapped block should raise that mspace's mmap threshold
+  printf("Testing: Dynamic mmap threshold stops repeated mmapping ...\n");
+  {
+    const size_t size=3*512*1024;
+    nedpool *pool=nedcreatepool(0, 1);
+    void *a, *b;
+    if(!(a=nedpmalloc(pool, size))) abort();
+    if(!is_mmapped(mem2chunk(a))) abort();
+    nedpfree(pool, a);
+    if(!(b=nedpmalloc(pool, size/2))) abort();
+    if(is_mmapped(mem2chunk(b))) abort();
+    nedpfree(pool, b);
+    // Repeating the cycle recycles the cached block rather than mapping or growing the pool
+    size_t footprint=nedpmalloc_footprint(pool);
+    for(int n=0; n<30; n++)
+    {
+      if(!(b=nedpmalloc(pool, size)) || b!=a) abort();
+      nedpfree(pool, b);
+    }
+    if(nedpmalloc_footprint(pool)!=footprint) abort();
+    neddestroypool(pool);
+  }
+
+#ifdef __linux__
+  // M2_PREFAULT should leave every page of both segment and mmapped blocks resident
+  printf("Testing: M2_PREFAULT populates pages up front ...\n");
+  {
+    const size_t sizes[]={512*1024, 4*1024*1024};
+    const size_t pagesize=(size_t) sysconf(_SC_PAGESIZE);
+    nedpool *pool=nedcreatepool(0, 1);
+    for(size_t n=0; n<2; n++)
+    {
+      char *a, *start;
+      if(!(a=(char *) nedpmalloc2(pool, sizes[n], 0, M2_PREFAULT))) abort();
+      start=(char *)((size_t) a & ~(pagesize-1));
+      vector<unsigned char> resident((a+sizes[n]-start+pagesize-1)/pagesize);
+      if(mincore(start, a+sizes[n]-start, &resident.front())) abort();
+      for(size_t m=0; m<resident.size(); m++)
+        if(!(resident[m]&1)) abort();
+      nedpfree(pool, a);
+    }
+    neddestroypool(pool);
+  }
+#endif
+
+  // A pool reserving its capacity must stay within it, fail when exhausted and trim within it
+  printf("Testing: Pools reserving their capacity up front ...\n");
+  {
+    const size_t capacity=8*1024*1024, size=256*1024;
+    nedpool *pool=nedcreatepool2(capacity, 1, NP_RESERVE_CAPACITY);
+    vector<void *> blocks;
+    size_t footprint;
+    char *mem;
+    if(!pool) abort();
+    while((mem=(char *) nedpmalloc(pool, size)))
+    {
+      if(mem<pool->reservation || mem+size>pool->reservation+pool->reservationsize) abort();
+      memset(mem, 0xff, size);
+      blocks.push_back(mem);
+    }
+    if(blocks.size()<capacity/size/2) abort();
+    footprint=nedpmalloc_footprint(pool);
+    if(footprint>capacity) abort();
+    for(size_t n=0; n<blocks.size(); n++)
+      nedpfree(pool, blocks[n]);
+    nedpmalloc_trim(pool, 0);
+    if(nedpmalloc_footprint(pool)>=footprint) abort();
+    if(!(mem=(char *) nedpmalloc(pool, capacity/2))) abort();
+    if(mem<pool->reservation || mem+capacity/2>pool->reservation+pool->reservationsize) abort();
+    memset(mem, 0xff, capacity/2);
+    nedpfree(pool, mem);
+    neddestroypool(pool);
+    // One thread can use the shares of all the mspaces, not just its own
+    pool=nedcreatepool2(capacity, 4, NP_RESERVE_CAPACITY);
+    if(!pool) abort();
+    blocks.clear();
+    while((mem=(char *) nedpmalloc(pool, size)))
+    {
+      if(mem<pool->reservation || mem+size>pool->reservation+pool->reservationsize) abort();
+      blocks.push_back(mem);
+    }
+    if(blocks.size()<capacity/size/2) abort();
+    for(size_t n=0; n<blocks.size(); n++)
+      nedpfree(pool, blocks[n]);
+    neddestroypool(pool);
+  }
+
+#if USE_PAGEMAP && !USE_MAGIC_HEADERS
+  // The page map must tell pool blocks from foreign memory exactly
+  printf("Testing: Block ownership is looked up in the page map ...\n");
+  {
+    nedpool *pool=nedcreatepool(0, 1), *owner=0;
+    char stackbuf[64];
+    void *foreign=::malloc(64), *small, *large;
+    int isforeign=0;
+    if(!pool || !foreign) abort();
+    nedpsetvalue(pool, (void *) pool);
+    if(nedblksize(&isforeign, foreign) || !isforeign) abort();
+    if(nedblksize(&isforeign, stackbuf) || !isforeign) abort();
+    if(nedgetvalue(&owner, foreign) || nedgetvalue(&owner, stackbuf) || owner) abort();
+    small=nedpmalloc(pool, 64);
+    large=nedpmalloc2(pool, 4*1024*1024, 0, M2_ALWAYS_MMAP);
+    if(!small || !large) abort();
+    if(nedblksize(&isforeign, small)<64 || isforeign) abort();
+    if(nedblksize(&isforeign, large)<4*1024*1024 || isforeign) abort();
+    if(nedgetvalue(&owner, small)!=pool || owner!=pool) abort();
+    if(nedgetvalue(&owner, large)!=pool || owner!=pool) abort();
+    nedpfree(pool, large);
+    nedpmalloc_trim(pool, 0);
+    if(nedblksize(&isforeign, large) || !isforeign) abort();
+    nedpfree(pool, small);
+    neddestroypool(pool);
+    ::free(foreign);
+  }
+#endif
+
+#if SMALLBLKMAX
+  // Small blocks are packed without chunk headers and found through the page map
+  printf("Testing: Small blocks are packed without headers ...\n");
+  {
+    nedpool *pool=nedcreatepool(0, 1), *owner=0;
+    vector<char *> blocks;
+    size_t adjacent=0;
+    int isforeign=1;
+    char *mem;
+    if(!pool) abort();
+    nedpsetvalue(pool, (void *) pool);
+    for(size_t n=0; n<10000; n++)
+    {
+      if(!(mem=(char *) nedpmalloc(pool, 16))) abort();
+      if(!blocks.empty() && mem==blocks.back()+16) adjacent++;
+      memset(mem, (int) n, 16);
+      blocks.push_back(mem);
+    }
+    if(adjacent<blocks.size()*9/10) abort();
+    if(nedblksize(&isforeign, blocks[0])!=16 || isforeign) abort();
+    if(nedgetvalue(&owner, blocks[0])!=pool || owner!=pool) abort();
+    if(!(mem=(char *) nedprealloc(pool, blocks[1], 4096))) abort();
+    if(mem[0]!=1 || mem[15]!=1) abort();
+    blocks[1]=mem;
+    for(size_t n=0; n<blocks.size(); n++)
+      nedpfree(pool, blocks[n]);
+#if THREADCACHEMAX
+    // Freed small blocks wait in the thread cache, so most mallocs never lock the mspace
+    struct nedstats *stats=new struct nedstats;
+    if(!(mem=(char *) nedpmalloc(pool, 16))) abort();
+    if(!nedpgetstats(pool, stats) || !stats->cached) abort();
+    if(stats->bin[0].blocksize!=16 || stats->bin[0].hits<blocks.size()*9/10) abort();
+    nedpfree(pool, mem);
+    delete stats;
+#endif
+    neddestroypool(pool);
+  }
+#endif
+
+  // Reallocs grow into free successors and shrink in place, and small shrinks are noops
+  printf("Testing: Realloc resizes in place where it can ...\n");
+  {
+    nedpool *pool=nedcreatepool(0, 1);
+    const size_t size=64*1024;
+    char *a, *b, *c, *mem;
+    size_t blksize;
+    if(!pool) abort();
+    if(!(a=(char *) nedpmalloc(pool, size)) || !(b=(char *) nedpmalloc(pool, size)) || !(c=(char *) nedpmalloc(pool, size))) abort();
+    memset(a, 'a', size);
+    nedpfree(pool, b);
+    if(!(mem=(char *) nedprealloc(pool, a, size*3/2)) || mem!=a) abort();
+    if(nedblksize(0, a)<size*3/2 || a[0]!='a' || a[size-1]!='a') abort();
+    if(!(mem=(char *) nedprealloc(pool, a, size/2)) || mem!=a) abort();
+    if((blksize=nedblksize(0, a))>=size) abort();
+    if(!(mem=(char *) nedprealloc(pool, a, blksize-blksize/16)) || mem!=a || nedblksize(0, a)!=blksize) abort();
+    if(a[0]!='a' || a[size/2-1]!='a') abort();
+    nedpfree(pool, a);
+    nedpfree(pool, c);
+    neddestroypool(pool);
+  }
+
+  // Thread cache hits and direct mmaps are counted and serialised
+  printf("Testing: Pool statistics ...\n");
+  {
+    nedpool *pool=nedcreatepool(0, 1);
+    struct nedstats *stats=new struct nedstats;
+    vector<char> json;
+    void *mem, *big;
+    size_t len;
+    if(!pool) abort();
+    if(!(mem=nedpmalloc(pool, 1024))) abort();
+    nedpfree(pool, mem);
+    if(!(mem=nedpmalloc(pool, 1024))) abort();
+    if(!(big=nedpmalloc(pool, 8*1024*1024))) abort();
+    nedpfree(pool, big);
+    if(!nedpgetstats(pool, stats)) abort();
+#if THREADCACHEMAX
+    if(stats->threadcaches!=1 || stats->threadcache[0].successes<1) abort();
+    if(stats->bin[6].blocksize!=1024 || stats->bin[6].hits<1 || stats->bin[6].misses<1) abort();
+#endif
+    if(!stats->mspaces || stats->mspace[0].mmapallocs<1 || stats->mspace[0].mmapfrees<1) abort();
+    if(stats->footprint<stats->inuse || stats->inuse<1024) abort();
+    len=nedstatsjson(stats, 0, 0);
+    json.resize(len+1);
+    if(nedstatsjson(stats, &json[0], 16)!=len || json[15] || json[0]!='{') abort();
+    if(nedstatsjson(stats, &json[0], json.size())!=len || json[len-1]!='}' || !strstr(&json[0], "\"mmapallocs\":")) abort();
+    nedpfree(pool, mem);
+    // Each trim which gives memory back counts once
+    {
+      vector<void *> blocks;
+      size_t trims=stats->mspace[0].trims;
+      for(size_t n=0; n<4096; n++)
+        blocks.push_back(nedpmalloc(pool, 4000));
+      for(size_t n=0; n<blocks.size(); n++)
+        nedpfree(pool, blocks[n]);
+      nedpmalloc_trim(pool, 0);
+      if(!nedpgetstats(pool, stats) || stats->mspace[0].trims!=trims+1 || !stats->mspace[0].trimmed) abort();
+    }
+    delete stats;
+    neddestroypool(pool);
+  }
+
+  // Free chunks left between live ones show up in the fragmentation report
+  printf("Testing: Fragmentation report ...\n");
+  {
+    nedpool *pool=nedcreatepool(0, 1);
+    vector<void *> blocks;
+    vector<char> json;
+    size_t len;
+    if(!pool) abort();
+    neddisablethreadcache(pool);
+    for(size_t n=0; n<4096; n++)
+      blocks.push_back(nedpmalloc(pool, 512));
+    for(size_t n=0; n<blocks.size(); n+=2)
+      nedpfree(pool, blocks[n]);
+    len=nedpfragreport(pool, 0, 0);
+    json.resize(len+4096);
+    if(!(len=nedpfragreport(pool, &json[0], json.size())) || len>=json.size()) abort();
+    if(strncmp(&json[0], "{\"mspaces\":[{", 13) || json[len-1]!='}') abort();
+    if(!strstr(&json[0], "\"largestfree\":") || !strstr(&json[0], "{\"size\":512,\"count\":")) abort();
+    for(size_t n=1; n<blocks.size(); n+=2)
+      nedpfree(pool, blocks[n]);
+    neddestroypool(pool);
+  }
+
+#if NEDMALLOC_HEAPPROFILE
+  // Sampled live blocks are written out and dropped when freed
+  printf("Testing: Heap profile samples allocations ...\n");
+  {
+    vector<void *> blocks;
+    unsigned long long inuse, inusebytes, allocs, allocbytes;
+    FILE *ih;
+    for(size_t n=0; n<(64*NEDMALLOC_HEAPPROFILE)/4096; n++)
+      blocks.push_back(nedmalloc(4096));
+    if(!nedheapprofile_dump("unittests.heap")) abort();
+    if(!(ih=fopen("unittests.heap", "r"))) abort();
+    if(4!=fscanf(ih, "heap profile: %llu: %llu [%llu: %llu]", &inuse, &inusebytes, &allocs, &allocbytes)) abort();
+    fclose(ih);
+    if(inuse<32 || inuse>128 || inusebytes<inuse*4096) abort();
+    for(size_t n=0; n<blocks.size(); n++)
+      nedfree(blocks[n]);
+    if(!nedheapprofile_dump("unittests.heap")) abort();
+    if(!(ih=fopen("unittests.heap", "r"))) abort();
+    if(4!=fscanf(ih, "heap profile: %llu: %llu [%llu: %llu]", &inuse, &inusebytes, &allocs, &allocbytes)) abort();
+    fclose(ih);
+    remove("unittests.heap");
+    if(inuse>8 || allocs<32) abort();
+  }
+#endif
+
+  // Containers keep the pool they were given through copies, moves and swaps
+  printf("Testing: nedpoolallocator carries its pool ...\n");
+  {
+    typedef nedpoolallocator<size_t> alloc;
+    nedpool *pool1=nedcreatepool(0, 1), *pool2=nedcreatepool(0, 1);
+    struct nedstats *stats=new struct nedstats;
+    size_t baseline, settled=0;
+    if(!pool1 || !pool2) abort();
+    if(!nedpgetstats(pool2, stats)) abort();
+    baseline=stats->inuse;
+    // Small block runs stay with the pool once created, so the second pass must reuse the first's memory
+    for(int pass=0; pass<2; pass++)
+    {
+      {
+        alloc a1(pool1), a2(pool2);
+        nedpoolallocator<char> c1(pool1);
+        nedpoolallocator<char>::rebind<size_t>::other a3(c1);
+        if(a1==a2 || !(a1==a3) || a3.get_pool()!=pool1) abort();
+        if(!(c1==a1) || c1!=a1 || c1==a2 || !(a2!=c1)) abort();
+        vector<size_t, alloc> v1(a1), v2(a2);
+        for(size_t n=0; n<10000; n++)
+        {
+          v1.push_back(n);
+          v2.push_back(n);
+        }
+        if(!nedpgetstats(pool2, stats)) abort();
+        if(stats->inuse<baseline+10000*sizeof(size_t)) abort();
+        vector<size_t, alloc> v3(v1);
+        if(v3.get_allocator().get_pool()!=pool1) abort();
+        v3=v2;
+        if(v3.get_allocator().get_pool()!=pool2) abort();
+        v1.swap(v2);
+        if(v1.get_allocator().get_pool()!=pool2 || v2.get_allocator().get_pool()!=pool1 || v1[9999]!=9999) abort();
+      }
+      if(!nedpgetstats(pool2, stats)) abort();
+      if(!pass)
+        settled=stats->inuse;
+      else if(stats->inuse>settled+16*1024) abort();
+    }
+    delete stats;
+    neddestroypool(pool2);
+    neddestroypool(pool1);
+  }
+
+  // nedvector grows relocatable types in place and everything else by moving
+  printf("Testing: nedvector ...\n");
+  {
+    nedvector<size_t> a;
+    for(size_t n=0; n<100000; n++)
+      a.push_back(n);
+    if(a.size()!=100000 || a.capacity()<a.size() || a[99999]!=99999) abort();
+    a.shrink_to_fit();
+    a.push_back(a[7]);
+    if(a.back()!=7 || a[6]!=6) abort();
+    a.erase(a.begin()+10, a.begin()+20);
+    if(a.size()!=99991 || a[9]!=9 || a[10]!=20) abort();
+    size_t ins[3]={ 1, 2, 3 };
+    a.insert(a.begin()+1, ins, ins+3);
+    if(a[0]!=0 || a[1]!=1 || a[3]!=3 || a[4]!=1) abort();
+    nedvector<size_t, nedpolicy::reserveN<26>::policy> b;
+    for(size_t n=0; n<4000000; n++)
+      b.push_back(n);
+    if(b[3999999]!=3999999 || b[1234567]!=1234567) abort();
+
+    nedvector<string> c, d;
+    for(size_t n=0; n<1000; n++)
+      c.push_back(string(100, (char)('a'+n%26)));
+    d=c;
+    c.resize(10);
+    if(c.size()!=10 || d.size()!=1000 || d[999]!=string(100, (char)('a'+999%26))) abort();
+    d.swap(c);
+    if(c.size()!=1000 || d.size()!=10) abort();
+    // Elements passed back in while growing are copied before the old storage goes
+    d.shrink_to_fit();
+    while(d.size()<d.capacity())
+      d.push_back(d[0]);
+    d.push_back(d[1]);
+    if(d.back()!=d[1]) abort();
+#ifdef HAVE_CPP0XVARIADICTEMPLATES
+    while(d.size()<d.capacity())
+      d.push_back(d[0]);
+    d.emplace_back(d[2]);
+    if(d.back()!=d[2]) abort();
+#endif
+    // Popping never gives back capacity, and failing to grow under a policy which doesn't throw leaves the vector as it was
+    size_t capacity=a.capacity();
+    while(a.size()>10)
+      a.pop_back();
+    if(a.capacity()!=capacity) abort();
+    nedvector<size_t, nedpolicy::badalloc<void>::policy> g(3, 5);
+    g.resize(((size_t)-1)/64);
+    if(g.size()!=3 || g[2]!=5) abort();
+
+    {
+      nedvector<counted> e;
+      for(size_t n=0; n<100; n++)
+        e.push_back(counted(n));
+      nedvector<counted> f(e);
+      e.resize(50);
+      if(counted::live!=150 || f[99].value!=99) abort();
+    }
+    if(counted::live!=0) abort();
+  }
+
+#ifdef HAVE_CPP0XTHREADLOCAL
+  // Nodes come from slabs and are recycled through the freelist
+  printf("Testing: nodepool policy ...\n");
+  {
+    typedef pair<const size_t, size_t> value;
+    map<size_t, size_t, less<size_t>, nedallocator<value, nedpolicy::nodepool<64>::policy> > m;
+    list<size_t, nedallocator<size_t, nedpolicy::nodepool<64>::policy> > l;
+    for(size_t n=0; n<10000; n++)
+      m[(n*7919)%10007]=n;
+    for(size_t n=0; n<10007; n+=2)
+      m.erase(n);
+    for(size_t n=0; n<10000; n++)
+      m[(n*7919)%10007]=n;
+    if(m.size()!=10000 || m[7919]!=1) abort();
+    for(size_t n=0; n<8; n++)
+      l.push_back(n);
+    list<size_t, nedallocator<size_t, nedpolicy::nodepool<64>::policy> >::iterator it=l.begin();
+    const char *first=(const char *) &*it++, *second=(const char *) &*it;
+    if(second<=first || second-first>256) abort();
+    l.clear();
+    for(size_t n=0; n<1000; n++)
+      l.push_back(n);
+    if(l.size()!=1000 || l.back()!=999) abort();
+    // Nodes freed by another thread, including those it still holds when it exits, are reused
+    struct crossnode { size_t a, b; };
+    typedef nedallocator<crossnode, nedpolicy::nodepool<64>::policy> crossalloc;
+    crossalloc a;
+    vector<crossnode *> nodes;
+    set<crossnode *> seen;
+    for(size_t n=0; n<256; n++)
+    {
+      nodes.push_back(a.allocate(1));
+      seen.insert(nodes.back());
+    }
+    std::thread([&nodes] { crossalloc b; for(size_t n=0; n<nodes.size(); n++) b.deallocate(nodes[n], 1); }).join();
+    for(size_t n=0; n<256; n++)
+      if(!seen.count(nodes[n]=a.allocate(1))) abort();
+    for(size_t n=0; n<256; n++)
+      a.deallocate(nodes[n], 1);
+  }
+#endif
+
+  // Objects created together sit together and are destroyed individually or together
+  printf("Testing: NewArray and NewBatch ...\n");
+  {
+    counted *objs[100];
+#ifdef HAVE_CPP0XVARIADICTEMPLATES
+    const size_t value=5;
+    if(NewArray<counted>(100, objs, value)!=objs || counted::live!=100) abort();
+#else
+    const size_t value=1;
+    if(NewArray<counted>(100, objs)!=objs || counted::live!=100) abort();
+#endif
+    for(size_t n=1; n<100; n++)
+      if(objs[n]->value!=value || objs[n]<=objs[n-1] || (char *) objs[n]-(char *) objs[n-1]>64) abort();
+    Delete(objs[50]);
+    objs[50]=0;
+    DeleteArray(objs, 100);
+    if(counted::live!=0) abort();
+    counted **objs2=NewArray<counted>(10, 0);
+    if(!objs2 || counted::live!=10 || objs2[9]->value!=1) abort();
+    DeleteArray(objs2, 10);
+    nedfree(objs2);
+    counted::throwat=30;
+    try
+    {
+      NewArray<counted>(100, objs);
+      abort();
+    }
+    catch(bad_alloc &) { }
+    if(counted::live!=0) abort();
+    counted::throwat=-1;
+    // A policy which doesn't throw gets zero back from a failed batch
+    if(NewArray<counted, nedallocator<counted, nedpolicy::badalloc<void>::policy> >(((size_t)-1)/64, 0)!=0 || counted::live!=0) abort();
+#if defined(HAVE_CPP0XVARIADICTEMPLATES) && defined(HAVE_CPP0XRVALUEREFS)
+    size_t *a;
+    string *b;
+    counted *c;
+    std::tie(a, b, c)=NewBatch(0, (size_t) 7, string("nedmalloc"), counted(9));
+    if(*a!=7 || *b!="nedmalloc" || c->value!=9 || counted::live!=1) abort();
+    if((char *) b<=(char *) a || (char *) c<=(char *) b || (char *) c-(char *) a>256) abort();
+    Delete(a);
+    Delete(b);
+    Delete(c);
+    if(counted::live!=0) abort();
+#endif
+  }
+
+  // Every form of new and delete goes to nedmalloc
+  printf("Testing: Replacement operators new and delete ...\n");
+  {
+    struct big { char c[4096]; };
+    int isforeign=1;
+    size_t huge=(size_t)-1/4;
+    int *a=new int(5), *b=new int[100], *c=new(nothrow) int;
+    big *d=new big;
+    if(!nedblksize(&isforeign, a) || isforeign || !nedblksize(&isforeign, b) || isforeign) abort();
+    if(!nedblksize(&isforeign, c) || isforeign || !nedblksize(&isforeign, d) || isforeign) abort();
+    delete a;
+    delete[] b;
+    delete c;
+    delete d;
+    // Stored through volatile so the optimiser can't elide the allocations
+    char *volatile e=new(nothrow) char[huge];
+    if(e) abort();
+    try
+    {
+      e=new char[huge];
+      delete[] e;
+      abort();
+    }
+    catch(bad_alloc &) { }
+#ifdef __cpp_aligned_new
+    struct alignas(256) simd { float f[64]; };
+    simd *f=new simd, *g=new simd[3], *h=new(nothrow) simd;
+    if(((size_t) f & 255) || ((size_t) g & 255) || ((size_t) h & 255)) abort();
+    if(!nedblksize(&isforeign, f) || isforeign || nedblksize(&isforeign, g)<3*sizeof(simd) || isforeign) abort();
+    delete f;
+    delete[] g;
+    delete h;
+#endif
+  }
+
+#ifdef HAVE_CPP17MEMORYRESOURCE
+  // pmr containers allocate from and return their memory to the pool
+  printf("Testing: pool_resource and monotonic_pool_resource ...\n");
+  {
+    nedpool *pool=nedcreatepool(0, 1);
+    struct nedstats *stats=new struct nedstats;
+    size_t baseline, settled;
+    if(!pool) abort();
+    if(!nedpgetstats(pool, stats)) abort();
+    baseline=stats->inuse;
+    {
+      pool_resource res(pool), res2(pool), other;
+      if(res.get_pool()!=pool || !res.is_equal(res2) || res.is_equal(other)) abort();
+      std::pmr::vector<unsigned> v(&res);
+      for(unsigned n=0; n<100000; n++)
+        v.push_back(n);
+      void *aligned=res.allocate(1000, 4096);
+      if((size_t) aligned & 4095) abort();
+      if(!nedpgetstats(pool, stats)) abort();
+      if(stats->inuse<baseline+100000*sizeof(unsigned)) abort();
+      res.deallocate(aligned, 1000, 4096);
+    }
+    // Freed large blocks may stay in the pool's mmap cache, which counts as in use
+    if(!nedpgetstats(pool, stats)) abort();
+    settled=stats->inuse;
+    {
+      monotonic_pool_resource mres(pool, 1024);
+      std::pmr::vector<std::pmr::vector<char> > vv(&mres);
+      for(size_t n=0; n<1000; n++)
+        vv.emplace_back(n, 'x');
+      if(mres.get_pool()!=pool || vv.back().get_allocator().resource()!=&mres) abort();
+      if(!nedpgetstats(pool, stats)) abort();
+      if(stats->inuse<settled+500*1000) abort();
+    }
+    if(!nedpgetstats(pool, stats)) abort();
+    if(stats->inuse>settled+64*1024) abort();
+    delete stats;
+    neddestroypool(pool);
+  }
+#endif
+
 #ifdef _MSC_VER
 		printf("\nPress a key to end\n");
 		getchar();